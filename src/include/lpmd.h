@@ -107,6 +107,9 @@ struct message_capsul_t {
 #define MAX_CONFIG_STATES	10
 #define MAX_STATE_NAME		32
 #define MAX_CONFIG_LEN		64
+#define MAX_IRQ_RULES		16	/* At most 32, matched rules are a bitmap */
+#define MAX_PROXY_STATES	8
+#define MAX_PROXY_RULES		16
 
 enum lpmd_states {
 	LPMD_OFF,
@@ -150,6 +153,12 @@ enum core_type {
 	L_CORE
 };
 
+/* How the cores counted by ActivePcores/ActiveEcores/ActiveLcores are used */
+enum smt_policy {
+	SMT_POLICY_FILL,	/* Use all the threads of each selected core */
+	SMT_POLICY_SINGLE,	/* Use one thread per core, park its siblings */
+};
+
 struct lpmd_config_state_t {
 	int id;
 	int valid;
@@ -174,6 +183,10 @@ struct lpmd_config_state_t {
 	char active_p_cores[MAX_STR_LENGTH];
 	char active_e_cores[MAX_STR_LENGTH];
 	char active_l_cores[MAX_STR_LENGTH];
+	int smt_policy;
+	/* Place by HFI ranking: the N most efficient CPUs, above X% perf */
+	int hfi_most_efficient;
+	int hfi_min_perf;
 
 	int itmt_state;
 	int irq_migrate;
@@ -191,6 +204,40 @@ struct lpmd_config_state_t {
 	int steady;
 };
 
+enum irq_policy {
+	IRQ_POLICY_FOLLOW,	/* Follow the state cpumask */
+	IRQ_POLICY_KEEP,	/* Keep on the P-cores */
+	IRQ_POLICY_SPREAD,	/* Pin each IRQ to a single CPU of the state cpumask */
+};
+
+/* Per-IRQ placement rule, matched by action name or PCI driver */
+struct lpmd_irq_rule {
+	char name[MAX_STATE_NAME];
+	char driver[MAX_STATE_NAME];
+	int policy;
+	/* Config state IDs the rule applies to, all states if empty */
+	int nr_state_ids;
+	int state_ids[MAX_CONFIG_STATES];
+};
+
+/* WLT proxy state transition, compiled by the proxy at init */
+struct lpmd_proxy_rule {
+	char when[MAX_STR_LENGTH];	/* "var op value" terms, comma separated */
+	char target[MAX_STATE_NAME];
+	char guard[MAX_STATE_NAME];
+	char stay_count[MAX_STATE_NAME];
+	int strikes;
+};
+
+/* WLT proxy state overrides, -1 or no rules keep the built-in ones */
+struct lpmd_proxy_state {
+	char name[MAX_STATE_NAME];
+	int poll_ms;
+	int stay_ms;
+	int nr_rules;
+	struct lpmd_proxy_rule rules[MAX_PROXY_RULES];
+};
+
 // lpmd config data
 struct lpmd_config_t {
 	int mode;
@@ -198,10 +245,15 @@ struct lpmd_config_t {
 	int balanced_def;
 	int powersaver_def;
 	int hfi_lpm_enable;
+	/* HFI updates are coalesced for hfi_coalesce_ms, applied hfi_dwell_ms apart */
+	int hfi_coalesce_ms;
+	int hfi_dwell_ms;
 	int wlt_hint_enable;
 	int wlt_notification_delay;
 	int wlt_hint_poll_enable;
 	int wlt_proxy_enable;
+	int wlt_proxy_confine;
+	int wlt_proxy_burst_wake;
 	int wlt_hint_mask;
 
 	union {
@@ -236,8 +288,13 @@ struct lpmd_config_t {
 	int slider_offset_def_dc;
 
 	struct lpmd_config_state_t config_states[MAX_STATES];
+	int irq_rule_count;
+	struct lpmd_irq_rule irq_rules[MAX_IRQ_RULES];
+	/* Native IRQ balancing imbalance threshold in percent, 0 to disable */
+	int irq_balance_threshold;
+	int proxy_state_count;
+	struct lpmd_proxy_state proxy_states[MAX_PROXY_STATES];
 	struct lpmd_data_t data;
-	unsigned char *core_type_masks[CORE_TYPES_COUNT];
 };
 
 enum lpm_cpu_process_mode {
@@ -245,18 +302,24 @@ enum lpm_cpu_process_mode {
 	LPM_CPU_ISOLATE,
 	LPM_CPU_POWERCLAMP,
 	LPM_CPU_OFFLINE,
-	LPM_CPU_MODE_MAX = LPM_CPU_POWERCLAMP,
+	LPM_CPU_MODE_MAX = LPM_CPU_OFFLINE,
 };
 
-#define NUM_USER_CPUMASKS	10
+/* config states, plus the WLT proxy modes */
+#define NUM_USER_CPUMASKS	16
 enum cpumask_idx {
 	CPUMASK_LPM_DEFAULT,
 	CPUMASK_ONLINE,
 	CPUMASK_HFI,
 	CPUMASK_HFI_BANNED,
 	CPUMASK_HFI_LAST,
+	CPUMASK_HFI_PENDING,
 	CPUMASK_UTIL,
 	CPUMASK_BLACKLIST,
+	CPUMASK_OFFLINE,
+	CPUMASK_PCORE,
+	CPUMASK_ECORE,
+	CPUMASK_LCORE,
 	CPUMASK_USER,
 	CPUMASK_MAX = CPUMASK_USER + NUM_USER_CPUMASKS,
 	CPUMASK_NONE = CPUMASK_MAX,
@@ -343,9 +406,22 @@ int lpmd_enter_next_state(void);
 int util_update(struct lpmd_config_t *lpmd_config);
 
 /* lpmd_hfi.c */
+struct hfi_stats {
+	unsigned int updates;	/* Complete capacity updates received */
+	unsigned int applied;	/* Transitions applied */
+	unsigned int absorbed;	/* Transitions superseded or reverted before being applied */
+	unsigned int dropped;	/* Updates not received in full */
+	unsigned int resyncs;	/* Receive buffer overflows */
+};
+
 int hfi_init(void);
 int hfi_kill(void);
 int hfi_update(void);
+int hfi_pending_timeout(int timeout);
+int hfi_apply_pending(void);
+int hfi_init_ranked_state(struct lpmd_config_state_t *state);
+void hfi_get_stats(struct hfi_stats *stats);
+int hfi_replay(const char *path, const char *config_file, int loops);
 
 /* lpmd_wlt.c */
 int wlt_init(void);
@@ -369,11 +445,14 @@ void process_slider(struct lpmd_config_t *config, struct lpmd_config_state_t *st
 /* lpmd_irq.c */
 int irq_init(void);
 int process_irq(struct lpmd_config_state_t *state);
+int irq_balance_timeout(int timeout);
+int irq_balance_update(void);
+void irq_table_invalidate(void);
 
 /* lpmd_cgroup.c*/
 int cgroup_init(struct lpmd_config_t *config);
 int cgroup_cleanup(void);
-int process_cgroup(struct lpmd_config_state_t *state, enum lpm_cpu_process_mode mode);
+int process_cgroup(enum cpumask_idx idx, enum lpm_cpu_process_mode mode);
 
 /* lpmd_uevent.c */
 int uevent_init(void);
@@ -387,6 +466,10 @@ int get_tdp(void);
 
 int is_cpu_ecore(int cpu);
 int is_cpu_pcore(int cpu);
+int get_cpu_core_id(int cpu);
+
+int process_cpu_offline(enum cpumask_idx idx);
+int cpu_offline_restore(void);
 
 /* lpmd_cpumask.c */
 int is_cpu_online(int cpu);
@@ -399,15 +482,17 @@ int cpu_clear_affinity(void);
 
 int cpumask_alloc(void);
 int cpumask_free(enum cpumask_idx idx);
+int cpumask_intern(enum cpumask_idx idx);
+unsigned long long cpumask_version(enum cpumask_idx idx);
 int cpumask_reset(enum cpumask_idx idx);
 
-void free_cpu_type_masks(struct lpmd_config_t *lpmd_config);
-int allocate_cpu_type_masks(struct lpmd_config_t *lpmd_config);
-
 int cpumask_add_cpu(int cpu, enum cpumask_idx idx);
+int cpumask_clear_cpu(int cpu, enum cpumask_idx idx);
+int cpumask_test_cpu(int cpu, enum cpumask_idx idx);
+int cpumask_next(int cpu, enum cpumask_idx idx);
 int cpumask_blacklist(enum cpumask_idx idx);
 int cpumask_init_cpus(char *buf, enum cpumask_idx idx);
-int cpumask_init_cpus_type(char *buf, enum cpumask_idx idx, unsigned char **cmasks, enum core_type type);
+int cpumask_init_cpus_type(char *buf, enum cpumask_idx idx, enum core_type type, int smt_policy);
 int cpumask_nr_cpus(enum cpumask_idx idx);
 int cpumask_has_cpu(enum cpumask_idx idx);
 
@@ -415,12 +500,12 @@ int cpumask_equal(enum cpumask_idx idx1, enum cpumask_idx idx2);
 void cpumask_copy(enum cpumask_idx source, enum cpumask_idx dest);
 void cpumask_exclude_copy(enum cpumask_idx source, enum cpumask_idx dest, enum cpumask_idx exclude);
 
-char *get_cpus_str(enum cpumask_idx idx, bool refresh);
-char *get_cpus_hexstr(enum cpumask_idx idx, bool refresh);
+char *get_cpus_str(enum cpumask_idx idx);
+char *get_cpus_hexstr(enum cpumask_idx idx);
 char *get_proc_irq_str(enum cpumask_idx idx);
 char *get_irqbalance_str(enum cpumask_idx idx);
 char *get_cpu_isolation_str(enum cpumask_idx idx);
-uint8_t *get_cgroup_systemd_vals(enum cpumask_idx idx);
+uint8_t *get_cgroup_systemd_vals(enum cpumask_idx idx, int *size);
 
 /* socket.c */
 int socket_init_connection(char *name);
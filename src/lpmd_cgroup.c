@@ -100,10 +100,10 @@ finish:
 
 static int restore_systemd_cgroup(void)
 {
-	int size = get_max_cpus() / 8;
 	uint8_t *vals;
+	int size;
 
-	vals = get_cgroup_systemd_vals(CPUMASK_ONLINE);
+	vals = get_cgroup_systemd_vals(CPUMASK_ONLINE, &size);
 	if (!vals)
 		return -1;
 
@@ -114,13 +114,12 @@ static int restore_systemd_cgroup(void)
 	return 0;
 }
 
-static int update_systemd_cgroup(struct lpmd_config_state_t *state)
+static int update_systemd_cgroup(enum cpumask_idx idx)
 {
-	int size = get_max_cpus() / 8;
 	uint8_t *vals;
-	int ret;
+	int size, ret;
 
-	vals = get_cgroup_systemd_vals(state->cpumask_idx);
+	vals = get_cgroup_systemd_vals(idx, &size);
 	if (!vals)
 		return -1;
 
@@ -143,32 +142,33 @@ restore:
 	return ret;
 }
 
-static int process_cpu_cgroupv2(struct lpmd_config_state_t *state)
+static int process_cpu_cgroupv2(enum cpumask_idx idx)
 {
-	if (cpumask_equal(state->cpumask_idx, CPUMASK_ONLINE)) {
+	if (cpumask_equal(idx, CPUMASK_ONLINE)) {
 		restore_systemd_cgroup();
 		return lpmd_write_str(PATH_CG2_SUBTREE_CONTROL, "-cpuset", LPMD_LOG_DEBUG);
 	}
 
 	if (lpmd_write_str(PATH_CG2_SUBTREE_CONTROL, "+cpuset", LPMD_LOG_DEBUG))
 		return 1;
-	return update_systemd_cgroup(state);
+	return update_systemd_cgroup(idx);
 }
 
-static enum cpumask_idx last_applied_cpumask = CPUMASK_NONE;
+/* cpumask_version() of the last applied cpumask, 0 if none */
+static unsigned long long last_applied_version;
 
 /* Support for cgroup based cpu isolation */
-static int process_cpu_isolate(struct lpmd_config_state_t *state)
+static int process_cpu_isolate(enum cpumask_idx idx)
 {
 	if (lpmd_write_str("/sys/fs/cgroup/lpm/cpuset.cpus.partition", "member", LPMD_LOG_DEBUG))
 		return 1;
 
-	if (!cpumask_equal(state->cpumask_idx, CPUMASK_ONLINE)) {
-		if (lpmd_write_str("/sys/fs/cgroup/lpm/cpuset.cpus.exclusive", get_cpu_isolation_str(state->cpumask_idx), LPMD_LOG_DEBUG))
+	if (!cpumask_equal(idx, CPUMASK_ONLINE)) {
+		if (lpmd_write_str("/sys/fs/cgroup/lpm/cpuset.cpus.exclusive", get_cpu_isolation_str(idx), LPMD_LOG_DEBUG))
 			return 1;
 		if (lpmd_write_str("/sys/fs/cgroup/lpm/cpuset.cpus.partition", "isolated", LPMD_LOG_DEBUG))
 			return 1;
-		if (lpmd_write_str("/sys/fs/cgroup/lpm/cpuset.cpus", get_cpu_isolation_str(state->cpumask_idx), LPMD_LOG_DEBUG))
+		if (lpmd_write_str("/sys/fs/cgroup/lpm/cpuset.cpus", get_cpu_isolation_str(idx), LPMD_LOG_DEBUG))
 			return 1;
 	} else {
 		if (lpmd_write_str("/sys/fs/cgroup/lpm/cpuset.cpus", get_cpu_isolation_str(CPUMASK_ONLINE), LPMD_LOG_DEBUG))
@@ -182,7 +182,8 @@ int cgroup_cleanup(void)
 {
 	DIR *dir;
 
-	last_applied_cpumask = CPUMASK_NONE;
+	last_applied_version = 0;
+	cpu_offline_restore();
 	dir = opendir("/sys/fs/cgroup/lpm");
 	if (dir) {
 		closedir(dir);
@@ -201,30 +202,32 @@ int cgroup_init(struct lpmd_config_t *config)
 	return 0;
 }
 
-int process_cgroup(struct lpmd_config_state_t *state, enum lpm_cpu_process_mode mode)
+int process_cgroup(enum cpumask_idx idx, enum lpm_cpu_process_mode mode)
 {
 	int ret;
 
-	if (state->cpumask_idx == CPUMASK_NONE) {
+	if (idx == CPUMASK_NONE) {
 		lpmd_log_debug("Ignore cgroup processing\n");
 		return 0;
 	}
 
-	if (last_applied_cpumask != CPUMASK_NONE &&
-	    cpumask_equal(state->cpumask_idx, last_applied_cpumask)) {
+	/* States with identical cpumasks share the interned one */
+	if (cpumask_version(idx) == last_applied_version) {
 		lpmd_log_debug("Skip cgroup: cpumask unchanged\n");
 		return 0;
 	}
 
 	lpmd_log_info ("Process Cgroup ...\n");
 	if (mode == LPM_CPU_CGROUPV2)
-		ret = process_cpu_cgroupv2(state);
+		ret = process_cpu_cgroupv2(idx);
 	else if (mode == LPM_CPU_ISOLATE)
-		ret = process_cpu_isolate(state);
+		ret = process_cpu_isolate(idx);
+	else if (mode == LPM_CPU_OFFLINE)
+		ret = process_cpu_offline(idx);
 	else
 		ret = 0;
 
 	if (!ret)
-		last_applied_cpumask = state->cpumask_idx;
+		last_applied_version = cpumask_version(idx);
 	return ret;
 }
@@ -2,6 +2,7 @@
 /* Copyright (C) 2026 Intel Corporation */
 
 #include "lpmd.h"
+#include <ctype.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 
@@ -157,6 +158,27 @@ static void lpmd_parse_state(xmlDoc *doc, xmlNode *a_node, struct lpmd_config_t
 			save_string_or_zero(tmp_value, state->active_e_cores, sizeof(state->active_e_cores));
 		if (!strncmp((const char *)cur_node->name, "ActiveLcores", strlen("ActiveLcores")))
 			save_string_or_zero(tmp_value, state->active_l_cores, sizeof(state->active_l_cores));
+		if (!strncmp((const char *)cur_node->name, "SMTPolicy", strlen("SMTPolicy"))) {
+			state->smt_policy = strtol(tmp_value, &pos, 10);
+			if (state->smt_policy != SMT_POLICY_FILL && state->smt_policy != SMT_POLICY_SINGLE) {
+				lpmd_log_error("Invalid SMTPolicy %s for state %d\n", tmp_value, state->id);
+				state->smt_policy = SMT_POLICY_FILL;
+			}
+		}
+		if (!strncmp((const char *)cur_node->name, "HfiMostEfficient", strlen("HfiMostEfficient"))) {
+			state->hfi_most_efficient = strtol(tmp_value, &pos, 10);
+			if (state->hfi_most_efficient < 0) {
+				lpmd_log_error("Invalid HfiMostEfficient %s for state %d\n", tmp_value, state->id);
+				state->hfi_most_efficient = 0;
+			}
+		}
+		if (!strncmp((const char *)cur_node->name, "HfiMinPerf", strlen("HfiMinPerf"))) {
+			state->hfi_min_perf = strtol(tmp_value, &pos, 10);
+			if (state->hfi_min_perf < 0 || state->hfi_min_perf > 100) {
+				lpmd_log_error("Invalid HfiMinPerf %s for state %d\n", tmp_value, state->id);
+				state->hfi_min_perf = 0;
+			}
+		}
 		if (!strncmp((const char *)cur_node->name, "ActiveCPUs", strlen("ActiveCPUs")))
 			save_string_or_zero(tmp_value, state->active_cpus, sizeof(state->active_cpus));
 		if (!strncmp((const char *)cur_node->name, "BalanceSliderAC", strlen("BalanceSliderAC")))
@@ -259,6 +281,229 @@ static void lpmd_parse_states(xmlDoc *doc, xmlNode *a_node, struct lpmd_config_t
 	lpmd_config->config_state_count = config_state_count;
 }
 
+/* Save an IRQ match string, without the surrounding spaces */
+static void save_irq_match(char *tmp_value, char *dst_string, int dest_size)
+{
+	int len;
+
+	copy_user_string(tmp_value, dst_string, dest_size - 1);
+	len = strlen(dst_string);
+	while (len && isspace(dst_string[len - 1]))
+		dst_string[--len] = '\0';
+}
+
+static int lpmd_parse_irq_rule(xmlDoc *doc, xmlNode *a_node, struct lpmd_irq_rule *rule)
+{
+	xmlNode *cur_node = NULL;
+	char *tmp_value;
+	char *pos;
+
+	memset(rule, 0, sizeof(*rule));
+
+	for (cur_node = a_node; cur_node; cur_node = cur_node->next) {
+		if (cur_node->type != XML_ELEMENT_NODE)
+			continue;
+
+		tmp_value = (char *)xmlNodeListGetString(doc, cur_node->xmlChildrenNode, 1);
+		if (!tmp_value)
+			continue;
+
+		if (!strncmp((const char *)cur_node->name, "Name", strlen("Name"))) {
+			save_irq_match(tmp_value, rule->name, sizeof(rule->name));
+		} else if (!strncmp((const char *)cur_node->name, "Driver", strlen("Driver"))) {
+			save_irq_match(tmp_value, rule->driver, sizeof(rule->driver));
+		} else if (!strncmp((const char *)cur_node->name, "Policy", strlen("Policy"))) {
+			errno = 0;
+			rule->policy = strtol(tmp_value, &pos, 10);
+			if (errno || rule->policy < IRQ_POLICY_FOLLOW ||
+			    rule->policy > IRQ_POLICY_SPREAD) {
+				lpmd_log_error("Invalid IRQ rule Policy %s\n", tmp_value);
+				xmlFree(tmp_value);
+				return LPMD_ERROR;
+			}
+		} else if (!strncmp((const char *)cur_node->name, "StateIDs", strlen("StateIDs"))) {
+			pos = tmp_value;
+			while (*pos && rule->nr_state_ids < MAX_CONFIG_STATES) {
+				char *end;
+				int id;
+
+				id = strtol(pos, &end, 10);
+				if (end == pos)
+					break;
+				rule->state_ids[rule->nr_state_ids++] = id;
+				pos = end;
+				while (*pos == ',' || isspace(*pos))
+					pos++;
+			}
+		}
+		xmlFree(tmp_value);
+	}
+
+	if (!rule->name[0] && !rule->driver[0]) {
+		lpmd_log_error("IRQ rule without Name or Driver\n");
+		return LPMD_ERROR;
+	}
+
+	return LPMD_SUCCESS;
+}
+
+static int lpmd_parse_irq_rules(xmlDoc *doc, xmlNode *a_node, struct lpmd_config_t *lpmd_config)
+{
+	xmlNode *cur_node = NULL;
+
+	for (cur_node = a_node; cur_node; cur_node = cur_node->next) {
+		if (cur_node->type != XML_ELEMENT_NODE)
+			continue;
+
+		if (strncmp((const char *)cur_node->name, "Rule", strlen("Rule")))
+			continue;
+
+		if (lpmd_config->irq_rule_count >= MAX_IRQ_RULES) {
+			lpmd_log_warn("Too many IRQ rules, ignore the rest\n");
+			break;
+		}
+
+		if (lpmd_parse_irq_rule(doc, cur_node->children,
+					&lpmd_config->irq_rules[lpmd_config->irq_rule_count]))
+			return LPMD_ERROR;
+		lpmd_config->irq_rule_count++;
+	}
+	lpmd_log_debug("Found %d IRQ rules\n", lpmd_config->irq_rule_count);
+
+	return LPMD_SUCCESS;
+}
+
+static int lpmd_parse_proxy_rule(xmlDoc *doc, xmlNode *a_node, struct lpmd_proxy_rule *rule)
+{
+	xmlNode *cur_node = NULL;
+	char *tmp_value;
+	char *pos;
+
+	memset(rule, 0, sizeof(*rule));
+	rule->strikes = -1;
+
+	for (cur_node = a_node; cur_node; cur_node = cur_node->next) {
+		if (cur_node->type != XML_ELEMENT_NODE)
+			continue;
+
+		tmp_value = (char *)xmlNodeListGetString(doc, cur_node->xmlChildrenNode, 1);
+		if (!tmp_value)
+			continue;
+
+		if (!strncmp((const char *)cur_node->name, "When", strlen("When"))) {
+			snprintf(rule->when, sizeof(rule->when), "%s", tmp_value);
+		} else if (!strncmp((const char *)cur_node->name, "Target", strlen("Target"))) {
+			sscanf(tmp_value, "%31s", rule->target);
+		} else if (!strncmp((const char *)cur_node->name, "Guard", strlen("Guard"))) {
+			sscanf(tmp_value, "%31s", rule->guard);
+		} else if (!strncmp((const char *)cur_node->name, "StayCount", strlen("StayCount"))) {
+			sscanf(tmp_value, "%31s", rule->stay_count);
+		} else if (!strncmp((const char *)cur_node->name, "Strikes", strlen("Strikes"))) {
+			errno = 0;
+			rule->strikes = strtol(tmp_value, &pos, 10);
+			if (errno || rule->strikes < 0 || rule->strikes > 1000) {
+				lpmd_log_error("Invalid proxy Strikes %s\n", tmp_value);
+				xmlFree(tmp_value);
+				return LPMD_ERROR;
+			}
+		}
+		xmlFree(tmp_value);
+	}
+
+	if (!rule->target[0]) {
+		lpmd_log_error("Proxy transition without Target\n");
+		return LPMD_ERROR;
+	}
+
+	return LPMD_SUCCESS;
+}
+
+static int lpmd_parse_proxy_state(xmlDoc *doc, xmlNode *a_node, struct lpmd_proxy_state *state)
+{
+	xmlNode *cur_node = NULL;
+	char *tmp_value;
+	char *pos;
+
+	memset(state, 0, sizeof(*state));
+	state->poll_ms = -1;
+	state->stay_ms = -1;
+
+	for (cur_node = a_node; cur_node; cur_node = cur_node->next) {
+		if (cur_node->type != XML_ELEMENT_NODE)
+			continue;
+
+		if (!strncmp((const char *)cur_node->name, "Transition", strlen("Transition"))) {
+			if (state->nr_rules >= MAX_PROXY_RULES) {
+				lpmd_log_error("Too many proxy transitions\n");
+				return LPMD_ERROR;
+			}
+			if (lpmd_parse_proxy_rule(doc, cur_node->children,
+						  &state->rules[state->nr_rules]))
+				return LPMD_ERROR;
+			state->nr_rules++;
+			continue;
+		}
+
+		tmp_value = (char *)xmlNodeListGetString(doc, cur_node->xmlChildrenNode, 1);
+		if (!tmp_value)
+			continue;
+
+		if (!strncmp((const char *)cur_node->name, "Name", strlen("Name"))) {
+			sscanf(tmp_value, "%31s", state->name);
+		} else if (!strncmp((const char *)cur_node->name, "PollMS", strlen("PollMS"))) {
+			errno = 0;
+			state->poll_ms = strtol(tmp_value, &pos, 10);
+			if (errno || state->poll_ms <= 0 || state->poll_ms > UTIL_DELAY_MAX) {
+				lpmd_log_error("Invalid proxy PollMS %s\n", tmp_value);
+				xmlFree(tmp_value);
+				return LPMD_ERROR;
+			}
+		} else if (!strncmp((const char *)cur_node->name, "StayMS", strlen("StayMS"))) {
+			errno = 0;
+			state->stay_ms = strtol(tmp_value, &pos, 10);
+			if (errno || state->stay_ms < 0 || state->stay_ms > UTIL_HYST_MAX) {
+				lpmd_log_error("Invalid proxy StayMS %s\n", tmp_value);
+				xmlFree(tmp_value);
+				return LPMD_ERROR;
+			}
+		}
+		xmlFree(tmp_value);
+	}
+
+	if (!state->name[0]) {
+		lpmd_log_error("Proxy state without Name\n");
+		return LPMD_ERROR;
+	}
+
+	return LPMD_SUCCESS;
+}
+
+static int lpmd_parse_proxy_states(xmlDoc *doc, xmlNode *a_node, struct lpmd_config_t *lpmd_config)
+{
+	xmlNode *cur_node = NULL;
+
+	for (cur_node = a_node; cur_node; cur_node = cur_node->next) {
+		if (cur_node->type != XML_ELEMENT_NODE)
+			continue;
+
+		if (strncmp((const char *)cur_node->name, "ProxyState", strlen("ProxyState")))
+			continue;
+
+		if (lpmd_config->proxy_state_count >= MAX_PROXY_STATES) {
+			lpmd_log_warn("Too many proxy states, ignore the rest\n");
+			break;
+		}
+
+		if (lpmd_parse_proxy_state(doc, cur_node->children,
+					   &lpmd_config->proxy_states[lpmd_config->proxy_state_count]))
+			return LPMD_ERROR;
+		lpmd_config->proxy_state_count++;
+	}
+	lpmd_log_debug("Found %d proxy states\n", lpmd_config->proxy_state_count);
+
+	return LPMD_SUCCESS;
+}
+
 static void lpmd_init_config(struct lpmd_config_t *config)
 {
 	config->performance_def = LPM_FORCE_OFF;
@@ -275,6 +520,8 @@ static void lpmd_init_config(struct lpmd_config_t *config)
 	config->slider_offset_def_dc = -1;
 	config->wlt_hint_mask = -1;
 	config->wlt_notification_delay = -1;
+	config->irq_rule_count = 0;
+	config->proxy_state_count = 0;
 }
 
 static int lpmd_fill_config(xmlDoc *doc, xmlNode *a_node, struct lpmd_config_t *lpmd_config)
@@ -342,6 +589,24 @@ static int lpmd_fill_config(xmlDoc *doc, xmlNode *a_node, struct lpmd_config_t *
 			    (lpmd_config->wlt_proxy_enable != 1 &&
 			     lpmd_config->wlt_proxy_enable != 0))
 				goto err;
+		} else if (!strncmp((const char *)cur_node->name,
+				    "WLTProxyConfine",
+				    strlen("WLTProxyConfine"))) {
+			errno = 0;
+			lpmd_config->wlt_proxy_confine = strtol(tmp_value, &pos, 10);
+			if (errno || *pos != '\0' ||
+			    (lpmd_config->wlt_proxy_confine != 1 &&
+			     lpmd_config->wlt_proxy_confine != 0))
+				goto err;
+		} else if (!strncmp((const char *)cur_node->name,
+				    "WLTProxyBurstWake",
+				    strlen("WLTProxyBurstWake"))) {
+			errno = 0;
+			lpmd_config->wlt_proxy_burst_wake = strtol(tmp_value, &pos, 10);
+			if (errno || *pos != '\0' ||
+			    (lpmd_config->wlt_proxy_burst_wake != 1 &&
+			     lpmd_config->wlt_proxy_burst_wake != 0))
+				goto err;
 		} else if (!strncmp((const char *)cur_node->name,
 				    "EntryDelayMS", strlen("EntryDelayMS"))) {
 			errno = 0;
@@ -464,6 +729,38 @@ static int lpmd_fill_config(xmlDoc *doc, xmlNode *a_node, struct lpmd_config_t *
 				    strlen("States"))) {
 			errno = 0;
 			lpmd_parse_states(doc, cur_node->children, lpmd_config);
+		} else if (!strncmp((const char *)cur_node->name, "IRQRules",
+				    strlen("IRQRules"))) {
+			if (lpmd_parse_irq_rules(doc, cur_node->children, lpmd_config))
+				goto err;
+		} else if (!strncmp((const char *)cur_node->name, "WLTProxyStates",
+				    strlen("WLTProxyStates"))) {
+			if (lpmd_parse_proxy_states(doc, cur_node->children, lpmd_config))
+				goto err;
+		} else if (!strncmp((const char *)cur_node->name, "IRQBalanceThreshold",
+				    strlen("IRQBalanceThreshold"))) {
+			errno = 0;
+			lpmd_config->irq_balance_threshold = strtol(tmp_value, &pos, 10);
+			if (errno || *pos != '\0' ||
+			    lpmd_config->irq_balance_threshold < 0 ||
+			    lpmd_config->irq_balance_threshold > 1000)
+				goto err;
+		} else if (!strncmp((const char *)cur_node->name, "HfiCoalesceMS",
+				    strlen("HfiCoalesceMS"))) {
+			errno = 0;
+			lpmd_config->hfi_coalesce_ms = strtol(tmp_value, &pos, 10);
+			if (errno || *pos != '\0' ||
+			    lpmd_config->hfi_coalesce_ms < 0 ||
+			    lpmd_config->hfi_coalesce_ms > UTIL_DELAY_MAX)
+				goto err;
+		} else if (!strncmp((const char *)cur_node->name, "HfiDwellMS",
+				    strlen("HfiDwellMS"))) {
+			errno = 0;
+			lpmd_config->hfi_dwell_ms = strtol(tmp_value, &pos, 10);
+			if (errno || *pos != '\0' ||
+			    lpmd_config->hfi_dwell_ms < 0 ||
+			    lpmd_config->hfi_dwell_ms > UTIL_HYST_MAX)
+				goto err;
 		} else if (!strncmp((const char *)cur_node->name, "BalancedSliderAC", strlen("BalancedSliderAC"))) {
 			if (read_slider_and_validate(&lpmd_config->balance_slider_def_ac,
 						     tmp_value, "BalancedSliderAC", -1, SLIDER_TYPE_BALANCE) != 0)
@@ -268,33 +268,143 @@ int get_tdp(void)
 	return tdp / 1000000;
 }
 
-#define BITMASK_SIZE 32
-int detect_max_cpus(void)
+/* SMT topology of each CPU, read once while all CPUs are online */
+struct cpu_topology {
+	int core_id;		/* First thread of the core */
+	int nr_siblings;	/* Threads of the core, including this one */
+};
+
+static struct cpu_topology *cpu_topo;
+
+/* Parse a cpulist like "0-1" or "0,64", returning the first CPU and the count */
+static int parse_siblings_list(char *str, int *first)
 {
-	unsigned long dummy;
-	int max_cpus, i;
+	int start, end, nr = 0;
+	char *next;
+
+	*first = -1;
+	while (*str) {
+		start = strtol(str, &next, 10);
+		if (next == str)
+			break;
+		end = start;
+		if (*next == '-') {
+			str = next + 1;
+			end = strtol(str, &next, 10);
+			if (next == str || end < start)
+				break;
+		}
+		if (*first < 0 || start < *first)
+			*first = start;
+		nr += end - start + 1;
+		if (*next != ',')
+			break;
+		str = next + 1;
+	}
+
+	return nr;
+}
+
+static int detect_smt_siblings(void)
+{
+	char path[MAX_STR_LENGTH];
+	char str[MAX_STR_LENGTH];
 	FILE *filep;
+	int i, first;
 
-	max_cpus = 0;
-	for (i = 0; i < 256; ++i) {
-		char path[MAX_STR_LENGTH];
+	free(cpu_topo);
+	cpu_topo = calloc(get_max_cpus(), sizeof(*cpu_topo));
+	if (!cpu_topo)
+		return -1;
 
-		snprintf(path, sizeof(path),
-			 "/sys/devices/system/cpu/cpu%d/topology/thread_siblings", i);
+	for (i = 0; i < get_max_cpus(); i++) {
+		cpu_topo[i].core_id = i;
+		cpu_topo[i].nr_siblings = 1;
+
+		if (!is_cpu_online(i))
+			continue;
 
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", i);
 		filep = fopen(path, "r");
-		if (filep)
-			break;
+		if (!filep)
+			continue;
+
+		if (fgets(str, sizeof(str), filep)) {
+			int nr = parse_siblings_list(str, &first);
+
+			if (nr > 0 && first >= 0 && first <= i) {
+				cpu_topo[i].core_id = first;
+				cpu_topo[i].nr_siblings = nr;
+			}
+		}
+		fclose(filep);
 	}
+	return 0;
+}
 
-	if (!filep) {
-		lpmd_log_error("Can't get max cpu number\n");
+/* Physical core of @cpu, identified by its first SMT thread */
+int get_cpu_core_id(int cpu)
+{
+	if (!cpu_topo || cpu < 0 || cpu >= get_max_cpus())
+		return cpu;
+
+	return cpu_topo[cpu].core_id;
+}
+
+static int is_smt_secondary(int cpu)
+{
+	return get_cpu_core_id(cpu) != cpu;
+}
+
+/* Highest CPU in a cpulist file like "0-3,8-11", -1 on failure */
+static int read_cpulist_last(const char *path)
+{
+	char *line = NULL, *str, *next;
+	size_t size = 0;
+	FILE *filep;
+	int cpu, last = -1;
+
+	filep = fopen(path, "r");
+	if (!filep)
 		return -1;
+
+	if (getline(&line, &size, filep) > 0) {
+		for (str = line; *str; str = next) {
+			cpu = strtol(str, &next, 10);
+			if (next == str)
+				break;
+			if (cpu > last)
+				last = cpu;
+			if (*next == ',' || *next == '-')
+				next++;
+		}
 	}
 
-	while (fscanf(filep, "%lx,", &dummy) == 1)
-		max_cpus += BITMASK_SIZE;
+	free(line);
 	fclose(filep);
+	return last;
+}
+
+/*
+ * Size the cpumasks for all the CPUs the kernel may ever bring up, so
+ * that CPUs hotplugged later and holes in the numbering fit.
+ */
+int detect_max_cpus(void)
+{
+	int possible, present, max_cpus;
+
+	possible = read_cpulist_last("/sys/devices/system/cpu/possible");
+	present = read_cpulist_last("/sys/devices/system/cpu/present");
+
+	max_cpus = (possible > present ? possible : present) + 1;
+	if (max_cpus <= 0)
+		max_cpus = sysconf(_SC_NPROCESSORS_CONF);
+
+	if (max_cpus <= 0) {
+		lpmd_log_error("Can't get max cpu number\n");
+		return -1;
+	}
 
 	lpmd_log_debug("\t%d CPUs supported in maximum\n", max_cpus);
 
@@ -308,22 +418,19 @@ int detect_cpu_topo(struct lpmd_config_t *lpmd_config)
 	int i;
 	char path[MAX_STR_LENGTH];
 	int ret;
-	int pcores, ecores, lcores;
+	int pcores, ecores, lcores, smt_cores;
 
 	ret = detect_max_cpus();
 	if (ret)
 		return ret;
 
-	/* Allocate space for per-type cpu masks */
-	ret = allocate_cpu_type_masks(lpmd_config);
-	if (ret)
-		return ret;
-
 	cpumask_reset(CPUMASK_ONLINE);
 	pcores = 0;
 	ecores = 0;
 	lcores = 0;
+	smt_cores = 0;
 
+	/* Holes in the numbering just don't have a cpuN directory */
 	for (i = 0; i < get_max_cpus(); i++) {
 		unsigned int online = 0;
 
@@ -333,10 +440,10 @@ int detect_cpu_topo(struct lpmd_config_t *lpmd_config)
 			if (fscanf(filep, "%u", &online) != 1)
 				lpmd_log_warn("fread failed for %s\n", path);
 			fclose(filep);
-		} else if (!i) {
-			online = 1;
 		} else {
-			break;
+			/* CPUs that can't be offlined have no online file */
+			snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", i);
+			online = !access(path, F_OK);
 		}
 
 		if (!online)
@@ -349,21 +456,27 @@ int detect_cpu_topo(struct lpmd_config_t *lpmd_config)
 	/* Here it is the first time we migrate CPUs, must clear the previous cgroup settings */
 	cgroup_cleanup();
 
-	for (i = 0 ; i < CORE_TYPES_COUNT ; i++)
-		memset(lpmd_config->core_type_masks[i], 0, get_max_cpus() / 8);
+	if (detect_smt_siblings())
+		lpmd_log_warn("Failed to detect SMT siblings\n");
+
+	cpumask_reset(CPUMASK_PCORE);
+	cpumask_reset(CPUMASK_ECORE);
+	cpumask_reset(CPUMASK_LCORE);
 
 	for (i = 0; i < get_max_cpus(); i++) {
 		if (!is_cpu_online(i))
 			continue;
+		if (!is_smt_secondary(i) && cpu_topo && cpu_topo[i].nr_siblings > 1)
+			smt_cores++;
 		if (is_cpu_pcore(i) > 0) {
 			pcores++;
-			lpmd_config->core_type_masks[P_CORE][i / 8] |= 1 << (i % 8);
+			cpumask_add_cpu(i, CPUMASK_PCORE);
 		} else if (is_cpu_ecore(i) > 0) {
 			ecores++;
-			lpmd_config->core_type_masks[E_CORE][i / 8] |= 1 << (i % 8);
+			cpumask_add_cpu(i, CPUMASK_ECORE);
 		} else if (is_cpu_lcore(i) > 0) {
 			lcores++;
-			lpmd_config->core_type_masks[L_CORE][i / 8] |= 1 << (i % 8);
+			cpumask_add_cpu(i, CPUMASK_LCORE);
 		}
 	}
 
@@ -372,6 +485,8 @@ int detect_cpu_topo(struct lpmd_config_t *lpmd_config)
 
 	lpmd_log_info("Detected %d Pcores, %d Ecores, %d Lcores, TDP %dW\n",
 		      pcores, ecores, lcores, lpmd_config->tdp);
+	if (smt_cores)
+		lpmd_log_info("Detected %d cores with SMT siblings\n", smt_cores);
 	ret = snprintf(lpmd_config->cpu_config, MAX_CONFIG_LEN - 1,
 		       " %dP%dE%dL-%dW ", pcores, ecores, lcores,
 		       lpmd_config->tdp);
@@ -379,6 +494,146 @@ int detect_cpu_topo(struct lpmd_config_t *lpmd_config)
 	return 0;
 }
 
+/* Support for LPM_CPU_OFFLINE */
+#define PATH_CPU_ONLINE	"/sys/devices/system/cpu/cpu%d/online"
+
+/*
+ * Write all the CPU online knobs of a batch back to back. The files are
+ * opened up front so that a failure to access one of them doesn't leave
+ * the batch half applied. The kernel serializes hotplug operations, so
+ * a single writer is as fast as parallel ones.
+ */
+static int cpu_hotplug_batch(int *cpus, int nr, int online)
+{
+	char path[MAX_STR_LENGTH];
+	int *fds;
+	int i, ret = 0;
+
+	if (!nr)
+		return 0;
+
+	fds = calloc(nr, sizeof(int));
+	if (!fds)
+		return -1;
+
+	for (i = 0; i < nr; i++) {
+		snprintf(path, sizeof(path), PATH_CPU_ONLINE, cpus[i]);
+		fds[i] = open(path, O_WRONLY);
+		if (fds[i] < 0)
+			lpmd_log_error("\tOpen %s failed\n", path);
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (fds[i] < 0) {
+			ret = -1;
+			continue;
+		}
+
+		if (write(fds[i], online ? "1" : "0", 1) != 1) {
+			lpmd_log_error("\tFailed to %s cpu%d: %s\n",
+				       online ? "online" : "offline", cpus[i], strerror(errno));
+			ret = -1;
+		} else if (online) {
+			cpumask_clear_cpu(cpus[i], CPUMASK_OFFLINE);
+		} else {
+			cpumask_add_cpu(cpus[i], CPUMASK_OFFLINE);
+		}
+		close(fds[i]);
+	}
+
+	free(fds);
+	return ret;
+}
+
+/*
+ * Offline the CPUs outside of the cpumask and online the CPUs inside it.
+ * CPUMASK_OFFLINE tracks the CPUs offlined by lpmd, so that the uevents
+ * generated here are not mistaken for an external CPU hotplug.
+ *
+ * Offlining a whole core is cheaper when its SMT siblings go first, so
+ * the secondary threads are offlined before the primary ones and onlined
+ * after them.
+ */
+static int cpu_hotplug_update(enum cpumask_idx idx)
+{
+	int *cpus, nr_on_pri = 0, nr_on_sec = 0, nr_off_pri = 0, nr_off_sec = 0;
+	int max_cpus = get_max_cpus();
+	char path[MAX_STR_LENGTH];
+	int i, ret = 0;
+
+	/* Four lists carved out of one allocation */
+	cpus = calloc(max_cpus * 4, sizeof(int));
+	if (!cpus)
+		return -1;
+
+	for (i = 0; i < max_cpus; i++) {
+		int secondary = is_smt_secondary(i);
+
+		if (!is_cpu_online(i))
+			continue;
+
+		if (cpumask_test_cpu(i, idx)) {
+			if (!cpumask_test_cpu(i, CPUMASK_OFFLINE))
+				continue;
+			if (secondary)
+				cpus[max_cpus + nr_on_sec++] = i;
+			else
+				cpus[nr_on_pri++] = i;
+			continue;
+		}
+
+		if (cpumask_test_cpu(i, CPUMASK_OFFLINE))
+			continue;
+
+		/* Some CPUs, like the boot CPU, can't be offlined */
+		snprintf(path, sizeof(path), PATH_CPU_ONLINE, i);
+		if (access(path, W_OK))
+			continue;
+
+		if (secondary)
+			cpus[max_cpus * 2 + nr_off_sec++] = i;
+		else
+			cpus[max_cpus * 3 + nr_off_pri++] = i;
+	}
+
+	lpmd_log_debug("\tCPU hotplug: online %d cpus, offline %d cpus\n",
+		       nr_on_pri + nr_on_sec, nr_off_pri + nr_off_sec);
+
+	/* Bring up the new CPUs first so the tasks always have somewhere to run */
+	if (cpu_hotplug_batch(cpus, nr_on_pri, 1))
+		ret = -1;
+	if (cpu_hotplug_batch(cpus + max_cpus, nr_on_sec, 1))
+		ret = -1;
+	if (cpu_hotplug_batch(cpus + max_cpus * 2, nr_off_sec, 0))
+		ret = -1;
+	if (cpu_hotplug_batch(cpus + max_cpus * 3, nr_off_pri, 0))
+		ret = -1;
+
+	free(cpus);
+	return ret;
+}
+
+int process_cpu_offline(enum cpumask_idx idx)
+{
+	if (cpumask_equal(idx, CPUMASK_ONLINE))
+		return cpu_offline_restore();
+
+	if (!cpumask_has_cpu(idx)) {
+		lpmd_log_error("Refuse to offline all CPUs\n");
+		return 1;
+	}
+
+	return cpu_hotplug_update(idx);
+}
+
+int cpu_offline_restore(void)
+{
+	if (!cpumask_has_cpu(CPUMASK_OFFLINE))
+		return 0;
+
+	return cpu_hotplug_update(CPUMASK_ONLINE);
+}
+
 static int detect_lpm_cpus_cmd(char *cmd)
 {
 	int ret;
@@ -397,7 +652,7 @@ static int detect_lpm_cpus_cluster(void)
 	FILE *filep;
 	int i, ret;
 
-	for (i = get_max_cpus(); i >= 0; i--) {
+	for (i = get_max_cpus() - 1; i >= 0; i--) {
 		if (!is_cpu_online(i))
 			continue;
 
@@ -502,7 +757,7 @@ int detect_lpm_cpus(char *cmd_cpus)
 end:
 	if (cpumask_has_cpu(CPUMASK_LPM_DEFAULT))
 		lpmd_log_info("\tUse CPU %s as Default Low Power CPUs (%s)\n",
-			       get_cpus_str(CPUMASK_LPM_DEFAULT, false), str);
+			       get_cpus_str(CPUMASK_LPM_DEFAULT), str);
 
 	return 0;
 }
@@ -9,15 +9,36 @@
 static int topo_max_cpus;
 static int max_online_cpu;
 static size_t size_cpumask;
+static int nr_mask_words;
+
+/*
+ * cpumasks are arrays of unsigned long words, bit N of word W being CPU
+ * W * BITS_PER_WORD + N. This is the cpu_set_t layout, so masks can be
+ * passed to sched_setaffinity() directly.
+ */
+#define BITS_PER_WORD		(8 * sizeof(unsigned long))
+#define CPU_WORD(cpu)		((cpu) / BITS_PER_WORD)
+#define CPU_BIT(cpu)		(1UL << ((cpu) % BITS_PER_WORD))
+
+/* A rendering of a cpumask, valid while the mask generation matches @key */
+struct cpumask_cache {
+	void *data;
+	unsigned long long key;
+};
 
 struct lpm_cpus {
-	cpu_set_t *mask;
+	unsigned long *mask;
+	/* Set from cpumask_generation on every change of the mask */
+	unsigned int gen;
+	/* Users of an interned mask and the hash of its CPUs */
+	int refcount;
+	int interned;
+	uint64_t hash;
 	char *name;
-	char *str;
-	char *str_reverse;
-	char *hexstr;
-	char *hexstr_reverse;
-	uint8_t *hexvals;
+	struct cpumask_cache str;
+	struct cpumask_cache str_reverse;
+	struct cpumask_cache hexstr;
+	struct cpumask_cache hexvals;
 };
 
 static struct lpm_cpus cpumasks[CPUMASK_MAX] = {
@@ -26,9 +47,148 @@ static struct lpm_cpus cpumasks[CPUMASK_MAX] = {
 		[CPUMASK_HFI] = { .name = "HFI Low Power", },
 		[CPUMASK_HFI_BANNED] = { .name = "HFI BANNED", },
 		[CPUMASK_HFI_LAST] = { .name = "HFI LAST", },
+		[CPUMASK_HFI_PENDING] = { .name = "HFI PENDING", },
 		[CPUMASK_BLACKLIST] = { .name = "Blacklist", },
+		[CPUMASK_OFFLINE] = { .name = "Offline", },
+		[CPUMASK_PCORE] = { .name = "P-cores", },
+		[CPUMASK_ECORE] = { .name = "E-cores", },
+		[CPUMASK_LCORE] = { .name = "L-cores", },
 };
 
+/* Word operations, simple loops the compiler can vectorize for wide masks */
+static void mask_zero(unsigned long *dst)
+{
+	memset(dst, 0, size_cpumask);
+}
+
+static void mask_copy(unsigned long *dst, const unsigned long *src)
+{
+	memcpy(dst, src, size_cpumask);
+}
+
+static void mask_and(unsigned long *dst, const unsigned long *src1, const unsigned long *src2)
+{
+	int i;
+
+	for (i = 0; i < nr_mask_words; i++)
+		dst[i] = src1[i] & src2[i];
+}
+
+static void mask_andnot(unsigned long *dst, const unsigned long *src1, const unsigned long *src2)
+{
+	int i;
+
+	for (i = 0; i < nr_mask_words; i++)
+		dst[i] = src1[i] & ~src2[i];
+}
+
+static void mask_xor(unsigned long *dst, const unsigned long *src1, const unsigned long *src2)
+{
+	int i;
+
+	for (i = 0; i < nr_mask_words; i++)
+		dst[i] = src1[i] ^ src2[i];
+}
+
+static int mask_weight(const unsigned long *src)
+{
+	int i, count = 0;
+
+	for (i = 0; i < nr_mask_words; i++)
+		count += __builtin_popcountl(src[i]);
+
+	return count;
+}
+
+static int mask_equal(const unsigned long *src1, const unsigned long *src2)
+{
+	return !memcmp(src1, src2, size_cpumask);
+}
+
+static uint64_t mask_hash(const unsigned long *src)
+{
+	uint64_t hash = 0;
+	int i;
+
+	for (i = 0; i < nr_mask_words; i++)
+		hash = (hash ^ src[i]) * 0x9e3779b97f4a7c15ULL;
+
+	return hash;
+}
+
+/* Return the first CPU set in @src starting at @cpu, -1 if none */
+static int mask_next(const unsigned long *src, int cpu)
+{
+	unsigned long word;
+	int i;
+
+	if (cpu < 0)
+		cpu = 0;
+	if (cpu >= topo_max_cpus)
+		return -1;
+
+	i = CPU_WORD(cpu);
+	word = src[i] & (~0UL << (cpu % BITS_PER_WORD));
+
+	while (1) {
+		if (word) {
+			cpu = i * BITS_PER_WORD + __builtin_ctzl(word);
+			return cpu < topo_max_cpus ? cpu : -1;
+		}
+		if (++i >= nr_mask_words)
+			return -1;
+		word = src[i];
+	}
+}
+
+/* Return the first CPU not set in @src starting at @cpu, topo_max_cpus if none */
+static int mask_next_zero(const unsigned long *src, int cpu)
+{
+	unsigned long word;
+	int i;
+
+	if (cpu >= topo_max_cpus)
+		return topo_max_cpus;
+
+	i = CPU_WORD(cpu);
+	word = ~src[i] & (~0UL << (cpu % BITS_PER_WORD));
+
+	while (1) {
+		if (word) {
+			cpu = i * BITS_PER_WORD + __builtin_ctzl(word);
+			return cpu < topo_max_cpus ? cpu : topo_max_cpus;
+		}
+		if (++i >= nr_mask_words)
+			return topo_max_cpus;
+		word = ~src[i];
+	}
+}
+
+/* Generations are unique across masks, so a generation identifies a mask content */
+static unsigned int cpumask_generation;
+
+/* Invalidate the cached renderings, they are rebuilt when next requested */
+static void cpumask_changed(enum cpumask_idx idx)
+{
+	cpumasks[idx].gen = ++cpumask_generation;
+	cpumasks[idx].interned = 0;
+}
+
+static void cpumask_free_caches(enum cpumask_idx idx)
+{
+	free(cpumasks[idx].str.data);
+	free(cpumasks[idx].str_reverse.data);
+	free(cpumasks[idx].hexstr.data);
+	free(cpumasks[idx].hexvals.data);
+	memset(&cpumasks[idx].str, 0, sizeof(struct cpumask_cache));
+	memset(&cpumasks[idx].str_reverse, 0, sizeof(struct cpumask_cache));
+	memset(&cpumasks[idx].hexstr, 0, sizeof(struct cpumask_cache));
+	memset(&cpumasks[idx].hexvals, 0, sizeof(struct cpumask_cache));
+}
+
+#define for_each_mask_cpu(cpu, src) \
+	for ((cpu) = mask_next((src), 0); (cpu) >= 0; (cpu) = mask_next((src), (cpu) + 1))
+
 int is_cpu_online(int cpu)
 {
 	if (cpu < 0 || cpu >= topo_max_cpus)
@@ -37,7 +197,7 @@ int is_cpu_online(int cpu)
 	if (!cpumasks[CPUMASK_ONLINE].mask)
 		return 0;
 
-	return CPU_ISSET_S(cpu, size_cpumask, cpumasks[CPUMASK_ONLINE].mask);
+	return !!(cpumasks[CPUMASK_ONLINE].mask[CPU_WORD(cpu)] & CPU_BIT(cpu));
 }
 
 int get_max_cpus(void)
@@ -60,38 +220,38 @@ void set_max_online_cpu(int num)
 	max_online_cpu = num;
 }
 
-static size_t alloc_cpu_set(cpu_set_t **cpu_set)
+static unsigned long *alloc_mask(void)
 {
-	cpu_set_t *_cpu_set;
-	size_t size;
-
-	_cpu_set = CPU_ALLOC((topo_max_cpus + 1));
-	if (!_cpu_set)
-		err(3, "CPU_ALLOC");
-	size = CPU_ALLOC_SIZE((topo_max_cpus + 1));
-	CPU_ZERO_S(size, _cpu_set);
+	int words = (topo_max_cpus + BITS_PER_WORD) / BITS_PER_WORD;
+	unsigned long *mask;
 
-	*cpu_set = _cpu_set;
-
-	if (!size_cpumask)
-		size_cpumask = size;
+	if (!nr_mask_words) {
+		nr_mask_words = words;
+		size_cpumask = words * sizeof(unsigned long);
+	}
 
-	if (size_cpumask && size_cpumask != size) {
-		lpmd_log_error("Conflict cpumask size %zu vs. %zu\n", size, size_cpumask);
+	if (nr_mask_words != words) {
+		lpmd_log_error("Conflict cpumask size %d vs. %d words\n", words, nr_mask_words);
 		exit(-1);
 	}
-	return size;
+
+	mask = calloc(nr_mask_words, sizeof(unsigned long));
+	if (!mask)
+		err(3, "CPUMASK_ALLOC");
+
+	return mask;
 }
 
 int cpu_migrate(int cpu)
 {
-	cpu_set_t *mask;
+	unsigned long *mask;
 	int ret;
 
-	alloc_cpu_set(&mask);
-	CPU_SET_S(cpu, size_cpumask, mask);
-	ret = sched_setaffinity(0, size_cpumask, mask);
-	CPU_FREE(mask);
+	mask = alloc_mask();
+	if (cpu >= 0 && cpu < topo_max_cpus)
+		mask[CPU_WORD(cpu)] |= CPU_BIT(cpu);
+	ret = sched_setaffinity(0, size_cpumask, (cpu_set_t *)mask);
+	free(mask);
 
 	if (ret == -1)
 		return -1;
@@ -101,7 +261,7 @@ int cpu_migrate(int cpu)
 
 int cpu_clear_affinity(void)
 {
-	return  sched_setaffinity(0, size_cpumask, cpumasks[CPUMASK_ONLINE].mask);
+	return  sched_setaffinity(0, size_cpumask, (cpu_set_t *)cpumasks[CPUMASK_ONLINE].mask);
 }
 
 int cpumask_alloc(void)
@@ -110,7 +270,9 @@ int cpumask_alloc(void)
 
 	for (idx = CPUMASK_USER; idx < CPUMASK_MAX; idx++) {
 		if (!cpumasks[idx].mask) {
-			alloc_cpu_set(&cpumasks[idx].mask);
+			cpumasks[idx].mask = alloc_mask();
+			cpumasks[idx].refcount = 1;
+			cpumask_changed(idx);
 			break;
 		}
 	}
@@ -122,121 +284,199 @@ int cpumask_free(enum cpumask_idx idx)
 	if (!cpumasks[idx].mask)
 		return 0;
 
-	cpumask_reset(idx);
+	/* Still used by other states sharing the interned mask */
+	if (cpumasks[idx].refcount > 1) {
+		cpumasks[idx].refcount--;
+		return 0;
+	}
+	cpumasks[idx].refcount = 0;
+
+	cpumask_free_caches(idx);
 	free(cpumasks[idx].mask);
 	cpumasks[idx].mask = NULL;
+	cpumask_changed(idx);
 	return 0;
 }
 
+/*
+ * Share one slot between the user cpumasks with the same CPUs, so states
+ * with identical masks compare equal by index. Return the interned index,
+ * @idx is released when an identical mask exists already. Interned masks
+ * must not be changed afterwards.
+ */
+int cpumask_intern(enum cpumask_idx idx)
+{
+	uint64_t hash;
+	int i;
+
+	if (idx < CPUMASK_USER || idx >= CPUMASK_MAX || !cpumasks[idx].mask)
+		return idx;
+
+	hash = mask_hash(cpumasks[idx].mask);
+
+	for (i = CPUMASK_USER; i < CPUMASK_MAX; i++) {
+		if (i == idx || !cpumasks[i].mask || !cpumasks[i].interned)
+			continue;
+
+		if (cpumasks[i].hash != hash || !mask_equal(cpumasks[i].mask, cpumasks[idx].mask))
+			continue;
+
+		cpumasks[i].refcount++;
+		cpumask_free(idx);
+		return i;
+	}
+
+	cpumasks[idx].hash = hash;
+	cpumasks[idx].interned = 1;
+	return idx;
+}
+
+/*
+ * Identify the CPUs of @idx and the online CPUs, equal versions mean the
+ * same cpumask content. 0 for no cpumask.
+ */
+unsigned long long cpumask_version(enum cpumask_idx idx)
+{
+	if (idx == CPUMASK_NONE || !cpumasks[idx].mask)
+		return 0;
+
+	return (unsigned long long)cpumasks[CPUMASK_ONLINE].gen << 32 | cpumasks[idx].gen;
+}
+
 int cpumask_reset(enum cpumask_idx idx)
 {
 	if (!cpumasks[idx].mask)
-		alloc_cpu_set(&cpumasks[idx].mask);
+		cpumasks[idx].mask = alloc_mask();
 	else
-		CPU_ZERO_S(size_cpumask, cpumasks[idx].mask);
-
-	free(cpumasks[idx].str);
-	free(cpumasks[idx].str_reverse);
-	free(cpumasks[idx].hexstr);
-	free(cpumasks[idx].hexstr_reverse);
-	free(cpumasks[idx].hexvals);
-	cpumasks[idx].str = NULL;
-	cpumasks[idx].str_reverse = NULL;
-	cpumasks[idx].hexstr = NULL;
-	cpumasks[idx].hexstr_reverse = NULL;
-	cpumasks[idx].hexvals = NULL;
+		mask_zero(cpumasks[idx].mask);
+
+	cpumask_changed(idx);
 	return 0;
 }
 
 int cpumask_add_cpu(int cpu, enum cpumask_idx idx)
 {
+	if (cpu < 0 || cpu >= topo_max_cpus)
+		return 0;
+
 	if (idx != CPUMASK_ONLINE && !is_cpu_online(cpu))
 		return 0;
 
 	if (!cpumasks[idx].mask)
-		alloc_cpu_set(&cpumasks[idx].mask);
+		cpumasks[idx].mask = alloc_mask();
 
-	CPU_SET_S(cpu, size_cpumask, cpumasks[idx].mask);
+	cpumasks[idx].mask[CPU_WORD(cpu)] |= CPU_BIT(cpu);
+	cpumask_changed(idx);
 
 	return LPMD_SUCCESS;
 }
 
-void free_cpu_type_masks(struct lpmd_config_t *lpmd_config)
+int cpumask_clear_cpu(int cpu, enum cpumask_idx idx)
 {
-	int i;
+	if (cpu < 0 || cpu >= topo_max_cpus)
+		return 0;
+
+	if (!cpumasks[idx].mask)
+		return 0;
 
-	for (i = 0 ; i < CORE_TYPES_COUNT ; i++)
-		free(lpmd_config->core_type_masks[i]);
+	cpumasks[idx].mask[CPU_WORD(cpu)] &= ~CPU_BIT(cpu);
+	cpumask_changed(idx);
+
+	return LPMD_SUCCESS;
 }
 
-int allocate_cpu_type_masks(struct lpmd_config_t *lpmd_config)
+int cpumask_test_cpu(int cpu, enum cpumask_idx idx)
 {
-	int i;
+	if (cpu < 0 || cpu >= topo_max_cpus)
+		return 0;
 
-	for (i = 0 ; i < CORE_TYPES_COUNT ; i++) {
-		lpmd_config->core_type_masks[i] = malloc(get_max_cpus() / 8);
-		if (!lpmd_config->core_type_masks[i]) {
-			free_cpu_type_masks(lpmd_config);
-			return -1;
-		}
-	}
-	return 0;
+	if (idx == CPUMASK_NONE || !cpumasks[idx].mask)
+		return 0;
+
+	return !!(cpumasks[idx].mask[CPU_WORD(cpu)] & CPU_BIT(cpu));
 }
 
-static unsigned int count_cpu_type_cores(unsigned char *bitmask)
+int cpumask_next(int cpu, enum cpumask_idx idx)
 {
-	unsigned int count = 0;
-	int i;
+	if (idx == CPUMASK_NONE || !cpumasks[idx].mask)
+		return -1;
 
-	for (i = 0 ; i < get_max_cpus() ; i++) {
-		if (!!(bitmask[i / 8] & (1 << (i % 8))))
-			count++;
-	}
-	return count;
+	return mask_next(cpumasks[idx].mask, cpu);
 }
 
-static unsigned int get_next_cpu_cmask(unsigned int id, enum core_type type, unsigned char *cmask)
+static enum cpumask_idx core_type_to_idx(enum core_type type)
 {
-	bool ret;
-	int i;
-
-	for (i = id ; i < get_max_cpus() ; i++) {
-		ret = !!(cmask[i / 8] & (1 << (i % 8)));
-		if (ret)
-			return i;
+	switch (type) {
+	case P_CORE:
+		return CPUMASK_PCORE;
+	case E_CORE:
+		return CPUMASK_ECORE;
+	case L_CORE:
+		return CPUMASK_LCORE;
+	default:
+		return CPUMASK_NONE;
 	}
-	return id;
 }
 
-int cpumask_init_cpus_type(char *buf, enum cpumask_idx idx, unsigned char **cmasks, enum core_type type)
+/*
+ * Select @buf physical cores of the core type into @idx. Cores are taken
+ * in index order of their first available thread, with either all of
+ * their threads or only that one, leaving the siblings idle.
+ */
+int cpumask_init_cpus_type(char *buf, enum cpumask_idx idx, enum core_type type, int smt_policy)
 {
-	unsigned int current, next, count;
-	int nr_cpus = 0;
+	enum cpumask_idx type_idx = core_type_to_idx(type);
+	unsigned long *avail, *cores;
+	int nr_cores = 0, count, cpu, core;
 	char *end;
 
 	if (!strncmp(buf, "ALL", strlen("ALL")) || !strncmp(buf, "all", strlen("all")) || is_wildcard(buf)) {
-		count = count_cpu_type_cores(cmasks[type]);
+		count = cpumask_nr_cpus(type_idx);
 	} else {
 		errno = 0;
 		count = strtol(buf, &end, 10);
-		if (errno || *end != '\0' || !count)
+		if (errno || *end != '\0' || count <= 0)
 			return 0;
 	}
 
-	current = get_next_cpu_cmask(0, type, cmasks[type]);
-	while (nr_cpus != count) {
-		cpumask_add_cpu(current, idx);
-		next = get_next_cpu_cmask(current + 1, type, cmasks[type]);
-		if(next == current) /* Couldn't find next core of the provided type */
-			goto blacklist;
-		nr_cpus++;
-		current = next;
+	if (type_idx == CPUMASK_NONE || !cpumasks[type_idx].mask)
+		return 0;
+
+	/* Count only the cores that are not claimed by other cgroups */
+	avail = alloc_mask();
+	mask_copy(avail, cpumasks[type_idx].mask);
+	if (cpumasks[CPUMASK_BLACKLIST].mask)
+		mask_andnot(avail, avail, cpumasks[CPUMASK_BLACKLIST].mask);
+
+	/* Cores are identified by their first thread */
+	cores = alloc_mask();
+	for_each_mask_cpu(cpu, avail) {
+		core = get_cpu_core_id(cpu);
+		if (cores[CPU_WORD(core)] & CPU_BIT(core))
+			continue;
+		if (nr_cores >= count)
+			break;
+
+		cores[CPU_WORD(core)] |= CPU_BIT(core);
+		nr_cores++;
+		if (smt_policy == SMT_POLICY_SINGLE)
+			cpumask_add_cpu(cpu, idx);
 	}
 
-blacklist:
+	if (smt_policy != SMT_POLICY_SINGLE) {
+		for_each_mask_cpu(cpu, avail) {
+			core = get_cpu_core_id(cpu);
+			if (cores[CPU_WORD(core)] & CPU_BIT(core))
+				cpumask_add_cpu(cpu, idx);
+		}
+	}
+
+	free(cores);
+	free(avail);
+
 	cpumask_blacklist(idx);
 
-	return CPU_COUNT_S(size_cpumask, cpumasks[idx].mask);
+	return mask_weight(cpumasks[idx].mask);
 }
 
 int cpumask_init_cpus(char *buf, enum cpumask_idx idx)
@@ -300,7 +540,7 @@ int cpumask_init_cpus(char *buf, enum cpumask_idx idx)
 
 	cpumask_blacklist(idx);
 
-	return CPU_COUNT_S(size_cpumask, cpumasks[idx].mask);
+	return mask_weight(cpumasks[idx].mask);
 error:
 	lpmd_log_error("CPU string malformed: %s\n", buf);
 	return -1;
@@ -314,7 +554,7 @@ int cpumask_nr_cpus(enum cpumask_idx idx)
 	if (!cpumasks[idx].mask)
 		return 0;
 
-	return CPU_COUNT_S(size_cpumask, cpumasks[idx].mask);
+	return mask_weight(cpumasks[idx].mask);
 }
 
 int cpumask_has_cpu(enum cpumask_idx idx)
@@ -327,59 +567,78 @@ int cpumask_equal(enum cpumask_idx idx1, enum cpumask_idx idx2)
 	if (!cpumasks[idx1].mask || !cpumasks[idx2].mask)
 		return 0;
 
-	if (CPU_EQUAL_S(size_cpumask, cpumasks[idx1].mask, cpumasks[idx2].mask))
-		return 1;
+	return mask_equal(cpumasks[idx1].mask, cpumasks[idx2].mask);
+}
 
-	return 0;
+/* Only online CPUs can be added to masks other than CPUMASK_ONLINE */
+static void cpumask_and_online(enum cpumask_idx dest)
+{
+	cpumask_changed(dest);
+
+	if (dest == CPUMASK_ONLINE)
+		return;
+
+	if (!cpumasks[CPUMASK_ONLINE].mask)
+		mask_zero(cpumasks[dest].mask);
+	else
+		mask_and(cpumasks[dest].mask, cpumasks[dest].mask, cpumasks[CPUMASK_ONLINE].mask);
 }
 
 void cpumask_copy(enum cpumask_idx source, enum cpumask_idx dest)
 {
-	int i;
-
 	cpumask_reset(dest);
-	for (i = 0; i < topo_max_cpus; i++) {
-		if (!CPU_ISSET_S(i, size_cpumask, cpumasks[source].mask))
-			continue;
+	if (!cpumasks[source].mask)
+		return;
 
-		cpumask_add_cpu(i, dest);
-	}
+	mask_copy(cpumasks[dest].mask, cpumasks[source].mask);
+	cpumask_and_online(dest);
 }
 
 void cpumask_exclude_copy(enum cpumask_idx source, enum cpumask_idx dest, enum cpumask_idx exclude)
 {
-	int i;
-
 	cpumask_reset(dest);
-	for (i = 0; i < topo_max_cpus; i++) {
-		if (!CPU_ISSET_S(i, size_cpumask, cpumasks[source].mask))
-			continue;
+	if (!cpumasks[source].mask)
+		return;
 
-		if (CPU_ISSET_S(i, size_cpumask, cpumasks[exclude].mask))
-			continue;
-
-		cpumask_add_cpu(i, dest);
+	if (cpumasks[exclude].mask)
+		mask_andnot(cpumasks[dest].mask, cpumasks[source].mask, cpumasks[exclude].mask);
+	else
+		mask_copy(cpumasks[dest].mask, cpumasks[source].mask);
+	cpumask_and_online(dest);
+}
+
+/*
+ * Render @mask as a range compressed CPU list, e.g. "0-3,8-11", and return
+ * the length. Only the length is computed when @buf is NULL.
+ */
+static int mask_to_str(const unsigned long *mask, char *buf, int size)
+{
+	int start, end, len = 0;
+
+	for (start = mask_next(mask, 0); start >= 0; start = mask_next(mask, end)) {
+		end = mask_next_zero(mask, start);
+		if (end - 1 == start)
+			len += snprintf(buf ? buf + len : NULL, buf ? size - len : 0,
+					"%s%d", len ? "," : "", start);
+		else
+			len += snprintf(buf ? buf + len : NULL, buf ? size - len : 0,
+					"%s%d-%d", len ? "," : "", start, end - 1);
 	}
+	return len;
 }
 
-static int cpumask_to_str(cpu_set_t *mask, char *buf, int length)
+static void *cpumask_to_str(const unsigned long *mask)
 {
-	int i;
-	int offset = 0;
+	int size = mask_to_str(mask, NULL, 0) + 1;
+	char *str;
 
-	buf[0] = '\0';
-	for (i = 0; i < topo_max_cpus; i++) {
-		if (!CPU_ISSET_S(i, size_cpumask, mask))
-			continue;
-		if (length - 1 < offset) {
-			lpmd_log_debug("%s: Too many cpus\n", __func__);
-			return 1;
-		}
-		offset += snprintf(buf + offset, length - 1 - offset, "%d,", i);
-	}
-	if (offset)
-		buf[offset - 1] = '\0';
-	return 0;
+	str = malloc(size);
+	if (!str)
+		err(3, "STR_ALLOC");
+
+	str[0] = '\0';
+	mask_to_str(mask, str, size);
+	return str;
 }
 
 static char to_hexchar(int val)
@@ -391,146 +650,114 @@ static char to_hexchar(int val)
 	return val - 10 + 'a';
 }
 
-static int cpumask_to_hexstr(cpu_set_t *mask, char *str, int size)
+/*
+ * Render @mask in the kernel cpumask format: one hex digit per 4 CPUs,
+ * highest CPUs first, in comma separated groups of 32 CPUs.
+ */
+static void *cpumask_to_hexstr(const unsigned long *mask)
 {
-	int cpu;
-	int i;
-	int pos = 0;
-	char c = 0;
-
-	for (cpu = 0; cpu < topo_max_cpus; cpu++) {
-		i = cpu % 4;
-
-		if (!i)
-			c = 0;
+	int nr_digits = (topo_max_cpus + 3) / 4;
+	int digit, pos = 0;
+	char *str;
 
-		if (CPU_ISSET_S(cpu, size_cpumask, mask))
-			c += (1 << i);
+	str = malloc(nr_digits + nr_digits / 8 + 1);
+	if (!str)
+		err(3, "HEXSTR_ALLOC");
 
-		if (i == 3) {
-			str[pos] = to_hexchar (c);
-			pos++;
-			if (pos >= size)
-				return -1;
-		}
+	for (digit = nr_digits - 1; digit >= 0; digit--) {
+		str[pos++] = to_hexchar((mask[digit / (BITS_PER_WORD / 4)] >>
+					 (4 * (digit % (BITS_PER_WORD / 4)))) & 0xf);
+		if (digit && !(digit % 8))
+			str[pos++] = ',';
 	}
 	str[pos] = '\0';
 
-	pos--;
-	for (i = 0; i <= pos / 2; i++) {
-		c = str[i];
-		str[i] = str[pos - i];
-		str[pos - i] = c;
-	}
-
-	return 0;
+	return str;
 }
 
-int get_cached_value_init(enum cpumask_idx idx, bool refresh,
-			  char **cached_str, const char *cached_name)
+static void *cpumask_to_str_reverse(const unsigned long *mask)
 {
-	if (!cpumasks[idx].mask)
-		return LPMD_ERROR;
-
-	if (!CPU_COUNT_S(size_cpumask, cpumasks[idx].mask))
-		return LPMD_ERROR;
-
-	if (*cached_str) {
-		if (!refresh)
-			return LPMD_SUCCESS;
-	} else {
-		*cached_str = calloc(MAX_STR_LENGTH, 1);
-	}
+	unsigned long *reverse;
+	char *str;
 
-	if (!(*cached_str))
-		err(3, "%s_ALLOC", cached_name);
+	reverse = alloc_mask();
+	mask_xor(reverse, mask, cpumasks[CPUMASK_ONLINE].mask);
+	str = cpumask_to_str(reverse);
+	free(reverse);
 
-	return LPMD_SUCCESS;
+	return str;
 }
 
-char *get_cpus_str(enum cpumask_idx idx, bool refresh)
+/* Byte N holds CPUs N * 8 to N * 8 + 7, like the words in little endian */
+static void *cpumask_to_hexvals(const unsigned long *mask)
 {
-	int ret = get_cached_value_init(idx, refresh, &cpumasks[idx].str, "STR");
+	int size = (topo_max_cpus + 7) / 8;
+	uint8_t *vals;
+	int i;
 
-	if (ret)
-		return NULL;
+	vals = calloc(size, 1);
+	if (!vals)
+		err(3, "HEXVALS_ALLOC");
+
+	for (i = 0; i < size; i++)
+		vals[i] = mask[i / sizeof(unsigned long)] >> (8 * (i % sizeof(unsigned long)));
 
-	cpumask_to_str(cpumasks[idx].mask, cpumasks[idx].str, MAX_STR_LENGTH);
-	return cpumasks[idx].str;
+	return vals;
 }
 
-char *get_cpus_hexstr(enum cpumask_idx idx, bool refresh)
+/*
+ * Return the rendering of @idx cached in @cache, rendering it only if the
+ * mask changed since. @key identifies the mask generation, combined with
+ * the online mask generation for renderings depending on it.
+ */
+static void *get_cached(enum cpumask_idx idx, struct cpumask_cache *cache,
+			unsigned long long key, void *(*render)(const unsigned long *mask))
 {
-	int ret = get_cached_value_init(idx, refresh, &cpumasks[idx].hexstr, "HEXSTR");
-
-	if (ret)
+	if (!cpumask_nr_cpus(idx))
 		return NULL;
 
-	cpumask_to_hexstr(cpumasks[idx].mask, cpumasks[idx].hexstr, MAX_STR_LENGTH);
-	return cpumasks[idx].hexstr;
+	if (cache->data && cache->key == key)
+		return cache->data;
+
+	free(cache->data);
+	cache->data = render(cpumasks[idx].mask);
+	cache->key = key;
+	return cache->data;
 }
 
-static char *get_cpus_str_reverse(enum cpumask_idx idx, bool refresh)
+char *get_cpus_str(enum cpumask_idx idx)
 {
-	cpu_set_t *mask;
-	int ret;
-
-	ret = get_cached_value_init(idx, refresh, &cpumasks[idx].str_reverse, "STR_REVERSE");
-	if (ret)
+	if (idx == CPUMASK_NONE)
 		return NULL;
 
-	alloc_cpu_set(&mask);
-	CPU_XOR_S(size_cpumask, mask, cpumasks[idx].mask, cpumasks[CPUMASK_ONLINE].mask);
-	cpumask_to_str(mask, cpumasks[idx].str_reverse, MAX_STR_LENGTH);
-	CPU_FREE(mask);
-
-	return cpumasks[idx].str_reverse;
+	return get_cached(idx, &cpumasks[idx].str, cpumasks[idx].gen, cpumask_to_str);
 }
 
-static uint8_t *get_cpus_hexvals(enum cpumask_idx idx, bool refresh)
+char *get_cpus_hexstr(enum cpumask_idx idx)
 {
-	int size = topo_max_cpus / 8;
-	uint8_t v = 0;
-	uint8_t *vals;
-	int i, j, k;
-
-	if (!cpumasks[idx].mask)
+	if (idx == CPUMASK_NONE)
 		return NULL;
 
-	if (!CPU_COUNT_S(size_cpumask, cpumasks[idx].mask))
-		return NULL;
+	return get_cached(idx, &cpumasks[idx].hexstr, cpumasks[idx].gen, cpumask_to_hexstr);
+}
 
-	if (cpumasks[idx].hexvals)
-		if (!refresh)
-			return cpumasks[idx].hexvals;
+static char *get_cpus_str_reverse(enum cpumask_idx idx)
+{
+	unsigned long long key;
 
-	vals = calloc(size, 1);
-	if (!vals)
+	if (idx == CPUMASK_NONE)
 		return NULL;
 
-	for (i = 0; i < topo_max_cpus; i++) {
-		j = i % 8;
-		k = i / 8;
-
-		if (k >= size) {
-			lpmd_log_error("size too big\n");
-			free(vals);
-			return NULL;
-		}
-
-		if (!CPU_ISSET_S(i, size_cpumask, cpumasks[idx].mask))
-			goto set_val;
+	key = (unsigned long long)cpumasks[CPUMASK_ONLINE].gen << 32 | cpumasks[idx].gen;
+	return get_cached(idx, &cpumasks[idx].str_reverse, key, cpumask_to_str_reverse);
+}
 
-		v |= 1 << j;
-set_val:
-		if (j == 7) {
-			vals[k] = v;
-			v = 0;
-		}
-	}
+static uint8_t *get_cpus_hexvals(enum cpumask_idx idx)
+{
+	if (idx == CPUMASK_NONE)
+		return NULL;
 
-	cpumasks[idx].hexvals = vals;
-	return cpumasks[idx].hexvals;
+	return get_cached(idx, &cpumasks[idx].hexvals, cpumasks[idx].gen, cpumask_to_hexvals);
 }
 
 int cpumask_blacklist(enum cpumask_idx idx)
@@ -538,30 +765,23 @@ int cpumask_blacklist(enum cpumask_idx idx)
 	char *state_name;
 
 	if (!cpumasks[idx].mask)
-		alloc_cpu_set(&cpumasks[idx].mask);
+		cpumasks[idx].mask = alloc_mask();
 
 	/* Return due to blacklist not getting initialized yet. */
 	if (!cpumasks[CPUMASK_BLACKLIST].mask) {
-		alloc_cpu_set(&cpumasks[CPUMASK_BLACKLIST].mask);
+		cpumasks[CPUMASK_BLACKLIST].mask = alloc_mask();
 		return LPMD_ERROR;
 	}
 
 	/* Return due to blacklist being empty. */
-	if (!CPU_COUNT_S(size_cpumask, cpumasks[CPUMASK_BLACKLIST].mask))
+	if (!mask_weight(cpumasks[CPUMASK_BLACKLIST].mask))
 		return LPMD_ERROR;
 
 	/* Otherwise clear blacklisted cpus from the chosen cpumask */
-	for (int i = 0 ; i < topo_max_cpus ; i++)
-		if (CPU_ISSET_S(i, size_cpumask, cpumasks[CPUMASK_BLACKLIST].mask))
-			CPU_CLR_S(i, size_cpumask, cpumasks[idx].mask);
-
-	/* Update any relevant cached data. */
-	cpumasks[idx].hexstr = get_cpus_hexstr(idx, true);
-	cpumasks[idx].str = get_cpus_str(idx, true);
-	cpumasks[idx].str_reverse = get_cpus_str_reverse(idx, true);
-	cpumasks[idx].hexvals = get_cpus_hexvals(idx, true);
+	mask_andnot(cpumasks[idx].mask, cpumasks[idx].mask, cpumasks[CPUMASK_BLACKLIST].mask);
+	cpumask_changed(idx);
 
-	if (!CPU_COUNT_S(size_cpumask, cpumasks[idx].mask)) {
+	if (!mask_weight(cpumasks[idx].mask)) {
 		state_name = user_cpumask_idx_to_state_name(idx);
 		lpmd_log_error("%s: cpumask[%d] is empty after blacklisting due to unavailable cpus\n", state_name, idx);
 		lpmd_log_error("It's possible another cgroup claimed all cores required by cpumask[%d]\n", idx);
@@ -572,23 +792,24 @@ int cpumask_blacklist(enum cpumask_idx idx)
 
 char *get_proc_irq_str(enum cpumask_idx idx)
 {
-	return get_cpus_hexstr(idx, false);
+	return get_cpus_hexstr(idx);
 }
 
 char *get_irqbalance_str(enum cpumask_idx idx)
 {
-	return get_cpus_str_reverse(idx, false);
+	return get_cpus_str_reverse(idx);
 }
 
 char *get_cpu_isolation_str(enum cpumask_idx idx)
 {
 	if (idx == CPUMASK_ONLINE)
-		return get_cpus_str(idx, false);
+		return get_cpus_str(idx);
 	else
-		return get_cpus_str_reverse(idx, false);
+		return get_cpus_str_reverse(idx);
 }
 
-uint8_t *get_cgroup_systemd_vals(enum cpumask_idx idx)
+uint8_t *get_cgroup_systemd_vals(enum cpumask_idx idx, int *size)
 {
-	return get_cpus_hexvals(idx, false);
+	*size = (topo_max_cpus + 7) / 8;
+	return get_cpus_hexvals(idx);
 }
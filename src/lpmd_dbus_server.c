@@ -150,6 +150,17 @@ lpmd_dbus_handle_method_call(GDBusConnection       *connection,
 		return;
 	}
 
+	if (g_strcmp0(method_name, "GetHfiStats") == 0) {
+		struct hfi_stats stats;
+
+		hfi_get_stats(&stats);
+		g_dbus_method_invocation_return_value(invocation,
+						      g_variant_new("(uuuuu)", stats.updates,
+								    stats.applied, stats.absorbed,
+								    stats.dropped, stats.resyncs));
+		return;
+	}
+
 	g_set_error(&error,
 		    G_DBUS_ERROR,
 		    G_DBUS_ERROR_UNKNOWN_METHOD,
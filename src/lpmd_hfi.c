@@ -15,6 +15,7 @@
 #include <sys/file.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -164,6 +165,241 @@ struct perf_cap {
 	int eff;
 };
 
+/* Latest HFI capabilities of each CPU, -1 until reported */
+struct hfi_cap {
+	int perf;
+	int eff;
+};
+
+static struct hfi_cap *hfi_caps;
+static int nr_ranked_states;
+/* Capabilities changed since the ranked cpumasks were last built */
+static int hfi_caps_changed;
+
+static int hfi_cap_known(int cpu)
+{
+	if (!hfi_caps || cpu < 0 || cpu >= get_max_cpus())
+		return 0;
+
+	/* Banned CPUs report no capability at all */
+	return hfi_caps[cpu].perf > 0 || hfi_caps[cpu].eff > 0;
+}
+
+/* Most efficient first, then by CPU number for a stable order */
+static int hfi_eff_cmp(const void *a, const void *b)
+{
+	int cpu_a = *(const int *)a;
+	int cpu_b = *(const int *)b;
+
+	if (hfi_caps[cpu_a].eff != hfi_caps[cpu_b].eff)
+		return hfi_caps[cpu_b].eff - hfi_caps[cpu_a].eff;
+
+	return cpu_a - cpu_b;
+}
+
+/*
+ * Build @idx from the HFI ranking: the CPUs with at least HfiMinPerf
+ * percent of the highest perf capability, then the HfiMostEfficient most
+ * efficient of them. All online CPUs until the capabilities are known.
+ */
+static int hfi_rank_cpus(struct lpmd_config_state_t *state, enum cpumask_idx idx)
+{
+	int max_perf = 0, nr = 0, cpu;
+	int *cpus;
+
+	cpus = calloc(get_max_cpus(), sizeof(*cpus));
+	if (!cpus)
+		return -1;
+
+	for (cpu = 0; cpu < get_max_cpus(); cpu++) {
+		if (is_cpu_online(cpu) && hfi_cap_known(cpu) && hfi_caps[cpu].perf > max_perf)
+			max_perf = hfi_caps[cpu].perf;
+	}
+
+	for (cpu = 0; cpu < get_max_cpus(); cpu++) {
+		if (!is_cpu_online(cpu) || !hfi_cap_known(cpu))
+			continue;
+		if (hfi_caps[cpu].perf * 100 < state->hfi_min_perf * max_perf)
+			continue;
+		cpus[nr++] = cpu;
+	}
+
+	if (state->hfi_most_efficient && nr > state->hfi_most_efficient) {
+		qsort(cpus, nr, sizeof(*cpus), hfi_eff_cmp);
+		nr = state->hfi_most_efficient;
+	}
+
+	cpumask_reset(idx);
+	if (!nr)
+		cpumask_copy(CPUMASK_ONLINE, idx);
+	while (nr--)
+		cpumask_add_cpu(cpus[nr], idx);
+	cpumask_blacklist(idx);
+
+	free(cpus);
+	return 0;
+}
+
+/* Rebuild the cpumasks of the states placed by HFI ranking, 1 if any changed */
+static int hfi_update_ranked_states(void)
+{
+	struct lpmd_config_t *config = get_lpmd_config();
+	struct lpmd_config_state_t *state;
+	int i, tmp, changed = 0;
+
+	for (i = CONFIG_STATE_BASE; i < CONFIG_STATE_BASE + config->config_state_count; i++) {
+		state = &config->config_states[i];
+
+		if (!state->valid || state->cpumask_idx == CPUMASK_NONE ||
+		    (!state->hfi_most_efficient && !state->hfi_min_perf))
+			continue;
+
+		tmp = cpumask_alloc();
+		if (tmp == CPUMASK_NONE)
+			return changed;
+
+		if (!hfi_rank_cpus(state, tmp) && !cpumask_equal(tmp, state->cpumask_idx)) {
+			cpumask_copy(tmp, state->cpumask_idx);
+			lpmd_log_debug("\tHFI ranked CPUs of state %s: %s\n", state->name,
+				       get_cpus_str(state->cpumask_idx));
+			changed = 1;
+		}
+		cpumask_free(tmp);
+	}
+
+	return changed;
+}
+
+/* Initial cpumask of a state placed by HFI ranking */
+int hfi_init_ranked_state(struct lpmd_config_state_t *state)
+{
+	nr_ranked_states++;
+	return hfi_rank_cpus(state, state->cpumask_idx);
+}
+
+/*
+ * HFI coalescing. Capacity updates only change the pending target, which
+ * is applied HfiCoalesceMS after the first update of a burst and at least
+ * HfiDwellMS after the previous transition. Targets superseded or reverted
+ * before being applied are counted as absorbed.
+ */
+enum hfi_target {
+	HFI_TARGET_NONE,
+	HFI_TARGET_LPM,		/* The CPUs in CPUMASK_HFI_PENDING */
+	HFI_TARGET_RECOVER,	/* All online CPUs */
+};
+
+static int hfi_pending = HFI_TARGET_NONE;
+/* The ranked cpumasks are due for a rebuild along with the target */
+static int hfi_rank_pending;
+/* Last CPU of the multi-message update being received, -1 when none */
+static int hfi_chunk_last = -1;
+static uint64_t hfi_chunk_since;
+static uint64_t hfi_pending_since;
+static uint64_t hfi_last_applied;
+static struct hfi_stats hfi_stats;
+
+/* Simulated clock of the event replay, in ms from the start of the trace */
+static int hfi_replaying;
+static uint64_t hfi_replay_clock;
+
+static uint64_t hfi_now_ms(void)
+{
+	struct timespec ts;
+
+	if (hfi_replaying)
+		return hfi_replay_clock;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * The messages of an update are sent back to back, an update still open
+ * HFI_CHUNK_TIMEOUT_MS after its last message ended with a full one.
+ */
+#define HFI_CHUNK_TIMEOUT_MS	10
+
+static void process_one_event(void);
+
+/*
+ * Milliseconds until the pending target is due, or the update being
+ * reassembled is closed, -1 if there is none
+ */
+static int hfi_pending_delay(uint64_t now)
+{
+	struct lpmd_config_t *config = get_lpmd_config();
+	uint64_t due;
+
+	if (hfi_chunk_last >= 0) {
+		due = hfi_chunk_since + HFI_CHUNK_TIMEOUT_MS;
+		return due > now ? due - now : 0;
+	}
+
+	if (hfi_pending == HFI_TARGET_NONE && !hfi_rank_pending)
+		return -1;
+
+	due = hfi_pending_since + config->hfi_coalesce_ms;
+	if (hfi_stats.applied && due < hfi_last_applied + config->hfi_dwell_ms)
+		due = hfi_last_applied + config->hfi_dwell_ms;
+
+	return due > now ? due - now : 0;
+}
+
+/* Shorten the poll @timeout so that the pending target is applied in time */
+int hfi_pending_timeout(int timeout)
+{
+	int delay = hfi_pending_delay(hfi_now_ms());
+
+	if (delay >= 0 && (timeout < 0 || delay < timeout))
+		return delay;
+
+	return timeout;
+}
+
+int hfi_apply_pending(void)
+{
+	uint64_t now = hfi_now_ms();
+	unsigned int applied;
+
+	if (hfi_pending_delay(now))
+		return 0;
+
+	if (hfi_chunk_last >= 0) {
+		lpmd_log_debug("\tHFI update closed after CPU %d\n", hfi_chunk_last);
+		applied = hfi_stats.applied;
+		hfi_chunk_last = -1;
+		hfi_stats.updates++;
+		process_one_event();
+		return hfi_stats.applied != applied;
+	}
+
+	if (hfi_pending == HFI_TARGET_LPM) {
+		cpumask_copy(CPUMASK_HFI_PENDING, CPUMASK_HFI);
+		cpumask_copy(CPUMASK_HFI_PENDING, CPUMASK_HFI_LAST);
+	} else if (hfi_pending == HFI_TARGET_RECOVER) {
+		lpmd_log_debug("\tHFI LPM recover\n");
+//		 Don't override the DETECT_LPM_CPU_DEFAULT so it is auto recovered
+		cpumask_copy(CPUMASK_ONLINE, CPUMASK_HFI);
+		cpumask_reset(CPUMASK_HFI_LAST);
+	}
+
+	if (hfi_rank_pending) {
+		hfi_rank_pending = 0;
+		if (!hfi_update_ranked_states() && hfi_pending == HFI_TARGET_NONE)
+			return 0;
+	}
+
+	hfi_pending = HFI_TARGET_NONE;
+	hfi_last_applied = now;
+	hfi_stats.applied++;
+	update_reason(UPDATE_HFI);
+
+	lpmd_log_debug("\tHFI transition applied, %u applied, %u absorbed\n",
+		       hfi_stats.applied, hfi_stats.absorbed);
+	return 1;
+}
+
 /*
  * Detect different kinds of CPU HFI hint
  * "LPM". EFF == 255
@@ -171,105 +407,147 @@ struct perf_cap {
  * "BAN". PERF == EFF == 0, suv bit not set.
  * "NOR".
  */
-static char *update_one_cpu(struct perf_cap *perf_cap)
+static char *hfi_cap_type(int perf, int eff)
 {
-	if (perf_cap->cpu < 0)
-		return NULL;
-
-	if (!perf_cap->cpu) {
-		cpumask_reset(CPUMASK_HFI);
-		cpumask_reset(CPUMASK_HFI_BANNED);
-	}
-
-	if (perf_cap->eff == 255 * 4) {
-		cpumask_add_cpu(perf_cap->cpu, CPUMASK_HFI);
+	if (eff == 255 * 4)
 		return "LPM";
-	}
-	if (!perf_cap->perf && !perf_cap->eff) {
-		cpumask_add_cpu(perf_cap->cpu, CPUMASK_HFI_BANNED);
+	if (!perf && !eff)
 		return "BAN";
-	}
 	return "NOR";
 }
 
-static void process_one_event(int first, int last, int nr)
+static void update_one_cpu(struct perf_cap *perf_cap)
 {
-	/* Need to update more CPUs */
-	if (nr == 16 && last != get_max_online_cpu())
+	struct hfi_cap *cap;
+
+	if (!hfi_caps || perf_cap->cpu < 0 || perf_cap->cpu >= get_max_cpus())
 		return;
 
-	if (cpumask_has_cpu(CPUMASK_HFI)) {
-		/* Ignore duplicate event */
-		if (cpumask_equal(CPUMASK_HFI_LAST, CPUMASK_HFI)) {
-			lpmd_log_debug("\tDuplicated HFI LPM hints ignored\n\n");
-			return;
-		}
+	cap = &hfi_caps[perf_cap->cpu];
+	if (cap->perf == perf_cap->perf && cap->eff == perf_cap->eff)
+		return;
+
+	cap->perf = perf_cap->perf;
+	cap->eff = perf_cap->eff;
+	hfi_caps_changed = 1;
+}
+
+/*
+ * Evaluate the hints of a complete update. The masks are rebuilt from the
+ * capabilities of all CPUs, as an update may only cover one HFI instance.
+ */
+static void process_one_event(void)
+{
+	int target, was_pending, cpu;
+
+	if (!hfi_caps)
+		return;
+
+	cpumask_reset(CPUMASK_HFI_PENDING);
+	cpumask_reset(CPUMASK_HFI_BANNED);
+	for (cpu = 0; cpu < get_max_cpus(); cpu++) {
+		if (!is_cpu_online(cpu) || hfi_caps[cpu].perf < 0)
+			continue;
+		if (hfi_caps[cpu].eff == 255 * 4)
+			cpumask_add_cpu(cpu, CPUMASK_HFI_PENDING);
+		else if (!hfi_caps[cpu].perf && !hfi_caps[cpu].eff)
+			cpumask_add_cpu(cpu, CPUMASK_HFI_BANNED);
+	}
+
+	if (cpumask_has_cpu(CPUMASK_HFI_PENDING)) {
 		lpmd_log_debug("\tDetect HFI LPM event\n");
-		update_reason(UPDATE_HFI);
-		cpumask_copy(CPUMASK_HFI, CPUMASK_HFI_LAST);
+		target = HFI_TARGET_LPM;
 	} else if (cpumask_has_cpu(CPUMASK_HFI_BANNED)) {
-		cpumask_exclude_copy(CPUMASK_ONLINE, CPUMASK_HFI, CPUMASK_HFI_BANNED);
-		/* Ignore duplicate event */
-		if (cpumask_equal(CPUMASK_HFI_LAST, CPUMASK_HFI)) {
-			lpmd_log_debug("\tDuplicated HFI BANNED hints ignored\n\n");
-			return;
-		}
+		cpumask_exclude_copy(CPUMASK_ONLINE, CPUMASK_HFI_PENDING, CPUMASK_HFI_BANNED);
 		lpmd_log_debug("\tDetect HFI LPM event with banned CPUs\n");
-		update_reason(UPDATE_HFI);
-		cpumask_copy(CPUMASK_HFI, CPUMASK_HFI_LAST);
-	} else if (cpumask_has_cpu(CPUMASK_HFI_LAST)) {
-		lpmd_log_debug("\tHFI LPM recover\n");
-//		 Don't override the DETECT_LPM_CPU_DEFAULT so it is auto recovered
-		cpumask_copy(CPUMASK_ONLINE, CPUMASK_HFI);
-		update_reason(UPDATE_HFI);
-		cpumask_reset(CPUMASK_HFI_LAST);
+		target = HFI_TARGET_LPM;
 	} else {
-		lpmd_log_info("\t\t\tUnsupported HFI event ignored\n");
+		target = HFI_TARGET_RECOVER;
+	}
+
+	/* Same as the applied hints, which reverts any pending transition */
+	if ((target == HFI_TARGET_LPM && cpumask_equal(CPUMASK_HFI_LAST, CPUMASK_HFI_PENDING)) ||
+	    (target == HFI_TARGET_RECOVER && !cpumask_has_cpu(CPUMASK_HFI_LAST))) {
+		if (hfi_pending != HFI_TARGET_NONE) {
+			hfi_pending = HFI_TARGET_NONE;
+			hfi_stats.absorbed++;
+			lpmd_log_debug("\tPending HFI transition reverted, %u absorbed\n",
+				       hfi_stats.absorbed);
+		} else if (target == HFI_TARGET_LPM) {
+			lpmd_log_debug("\tDuplicated HFI LPM hints ignored\n\n");
+		} else if (!hfi_caps_changed) {
+			lpmd_log_info("\t\t\tUnsupported HFI event ignored\n");
+		}
+		target = HFI_TARGET_NONE;
+	}
+
+	was_pending = hfi_pending != HFI_TARGET_NONE || hfi_rank_pending;
+
+	if (target != HFI_TARGET_NONE) {
+		if (hfi_pending != HFI_TARGET_NONE) {
+			hfi_stats.absorbed++;
+			lpmd_log_debug("\tPending HFI transition superseded, %u absorbed\n",
+				       hfi_stats.absorbed);
+		}
+		hfi_pending = target;
 	}
+
+	/* The ranked cpumasks follow every capability change */
+	if (hfi_caps_changed && nr_ranked_states)
+		hfi_rank_pending = 1;
+	hfi_caps_changed = 0;
+
+	if (!was_pending && (hfi_pending != HFI_TARGET_NONE || hfi_rank_pending))
+		hfi_pending_since = hfi_now_ms();
+
+	hfi_apply_pending();
 }
 
-static void __handle_event(struct nlattr *cap, int *index,
-			   int *offset, char *buf, struct perf_cap *perf_cap,
-			   int *first_cpu, int *last_cpu, int *nr_cpus)
+/*
+ * Capacity updates of an HFI instance larger than HFI_CHUNK_CPUS CPUs come
+ * as several messages with increasing CPU numbers, the last one shorter.
+ * An update whose CPU count is a multiple of HFI_CHUNK_CPUS, as on parts
+ * with several instances or with CPUs offlined, is closed by
+ * hfi_apply_pending() after HFI_CHUNK_TIMEOUT_MS, or right away when it
+ * reaches the highest online CPU. A message not continuing the update
+ * being reassembled starts a new one.
+ */
+#define HFI_CHUNK_CPUS		16
+
+static void hfi_process_caps(struct perf_cap *caps, int nr)
 {
-	switch (*index) {
-	case 0:
-		*offset += snprintf(buf + *offset, MAX_STR_LENGTH -
-				    *offset, "\tCPU %3d: ", nla_get_u32(cap));
-		perf_cap->cpu = nla_get_u32(cap);
-		break;
-	case 1:
-		*offset += snprintf(buf + *offset, MAX_STR_LENGTH -
-				    *offset, " PERF [%4d] ", nla_get_u32(cap));
-		perf_cap->perf = nla_get_u32(cap);
-		break;
-	case 2:
-		*offset += snprintf(buf + *offset, MAX_STR_LENGTH -
-				    *offset, " EFF [%4d] ", nla_get_u32(cap));
-		perf_cap->eff = nla_get_u32(cap);
-		break;
-	default:
-		break;
-	}
-	*index += 1;
+	int i;
 
-	if (*index == 3) {
-		char *str;
+	if (!nr)
+		return;
 
-		str = update_one_cpu(perf_cap);
-		*offset += snprintf(buf + *offset, MAX_STR_LENGTH -
-				    *offset, " TYPE [%s]", str);
-		buf[MAX_STR_LENGTH - 1] = '\0';
-		lpmd_log_debug("\t\t\t%s\n", buf);
+	/*
+	 * The previous update ended with a full message, as the kernel does
+	 * for the CPU count of an instance being a multiple of HFI_CHUNK_CPUS
+	 */
+	if (hfi_chunk_last >= 0 && caps[0].cpu <= hfi_chunk_last) {
+		lpmd_log_debug("\tHFI update closed after CPU %d\n", hfi_chunk_last);
+		hfi_chunk_last = -1;
+		hfi_stats.updates++;
+		process_one_event();
+	}
 
-		*index = 0;
-		*offset = 0;
+	for (i = 0; i < nr; i++) {
+		lpmd_log_debug("\t\t\tCPU %3d:  PERF [%4d]  EFF [%4d]  TYPE [%s]\n",
+			       caps[i].cpu, caps[i].perf, caps[i].eff,
+			       hfi_cap_type(caps[i].perf, caps[i].eff));
+		update_one_cpu(&caps[i]);
+	}
 
-		if (*first_cpu == -1)
-			*first_cpu = perf_cap->cpu;
-		*last_cpu = perf_cap->cpu;
-		*nr_cpus += 1;
+	if (nr == HFI_CHUNK_CPUS && caps[nr - 1].cpu < get_max_online_cpu()) {
+		hfi_chunk_last = caps[nr - 1].cpu;
+		hfi_chunk_since = hfi_now_ms();
+		return;
 	}
+
+	hfi_chunk_last = -1;
+	hfi_stats.updates++;
+	process_one_event();
 }
 
 static int handle_event(struct nl_msg *n, void *arg)
@@ -277,11 +555,9 @@ static int handle_event(struct nl_msg *n, void *arg)
 	struct nlmsghdr *nlh = nlmsg_hdr(n);
 	struct genlmsghdr *genlhdr = genlmsg_hdr(nlh);
 	struct nlattr *attrs[THERMAL_GENL_ATTR_MAX + 1];
+	struct perf_cap *caps;
 	struct nlattr *cap;
-	struct perf_cap perf_cap;
-	int first_cpu = -1, last_cpu = -1, nr_cpus = 0;
-	int j, index = 0, offset = 0;
-	char buf[MAX_STR_LENGTH];
+	int j, nr = 0, index = 0;
 
 	if (genlhdr->cmd != THERMAL_GENL_EVENT_CAPACITY_CHANGE)
 		return 0;
@@ -289,14 +565,34 @@ static int handle_event(struct nl_msg *n, void *arg)
 	if (genlmsg_parse(nlh, 0, attrs, THERMAL_GENL_ATTR_MAX, NULL))
 		return -1;
 
-	perf_cap.eff = -1;
-	perf_cap.perf = -1;
-	perf_cap.cpu = -1;
+	if (!attrs[THERMAL_GENL_ATTR_CAPACITY])
+		return 0;
 
+	/* CPU, PERF and EFF attributes for each CPU */
 	nla_for_each_nested(cap, attrs[THERMAL_GENL_ATTR_CAPACITY], j)
-		__handle_event(cap, &index, &offset, buf, &perf_cap,
-			       &first_cpu, &last_cpu, &nr_cpus);
-	process_one_event(first_cpu, last_cpu, nr_cpus);
+		index++;
+
+	caps = calloc(index / 3 + 1, sizeof(*caps));
+	if (!caps)
+		return -1;
+
+	index = 0;
+	nla_for_each_nested(cap, attrs[THERMAL_GENL_ATTR_CAPACITY], j) {
+		switch (index++ % 3) {
+		case 0:
+			caps[nr].cpu = nla_get_u32(cap);
+			break;
+		case 1:
+			caps[nr].perf = nla_get_u32(cap);
+			break;
+		default:
+			caps[nr++].eff = nla_get_u32(cap);
+			break;
+		}
+	}
+
+	hfi_process_caps(caps, nr);
+	free(caps);
 
 	return 0;
 }
@@ -310,12 +606,68 @@ int hfi_kill(void)
 	return 0;
 }
 
+#define HFI_RCVBUF		(256 * 1024)
+#define HFI_RCVBUF_MAX		(4 * 1024 * 1024)
+/* Datagrams received per wakeup, so a storm can't starve the other events */
+#define HFI_RECV_BUDGET		32
+
+static int hfi_rcvbuf = HFI_RCVBUF;
+
+/*
+ * The socket overflowed and updates were lost. Drop the update being
+ * reassembled, grow the receive buffer for next time and evaluate the
+ * hints again from the latest capabilities known for each CPU.
+ */
+static void hfi_resync(void)
+{
+	hfi_stats.resyncs++;
+	if (hfi_chunk_last >= 0)
+		hfi_stats.dropped++;
+	hfi_chunk_last = -1;
+
+	if (hfi_rcvbuf < HFI_RCVBUF_MAX) {
+		hfi_rcvbuf *= 2;
+		if (nl_socket_set_buffer_size(drv.nl_handle, hfi_rcvbuf, 0))
+			lpmd_log_warn("Failed to grow HFI receive buffer to %d\n", hfi_rcvbuf);
+	}
+
+	lpmd_log_warn("HFI events lost, resync %u\n", hfi_stats.resyncs);
+	process_one_event();
+}
+
 int hfi_update(void)
 {
-	int err = 0;
+	int i, err;
 
-	while (!err)
+	for (i = 0; i < HFI_RECV_BUDGET; i++) {
 		err = nl_recvmsgs(drv.nl_handle, drv.nl_cb);
+		/* ENOBUFS */
+		if (err == -NLE_NOMEM) {
+			hfi_resync();
+			continue;
+		}
+		if (err < 0)
+			break;
+	}
+
+	return 0;
+}
+
+void hfi_get_stats(struct hfi_stats *stats)
+{
+	*stats = hfi_stats;
+}
+
+/* Start with the capabilities of all CPUs unknown */
+static int hfi_alloc_caps(void)
+{
+	free(hfi_caps);
+	hfi_caps = calloc(get_max_cpus(), sizeof(*hfi_caps));
+	if (!hfi_caps) {
+		lpmd_log_error("Failed to allocate HFI capabilities\n");
+		return -1;
+	}
+	memset(hfi_caps, -1, get_max_cpus() * sizeof(*hfi_caps));
 
 	return 0;
 }
@@ -327,6 +679,10 @@ int hfi_init(void)
 	int mcast_id;
 
 	cpumask_reset(CPUMASK_HFI_LAST);
+	cpumask_reset(CPUMASK_HFI_PENDING);
+
+	if (hfi_alloc_caps())
+		goto err_proc;
 
 	signal(SIGPIPE, SIG_IGN);
 
@@ -361,6 +717,9 @@ int hfi_init(void)
 		goto err_proc;
 	}
 
+	if (nl_socket_set_buffer_size(sock, hfi_rcvbuf, 0))
+		lpmd_log_warn("Failed to set HFI receive buffer to %d\n", hfi_rcvbuf);
+
 	nl_cb_set(cb, NL_CB_SEQ_CHECK, NL_CB_CUSTOM, seq_check_handler, &done);
 	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, handle_event, NULL);
 
@@ -371,3 +730,443 @@ int hfi_init(void)
 
 err_proc: return -1;
 }
+
+/*
+ * Event replay. Capacity changes are read from a file and fed through the
+ * same parsing, reassembly, hint evaluation and coalescing as the ones
+ * received from the kernel, to check the handling of a trace and measure
+ * its cost without HFI hardware or a netlink socket. Time is simulated:
+ * each message comes at its trace time, the pending transitions are
+ * applied when they are due in between.
+ *
+ * The file holds either raw netlink messages of the thermal event group,
+ * back to back, or text with one capacity update per line as "CPU PERF EFF"
+ * triples, optionally preceded by "@MS", the time of the update from the
+ * start of the trace. Text updates are split into HFI_CHUNK_CPUS CPU
+ * messages like the kernel does. Messages without a time come
+ * HFI_REPLAY_STEP_MS after the previous one.
+ */
+#define HFI_REPLAY_STEP_MS	1
+
+struct hfi_replay_msgs {
+	struct nl_msg **msgs;
+	uint64_t *times;
+	int nr;
+	int size;
+	/* Highest CPU number in the trace */
+	int max_cpu;
+};
+
+static int hfi_replay_add(struct hfi_replay_msgs *replay, struct nl_msg *msg, uint64_t time)
+{
+	struct nl_msg **msgs;
+	uint64_t *times;
+
+	if (!msg)
+		return -1;
+
+	if (replay->nr == replay->size) {
+		replay->size = replay->size ? replay->size * 2 : 64;
+		msgs = realloc(replay->msgs, replay->size * sizeof(*msgs));
+		if (msgs)
+			replay->msgs = msgs;
+		times = realloc(replay->times, replay->size * sizeof(*times));
+		if (times)
+			replay->times = times;
+		if (!msgs || !times) {
+			nlmsg_free(msg);
+			return -1;
+		}
+	}
+
+	replay->times[replay->nr] = time;
+	replay->msgs[replay->nr++] = msg;
+	return 0;
+}
+
+static struct nl_msg *hfi_replay_build(struct perf_cap *caps, int nr)
+{
+	struct nl_msg *msg;
+	struct nlattr *nest;
+	int i;
+
+	msg = nlmsg_alloc();
+	if (!msg)
+		return NULL;
+
+	if (!genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ, 0, 0, 0,
+			 THERMAL_GENL_EVENT_CAPACITY_CHANGE, THERMAL_GENL_VERSION))
+		goto err;
+
+	nest = nla_nest_start(msg, THERMAL_GENL_ATTR_CAPACITY);
+	if (!nest)
+		goto err;
+
+	for (i = 0; i < nr; i++) {
+		if (nla_put_u32(msg, THERMAL_GENL_ATTR_CAPACITY_CPU_ID, caps[i].cpu) ||
+		    nla_put_u32(msg, THERMAL_GENL_ATTR_CAPACITY_CPU_PERF, caps[i].perf) ||
+		    nla_put_u32(msg, THERMAL_GENL_ATTR_CAPACITY_CPU_EFF, caps[i].eff))
+			goto err;
+	}
+
+	nla_nest_end(msg, nest);
+	return msg;
+
+err:
+	nlmsg_free(msg);
+	return NULL;
+}
+
+/* Highest CPU number reported by a capacity change message, -1 if none */
+static int hfi_msg_max_cpu(struct nl_msg *n)
+{
+	struct nlmsghdr *nlh = nlmsg_hdr(n);
+	struct nlattr *attrs[THERMAL_GENL_ATTR_MAX + 1];
+	struct nlattr *cap;
+	int j, index = 0, max_cpu = -1;
+
+	if (genlmsg_hdr(nlh)->cmd != THERMAL_GENL_EVENT_CAPACITY_CHANGE ||
+	    genlmsg_parse(nlh, 0, attrs, THERMAL_GENL_ATTR_MAX, NULL) ||
+	    !attrs[THERMAL_GENL_ATTR_CAPACITY])
+		return -1;
+
+	nla_for_each_nested(cap, attrs[THERMAL_GENL_ATTR_CAPACITY], j) {
+		if (index++ % 3 == 0 && (int)nla_get_u32(cap) > max_cpu)
+			max_cpu = nla_get_u32(cap);
+	}
+
+	return max_cpu;
+}
+
+static int hfi_replay_load_raw(struct hfi_replay_msgs *replay, char *buf, int len)
+{
+	struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+	uint64_t time = 0;
+
+	while (nlmsg_ok(nlh, len)) {
+		if (hfi_replay_add(replay, nlmsg_convert(nlh), time))
+			return -1;
+		time += HFI_REPLAY_STEP_MS;
+		nlh = nlmsg_next(nlh, &len);
+	}
+
+	if (len) {
+		lpmd_log_error("Truncated netlink message in HFI replay file\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int hfi_replay_load_text(struct hfi_replay_msgs *replay, char *buf)
+{
+	struct perf_cap *caps = NULL;
+	char *line, *next, *end;
+	uint64_t time = 0, t;
+	int vals[3];
+	int size = 0, lineno = 0, timed = 0;
+	int nr, i, n;
+
+	for (line = buf; line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		lineno++;
+
+		end = strchr(line, '#');
+		if (end)
+			*end = '\0';
+
+		while (isspace(*line))
+			line++;
+		if (!*line)
+			continue;
+
+		if (*line == '@') {
+			t = strtoull(line + 1, &end, 0);
+			if (end == line + 1 || (timed && t < time))
+				goto err_parse;
+			time = t;
+			line = end;
+		} else if (timed) {
+			time += HFI_REPLAY_STEP_MS;
+		}
+		timed = 1;
+
+		nr = 0;
+		n = 0;
+		while (1) {
+			while (isspace(*line))
+				line++;
+			if (!*line)
+				break;
+
+			vals[n] = strtol(line, &end, 0);
+			if (end == line || vals[n] < 0)
+				goto err_parse;
+			line = end;
+
+			if (++n < 3)
+				continue;
+			n = 0;
+
+			if (nr == size) {
+				struct perf_cap *tmp;
+
+				size = size ? size * 2 : HFI_CHUNK_CPUS;
+				tmp = realloc(caps, size * sizeof(*caps));
+				if (!tmp)
+					goto err;
+				caps = tmp;
+			}
+			caps[nr].cpu = vals[0];
+			caps[nr].perf = vals[1];
+			caps[nr++].eff = vals[2];
+		}
+
+		if (n || !nr)
+			goto err_parse;
+
+		for (i = 0; i < nr; i += HFI_CHUNK_CPUS) {
+			n = nr - i < HFI_CHUNK_CPUS ? nr - i : HFI_CHUNK_CPUS;
+			if (hfi_replay_add(replay, hfi_replay_build(&caps[i], n), time))
+				goto err;
+		}
+	}
+
+	free(caps);
+	return 0;
+
+err_parse:
+	lpmd_log_error("Invalid HFI replay line %d, expect [@MS] \"CPU PERF EFF\" triples\n",
+		       lineno);
+err:
+	free(caps);
+	return -1;
+}
+
+static int hfi_replay_load(struct hfi_replay_msgs *replay, const char *path)
+{
+	struct stat st;
+	char *buf;
+	int fd, ret, len, i, cpu;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		lpmd_log_error("Can't open HFI replay file %s\n", path);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	buf = calloc(1, st.st_size + 1);
+	if (!buf) {
+		close(fd);
+		return -1;
+	}
+
+	len = read(fd, buf, st.st_size);
+	close(fd);
+	if (len != st.st_size) {
+		lpmd_log_error("Failed to read HFI replay file %s\n", path);
+		free(buf);
+		return -1;
+	}
+
+	/* Netlink headers start with a native 32bit length, text has no NUL */
+	if (memchr(buf, '\0', len))
+		ret = hfi_replay_load_raw(replay, buf, len);
+	else
+		ret = hfi_replay_load_text(replay, buf);
+
+	free(buf);
+	if (ret)
+		return ret;
+
+	replay->max_cpu = -1;
+	for (i = 0; i < replay->nr; i++) {
+		cpu = hfi_msg_max_cpu(replay->msgs[i]);
+		if (cpu > replay->max_cpu)
+			replay->max_cpu = cpu;
+	}
+
+	return 0;
+}
+
+/*
+ * The CPUs of the trace are the online ones, so the masks and the
+ * reassembly of the updates match the system the trace comes from.
+ */
+static int hfi_replay_cpus(struct hfi_replay_msgs *replay)
+{
+	int cpu;
+
+	if (replay->max_cpu < 0) {
+		lpmd_log_error("No CPU in the HFI replay file\n");
+		return -1;
+	}
+
+	set_max_cpus(replay->max_cpu + 1);
+	cpumask_reset(CPUMASK_ONLINE);
+	for (cpu = 0; cpu <= replay->max_cpu; cpu++)
+		cpumask_add_cpu(cpu, CPUMASK_ONLINE);
+	set_max_online_cpu(replay->max_cpu);
+
+	return hfi_alloc_caps();
+}
+
+/*
+ * Coalescing, dwell and ranking come from the configuration, @config_file
+ * or the default one. Without one, updates are applied right away.
+ */
+static int hfi_replay_config(const char *config_file)
+{
+	struct lpmd_config_t *config = get_lpmd_config();
+
+	if (config_file)
+		snprintf(config->file_name, MAX_FILE_NAME_PATH, "%s", config_file);
+
+	if (lpmd_get_config(config) != LPMD_SUCCESS) {
+		if (config_file) {
+			lpmd_log_error("Failed to load %s\n", config_file);
+			return -1;
+		}
+		lpmd_log_warn("No configuration, HFI updates applied right away\n");
+		return 0;
+	}
+
+	lpmd_build_config_states(config);
+	return 0;
+}
+
+/* Transitions applied so far, to print the new ones when tracing */
+static unsigned int hfi_replay_applied;
+static int hfi_replay_tracing;
+
+static void hfi_replay_print_states(void)
+{
+	struct lpmd_config_t *config = get_lpmd_config();
+	struct lpmd_config_state_t *state;
+	int i;
+
+	printf("\tLPM CPUs: %s\n", get_cpus_str(CPUMASK_HFI_LAST) ? : "none");
+
+	for (i = CONFIG_STATE_BASE; i < CONFIG_STATE_BASE + config->config_state_count; i++) {
+		state = &config->config_states[i];
+		if (!state->valid || (!state->hfi_most_efficient && !state->hfi_min_perf))
+			continue;
+		printf("\tstate %s CPUs: %s\n", state->name,
+		       get_cpus_str(state->cpumask_idx) ? : "none");
+	}
+}
+
+static void hfi_replay_check_applied(void)
+{
+	if (hfi_stats.applied == hfi_replay_applied)
+		return;
+
+	hfi_replay_applied = hfi_stats.applied;
+	if (!hfi_replay_tracing)
+		return;
+
+	printf("transition at %llu ms\n", (unsigned long long)hfi_replay_clock);
+	hfi_replay_print_states();
+}
+
+/* Apply the pending transitions due up to @time, then move the clock there */
+static void hfi_replay_advance(uint64_t time)
+{
+	int delay;
+
+	while ((delay = hfi_pending_delay(hfi_replay_clock)) >= 0 &&
+	       hfi_replay_clock + delay <= time) {
+		hfi_replay_clock += delay;
+		hfi_apply_pending();
+		hfi_replay_check_applied();
+		/* Nothing was due after all, don't spin */
+		if (!hfi_pending_delay(hfi_replay_clock))
+			break;
+	}
+
+	if (time > hfi_replay_clock)
+		hfi_replay_clock = time;
+}
+
+int hfi_replay(const char *path, const char *config_file, int loops)
+{
+	struct lpmd_config_t *config = get_lpmd_config();
+	struct hfi_replay_msgs replay = { 0 };
+	struct hfi_stats stats;
+	struct timespec start, end;
+	uint64_t offset, period;
+	double secs;
+	int i, j;
+	int ret = LPMD_ERROR;
+
+	if (hfi_replay_load(&replay, path))
+		goto out;
+
+	if (!replay.nr) {
+		lpmd_log_error("No HFI event in %s\n", path);
+		goto out;
+	}
+
+	if (hfi_replay_cpus(&replay))
+		goto out;
+
+	cpumask_reset(CPUMASK_HFI_LAST);
+	cpumask_reset(CPUMASK_HFI_PENDING);
+
+	if (hfi_replay_config(config_file))
+		goto out;
+
+	if (loops < 1)
+		loops = 1;
+
+	printf("HFI replay, %d messages x %d, %d CPUs, coalesce %d ms, dwell %d ms\n",
+	       replay.nr, loops, replay.max_cpu + 1, config->hfi_coalesce_ms,
+	       config->hfi_dwell_ms);
+
+	/* A single pass prints each transition with its time in the trace */
+	hfi_replay_tracing = loops == 1;
+	hfi_replaying = 1;
+	hfi_replay_clock = 0;
+	period = replay.times[replay.nr - 1] + HFI_REPLAY_STEP_MS;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0, offset = 0; i < loops; i++, offset += period) {
+		for (j = 0; j < replay.nr; j++) {
+			hfi_replay_advance(offset + replay.times[j]);
+			handle_event(replay.msgs[j], NULL);
+			hfi_apply_pending();
+			hfi_replay_check_applied();
+		}
+	}
+	/* The last pending transition is due within the coalescing or dwell time */
+	hfi_replay_advance(hfi_replay_clock + config->hfi_coalesce_ms + config->hfi_dwell_ms);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	hfi_get_stats(&stats);
+
+	printf("end at %llu ms\n", (unsigned long long)hfi_replay_clock);
+	printf("\tupdates: %u\n", stats.updates);
+	printf("\ttransitions: %u applied, %u absorbed\n", stats.applied, stats.absorbed);
+	printf("\tdropped: %u\n", stats.dropped);
+	hfi_replay_print_states();
+	/* The only line depending on the machine */
+	printf("rate: %.0f messages/s, %.0f updates/s, %.6f s\n",
+	       secs > 0 ? replay.nr * loops / secs : 0, secs > 0 ? stats.updates / secs : 0,
+	       secs);
+
+	ret = LPMD_SUCCESS;
+
+out:
+	hfi_replaying = 0;
+	for (i = 0; i < replay.nr; i++)
+		nlmsg_free(replay.msgs[i]);
+	free(replay.msgs);
+	free(replay.times);
+
+	return ret;
+}
@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <err.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
@@ -12,6 +13,7 @@
 #include <sys/file.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -20,6 +22,7 @@
 #include <sched.h>
 #include <dirent.h>
 #include <ctype.h>
+#include <limits.h>
 #include <signal.h>
 #include <netlink/genl/genl.h>
 #include <netlink/genl/family.h>
@@ -31,114 +34,408 @@ static char irq_socket_name[64];
 
 static int irqbalance_pid = -1;
 
-#define MAX_IRQS		128
+/* cpumask_version() of the CPUs last sent to irqbalance, 0 if none */
+static unsigned long long irqbalance_version;
 
 struct info_irq {
 	int irq;
-	char affinity[MAX_STR_LENGTH];
+	/* Managed or per-CPU IRQs, whose smp_affinity can't be changed */
+	int unmovable;
+	/* smp_affinity saved when the IRQ was first seen */
+	char *affinity;
+	/* smp_affinity last written by lpmd, NULL if not changed */
+	char *current;
+	/* Bitmap of the matching lpmd_irq_rules, MAX_IRQ_RULES bits */
+	unsigned int rules;
+	/* Interrupt count at the last sample and the rate since, per second */
+	int sampled;
+	unsigned long long count;
+	unsigned long rate;
+	/* Following the state cpumask, so the native balancer may move it */
+	int follow;
+	/* CPU picked by the native balancer, -1 if following the whole cpumask */
+	int balance_cpu;
 };
 
 struct info_irqs {
-	/* Cached IRQ smp_affinity info */
+	/* Cached IRQ table, rebuilt when the IRQs in /proc/irq change */
 	int nr_irqs;
-	struct info_irq irq[MAX_IRQS];
+	int size;
+	uint64_t signature;
+	/* Set on driver uevents, the IRQs may have changed behind the signature */
+	int stale;
+	struct info_irq *irq;
 };
 
 struct info_irqs info_irqs;
 struct info_irqs *info = &info_irqs;
 
+/* Native balancer, active while an LP state migrates IRQs to balance_idx */
+static enum cpumask_idx balance_idx = CPUMASK_NONE;
+static struct timespec balance_last;
+/* Next sample, in CLOCK_MONOTONIC ms, independent of the utilization poll */
+static uint64_t balance_due;
+
+/* Don't bother balancing below this total interrupt rate, per second */
+#define IRQ_BALANCE_MIN_RATE	100
+/* Interrupt rate sampling period */
+#define IRQ_BALANCE_INTERVAL_MS	1000
+
 /* Interrupt Management */
 #define SOCKET_PATH "irqbalance"
 #define SOCKET_TMPFS "/run/irqbalance"
 
+#define PATH_PROC_IRQ	"/proc/irq"
+#define PATH_PCI_DEVICES	"/sys/bus/pci/devices"
+
+/* Find the irqbalance socket, irqbalance_pid is -1 if not running */
+static void irqbalance_detect(void)
+{
+	struct dirent *entry;
+	DIR *dir;
+	int ret;
+
+	irqbalance_pid = -1;
+
+	dir = opendir(SOCKET_TMPFS);
+	if (!dir)
+		return;
+
+	do {
+		entry = readdir(dir);
+		if (entry) {
+			if (!strncmp(entry->d_name, "irqbalance", 10)) {
+				ret = sscanf(entry->d_name, "irqbalance%d.sock", &irqbalance_pid);
+				if (!ret)
+					irqbalance_pid = -1;
+			}
+		}
+	} while ((entry) && (irqbalance_pid == -1));
+
+	closedir(dir);
+
+	if (irqbalance_pid != -1)
+		snprintf(irq_socket_name, 64, "%s/%s%d.sock", SOCKET_TMPFS, SOCKET_PATH,
+			 irqbalance_pid);
+}
+
 static int irqbalance_ban_cpus(char *irq_str)
 {
-	char socket_cmd[MAX_STR_LENGTH];
-	int offset;
+	char *socket_cmd;
+	int size, pid, ret = 0;
 
 	lpmd_log_debug("\tUpdate IRQ affinity (irqbalance)\n");
-	offset = snprintf(socket_cmd, MAX_STR_LENGTH, "settings cpus %s", irq_str);
-	if (offset >= MAX_STR_LENGTH)
-		offset = MAX_STR_LENGTH - 1;
 
-	socket_cmd[offset] = '\0';
-	socket_send_cmd(irq_socket_name, socket_cmd);
+	/* No CPU list for an empty cpumask */
+	if (!irq_str) {
+		lpmd_log_debug("\tSkip irqbalance: empty cpumask\n");
+		return -1;
+	}
 
+	/* The CPU list is not bounded on large systems */
+	size = strlen("settings cpus ") + strlen(irq_str) + 1;
+	socket_cmd = malloc(size);
+	if (!socket_cmd)
+		return -1;
+
+	snprintf(socket_cmd, size, "settings cpus %s", irq_str);
 	lpmd_log_debug("\tSend socket command %s\n", socket_cmd);
-	return 0;
+
+	if (socket_send_cmd(irq_socket_name, socket_cmd) == LPMD_SUCCESS)
+		goto out;
+
+	/* irqbalance may have been restarted with a new socket */
+	pid = irqbalance_pid;
+	irqbalance_detect();
+	if (irqbalance_pid == -1) {
+		lpmd_log_info("irqbalance not running anymore, run in native mode\n");
+		ret = -1;
+		goto out;
+	}
+
+	if (irqbalance_pid != pid &&
+	    socket_send_cmd(irq_socket_name, socket_cmd) == LPMD_SUCCESS)
+		goto out;
+
+	lpmd_log_warn("Failed to send irqbalance command %s\n", socket_cmd);
+	ret = -1;
+out:
+	free(socket_cmd);
+	return ret;
 }
 
-static int native_restore_irqs(void)
+/*
+ * Hex cpumask helpers. The kernel formats smp_affinity in 32bit groups
+ * separated by commas while lpmd uses one string, so compare them digit
+ * by digit from the lowest CPU, ignoring the commas.
+ */
+static int hexmask_digit(const char *str, int *pos)
 {
-	char path[MAX_STR_LENGTH];
-	int i;
+	while (*pos >= 0 && !isxdigit(str[*pos]))
+		(*pos)--;
+	if (*pos < 0)
+		return 0;
 
-	lpmd_log_debug("\tRestore IRQ affinity (native)\n");
+	return isdigit(str[*pos]) ? str[(*pos)--] - '0' : tolower(str[(*pos)--]) - 'a' + 10;
+}
 
-	for (i = 0; i < info->nr_irqs; i++) {
-		char *str = info->irq[i].affinity;
+/* Return 1 if all the CPUs in @sub are also set in @mask */
+static int hexmask_subset(const char *sub, const char *mask)
+{
+	int pos_sub = strlen(sub) - 1;
+	int pos_mask = strlen(mask) - 1;
 
-		snprintf(path, MAX_STR_LENGTH, "/proc/irq/%i/smp_affinity", info->irq[i].irq);
+	while (pos_sub >= 0) {
+		int s = hexmask_digit(sub, &pos_sub);
+		int m = hexmask_digit(mask, &pos_mask);
 
-		lpmd_write_str(path, str, LPMD_LOG_DEBUG);
+		if (s & ~m)
+			return 0;
 	}
-	memset(info, 0, sizeof(*info));
-	return 0;
+	return 1;
 }
 
-static int irq_updated;
+static int hexmask_equal(const char *a, const char *b)
+{
+	return hexmask_subset(a, b) && hexmask_subset(b, a);
+}
 
-static int update_one_irq(int irq, char *irq_str)
+/* Read an IRQ cpumask file of any length, returned allocated */
+static char *irq_read_mask(int irq, const char *name)
 {
 	char path[MAX_STR_LENGTH];
-	char *str = NULL;
+	char *buf = NULL;
 	size_t size = 0;
 	FILE *filep;
+	ssize_t len;
 
-	if (info->nr_irqs >= (MAX_IRQS - 1)) {
-		lpmd_log_error("Too many IRQs\n");
-		return -1;
+	snprintf(path, MAX_STR_LENGTH, PATH_PROC_IRQ "/%i/%s", irq, name);
+	filep = fopen(path, "r");
+	if (!filep)
+		return NULL;
+
+	len = getline(&buf, &size, filep);
+	fclose(filep);
+	if (len <= 0) {
+		free(buf);
+		return NULL;
 	}
 
-	snprintf(path, MAX_STR_LENGTH, "/proc/irq/%i/smp_affinity", irq);
+	/* Remove the Newline */
+	if (buf[len - 1] == '\n')
+		buf[len - 1] = '\0';
+	return buf;
+}
 
-	if (!irq_updated) {
-		info->irq[info->nr_irqs].irq = irq;
-		filep = fopen(path, "r");
-		if (!filep)
-			return -1;
+/* Room for a hex cpumask of all possible CPUs, in 32bit groups */
+static int hexmask_size(void)
+{
+	return get_max_cpus() / 4 + get_max_cpus() / 32 + 2;
+}
 
-		if (getline(&str, &size, filep) <= 0) {
-			lpmd_log_error("Failed to get IRQ%d smp_affinity\n", irq);
-			free(str);
-			fclose(filep);
-			return -1;
-		}
+/* splitmix64 finalizer */
+static uint64_t irq_hash64(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
 
-		fclose(filep);
+/*
+ * Cheap check for IRQs being allocated or freed: one readdir of /proc/irq
+ * instead of parsing /proc/interrupts on every transition.
+ *
+ * Each IRQ is hashed with the inode of its /proc/irq/N directory, which
+ * is recreated when the IRQ descriptor is freed and allocated again, so a
+ * reused IRQ number changes the signature too. The per-IRQ hashes are
+ * summed as readdir gives no ordering guarantee.
+ */
+static uint64_t irq_table_signature(void)
+{
+	uint64_t count = 0, sum = 0;
+	struct dirent *entry;
+	DIR *dir;
+
+	dir = opendir(PATH_PROC_IRQ);
+	if (!dir)
+		return 0;
+
+	while ((entry = readdir(dir)) != NULL) {
+		if (!isdigit(entry->d_name[0]))
+			continue;
+		count++;
+		sum += irq_hash64(strtoull(entry->d_name, NULL, 10) << 32 ^
+				  (uint64_t)entry->d_ino);
+	}
+	closedir(dir);
+
+	return irq_hash64(sum ^ count);
+}
+
+/*
+ * A driver bound to a device that keeps its IRQ descriptor, as legacy
+ * IRQs do, leaves /proc/irq unchanged: drop the cache on driver uevents.
+ */
+void irq_table_invalidate(void)
+{
+	info->stale = 1;
+}
+
+static struct info_irq *irq_table_find(struct info_irq *irqs, int nr, int irq)
+{
+	int i;
 
-		snprintf(info->irq[info->nr_irqs].affinity, MAX_STR_LENGTH, "%s", str);
+	for (i = 0; i < nr; i++) {
+		if (irqs[i].irq == irq)
+			return &irqs[i];
+	}
+	return NULL;
+}
 
-		free(str);
+static void irq_table_free(struct info_irq *irqs, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		free(irqs[i].affinity);
+		free(irqs[i].current);
+	}
+	free(irqs);
+}
+
+/*
+ * Skip the IRQ number and the per-CPU counts of a /proc/interrupts line,
+ * leaving the chip name, hwirq and action names. The counts are summed
+ * into @count if not NULL.
+ */
+static char *irq_line_desc(char *line, unsigned long long *count)
+{
+	char *c = strchr(line, ':') + 1;
+	char *p;
 
-		/* Remove the Newline */
-		size = strnlen(info->irq[info->nr_irqs].affinity, MAX_STR_LENGTH);
-		info->irq[info->nr_irqs].affinity[size - 1] = '\0';
+	if (count)
+		*count = 0;
 
-		info->nr_irqs++;
+	while (1) {
+		while (isblank(*c))
+			c++;
+		for (p = c; isdigit(*p); p++)
+			;
+		if (p == c || (*p && !isspace(*p)))
+			break;
+		if (count)
+			*count += strtoull(c, NULL, 10);
+		c = p;
 	}
 
-	return lpmd_write_str(path, irq_str, LPMD_LOG_DEBUG);
+	p = strchr(c, '\n');
+	if (p)
+		*p = '\0';
+	return c;
+}
+
+static unsigned int irq_match_name(char *desc)
+{
+	struct lpmd_config_t *config = get_lpmd_config();
+	unsigned int rules = 0;
+	int i;
+
+	for (i = 0; i < config->irq_rule_count; i++) {
+		if (config->irq_rules[i].name[0] && strstr(desc, config->irq_rules[i].name))
+			rules |= 1U << i;
+	}
+	return rules;
 }
 
-static int native_update_irqs(char *irq_str)
+static void irq_set_rules(int nr, unsigned int rules)
 {
+	struct info_irq *irq = irq_table_find(info->irq, info->nr_irqs, nr);
+
+	if (irq)
+		irq->rules |= rules;
+}
+
+/* Match the MSI and legacy IRQs of the PCI devices bound to the rule drivers */
+static void irq_match_drivers(void)
+{
+	struct lpmd_config_t *config = get_lpmd_config();
+	char path[PATH_MAX];
+	char buf[PATH_MAX];
+	struct dirent *entry;
+	DIR *dir;
+	int i, len, nr;
+
+	for (i = 0; i < config->irq_rule_count; i++) {
+		if (config->irq_rules[i].driver[0])
+			break;
+	}
+	if (i == config->irq_rule_count)
+		return;
+
+	dir = opendir(PATH_PCI_DEVICES);
+	if (!dir)
+		return;
+
+	while ((entry = readdir(dir)) != NULL) {
+		struct dirent *msi;
+		DIR *msi_dir;
+		unsigned int rules = 0;
+		char *drv;
+
+		if (entry->d_name[0] == '.')
+			continue;
+
+		if (snprintf(path, sizeof(path), PATH_PCI_DEVICES "/%s/driver",
+			     entry->d_name) >= (int)sizeof(path))
+			continue;
+		len = readlink(path, buf, sizeof(buf) - 1);
+		if (len <= 0)
+			continue;
+		buf[len] = '\0';
+		drv = strrchr(buf, '/');
+		drv = drv ? drv + 1 : buf;
+
+		for (i = 0; i < config->irq_rule_count; i++) {
+			if (!strcmp(drv, config->irq_rules[i].driver))
+				rules |= 1U << i;
+		}
+		if (!rules)
+			continue;
+
+		/* Same length as the driver link path, which fit */
+		snprintf(path, sizeof(path), PATH_PCI_DEVICES "/%s/msi_irqs", entry->d_name);
+		msi_dir = opendir(path);
+		if (msi_dir) {
+			while ((msi = readdir(msi_dir)) != NULL) {
+				if (isdigit(msi->d_name[0]))
+					irq_set_rules(strtol(msi->d_name, NULL, 10), rules);
+			}
+			closedir(msi_dir);
+		}
+
+		/* Legacy INTx */
+		snprintf(path, sizeof(path), PATH_PCI_DEVICES "/%s/irq", entry->d_name);
+		if (!lpmd_read_int(path, &nr, -1) && nr > 0)
+			irq_set_rules(nr, rules);
+	}
+	closedir(dir);
+}
+
+/*
+ * Build the IRQ table from /proc/interrupts. IRQs already present in the
+ * old table keep their saved and current affinity.
+ */
+static int irq_table_refresh(void)
+{
+	struct info_irq *irqs = NULL, *old;
+	int nr = 0, size = 0;
 	char *line = NULL;
-	size_t size = 0;
+	size_t len = 0;
 	FILE *filep;
 
-	lpmd_log_debug("\tUpdate IRQ affinity (native)\n");
-
 	filep = fopen("/proc/interrupts", "r");
 	if (!filep) {
 		perror("Error open /proc/interrupts\n");
@@ -146,73 +443,584 @@ static int native_update_irqs(char *irq_str)
 	}
 
 	/* first line is the header we don't need; nuke it */
-	if (getline(&line, &size, filep) <= 0) {
+	if (getline(&line, &len, filep) <= 0) {
 		perror("Error getline\n");
 		free(line);
 		fclose(filep);
 		return -1;
 	}
-	free(line);
 
-	while (!feof(filep)) {
-		int number;
+	while (getline(&line, &len, filep) > 0) {
+		struct info_irq *irq;
 		char *c;
 
-		line = NULL;
-		size = 0;
-
-		if (getline(&line, &size, filep) <= 0) {
-			free(line);
-			break;
-		}
-
 		/* lines with letters in front are special, like NMI count. Ignore */
 		c = line;
 		while (isblank(*(c)))
 			c++;
 
-		if (!isdigit(*c)) {
-			free(line);
+		if (!isdigit(*c))
 			break;
-		}
-		c = strchr(line, ':');
-		if (!c) {
-			free(line);
+
+		if (!strchr(c, ':'))
 			continue;
+
+		if (nr == size) {
+			size = size ? size * 2 : 128;
+			irq = realloc(irqs, size * sizeof(*irqs));
+			if (!irq) {
+				irq_table_free(irqs, nr);
+				free(line);
+				fclose(filep);
+				return -1;
+			}
+			irqs = irq;
+		}
+
+		irq = &irqs[nr];
+		memset(irq, 0, sizeof(*irq));
+		irq->irq = strtoul(c, NULL, 10);
+		irq->rules = irq_match_name(irq_line_desc(c, NULL));
+		irq->balance_cpu = -1;
+
+		old = irq_table_find(info->irq, info->nr_irqs, irq->irq);
+		if (old) {
+			old->rules = irq->rules;
+			*irq = *old;
+			old->affinity = NULL;
+			old->current = NULL;
+		} else {
+			irq->affinity = irq_read_mask(irq->irq, "smp_affinity");
 		}
 
-		*c = 0;
-		number = strtoul(line, NULL, 10);
+		/* No smp_affinity means the IRQ can't be migrated */
+		if (!irq->affinity)
+			irq->unmovable = 1;
+		nr++;
+	}
+
+	free(line);
+	fclose(filep);
+
+	irq_table_free(info->irq, info->nr_irqs);
+	info->irq = irqs;
+	info->nr_irqs = nr;
+	info->size = size;
+
+	irq_match_drivers();
+
+	lpmd_log_debug("\tIRQ table: %d IRQs\n", nr);
+	return 0;
+}
+
+/* Update the interrupt rate of each IRQ from the /proc/interrupts counts */
+static int irq_sample_rates(void)
+{
+	unsigned long long count;
+	struct timespec now;
+	long elapsed_ms = 0;
+	char *line = NULL;
+	size_t len = 0;
+	FILE *filep;
+	int pos = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (balance_last.tv_sec || balance_last.tv_nsec)
+		elapsed_ms = (now.tv_sec - balance_last.tv_sec) * 1000 +
+			     (now.tv_nsec - balance_last.tv_nsec) / 1000000;
 
-		update_one_irq(number, irq_str);
+	filep = fopen("/proc/interrupts", "r");
+	if (!filep)
+		return -1;
+
+	/* Skip the header */
+	if (getline(&line, &len, filep) <= 0) {
 		free(line);
+		fclose(filep);
+		return -1;
+	}
+
+	while (getline(&line, &len, filep) > 0) {
+		struct info_irq *irq;
+		int nr;
+		char *c;
+
+		c = line;
+		while (isblank(*c))
+			c++;
+
+		if (!isdigit(*c))
+			break;
+
+		if (!strchr(c, ':'))
+			continue;
+
+		nr = strtoul(c, NULL, 10);
+
+		/* Same order as the table, avoid searching in the common case */
+		if (pos < info->nr_irqs && info->irq[pos].irq == nr)
+			irq = &info->irq[pos];
+		else
+			irq = irq_table_find(info->irq, info->nr_irqs, nr);
+		if (!irq)
+			continue;
+		pos = irq - info->irq + 1;
+
+		irq_line_desc(c, &count);
+		if (irq->sampled && elapsed_ms > 0 && count >= irq->count)
+			irq->rate = (count - irq->count) * 1000 / elapsed_ms;
+		else
+			irq->rate = 0;
+		irq->count = count;
+		irq->sampled = 1;
 	}
 
+	free(line);
 	fclose(filep);
 
-	irq_updated = 1;
+	balance_last = now;
+	return 0;
+}
+
+static int irq_write_affinity(struct info_irq *irq, char *str)
+{
+	char path[MAX_STR_LENGTH];
+	int fd, ret;
+
+	snprintf(path, MAX_STR_LENGTH, PATH_PROC_IRQ "/%i/smp_affinity", irq->irq);
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -1;
+
+	ret = write(fd, str, strlen(str));
+	if (ret < 0) {
+		/* Managed IRQs always fail with EIO, don't try again */
+		if (errno == EIO) {
+			lpmd_log_debug("\tIRQ%d is not movable\n", irq->irq);
+			irq->unmovable = 1;
+		} else {
+			lpmd_log_debug("\tWrite \"%s\" to %s failed: %s\n", str, path, strerror(errno));
+		}
+	}
+	close(fd);
+
+	return ret < 0 ? -1 : 0;
+}
+
+static uint64_t irq_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void irq_balance_reset(enum cpumask_idx idx)
+{
+	int i;
+
+	for (i = 0; i < info->nr_irqs; i++) {
+		info->irq[i].follow = 0;
+		info->irq[i].balance_cpu = -1;
+	}
+	balance_idx = idx;
+	balance_last.tv_sec = 0;
+	balance_last.tv_nsec = 0;
+	/* Take the baseline sample right away */
+	balance_due = irq_now_ms();
+}
+
+static int native_restore_irqs(void)
+{
+	int i;
+
+	lpmd_log_debug("\tRestore IRQ affinity (native)\n");
+
+	irq_balance_reset(CPUMASK_NONE);
+
+	for (i = 0; i < info->nr_irqs; i++) {
+		struct info_irq *irq = &info->irq[i];
+
+		if (!irq->current || irq->unmovable)
+			continue;
+
+		irq_write_affinity(irq, irq->affinity);
+		free(irq->current);
+		irq->current = NULL;
+	}
 	return 0;
 }
 
+static int update_one_irq(struct info_irq *irq, char *irq_str)
+{
+	char *effective;
+
+	if (irq->unmovable)
+		return 0;
+
+	/* Skip the IRQs already following the requested affinity */
+	if (irq->current ? !strcmp(irq->current, irq_str) :
+			   hexmask_equal(irq->affinity, irq_str))
+		return 0;
+
+	if (irq_write_affinity(irq, irq_str))
+		return -1;
+
+	free(irq->current);
+	irq->current = strdup(irq_str);
+
+	/* Some IRQs move lazily, on their next interrupt */
+	effective = irq_read_mask(irq->irq, "effective_affinity");
+	if (effective && !hexmask_subset(effective, irq_str))
+		lpmd_log_debug("\tIRQ%d effective affinity %s pending\n", irq->irq, effective);
+	free(effective);
+
+	return 1;
+}
+
+/* Format a single CPU as smp_affinity, in 32bit groups like the kernel */
+static void cpu_to_hexmask(int cpu, char *buf, int size)
+{
+	int pos = 0;
+	int i;
+
+	for (i = cpu / 4; i >= 0 && pos < size - 2; i--) {
+		buf[pos++] = i == cpu / 4 ? "1248"[cpu % 4] : '0';
+		if (i && !(i % 8))
+			buf[pos++] = ',';
+	}
+	buf[pos] = '\0';
+}
+
+/* Round robin over the CPUs of @idx */
+static int irq_next_cpu(enum cpumask_idx idx, int prev)
+{
+	int max = get_max_cpus();
+	int i, cpu;
+
+	for (i = 1; i <= max; i++) {
+		cpu = (prev + i) % max;
+		if (cpumask_test_cpu(cpu, idx))
+			return cpu;
+	}
+	return -1;
+}
+
+static int irq_rule_applies(struct lpmd_irq_rule *rule, struct lpmd_config_state_t *state)
+{
+	int i;
+
+	if (!rule->nr_state_ids)
+		return 1;
+
+	for (i = 0; i < rule->nr_state_ids; i++) {
+		if (rule->state_ids[i] == state->id)
+			return 1;
+	}
+	return 0;
+}
+
+/* The first rule matching the IRQ that applies to @state, NULL if none */
+static struct lpmd_irq_rule *irq_state_rule(struct info_irq *irq,
+					    struct lpmd_config_state_t *state)
+{
+	struct lpmd_config_t *config = get_lpmd_config();
+	int i;
+
+	if (irq->unmovable)
+		return NULL;
+
+	for (i = 0; i < config->irq_rule_count; i++) {
+		if ((irq->rules & (1U << i)) && irq_rule_applies(&config->irq_rules[i], state))
+			return &config->irq_rules[i];
+	}
+	return NULL;
+}
+
+static int native_update_irqs(struct lpmd_config_state_t *state)
+{
+	struct lpmd_config_t *config = get_lpmd_config();
+	char *spread_str, *pcore_str;
+	enum cpumask_idx idx;
+	uint64_t signature;
+	int i, updated = 0;
+	int cpu = -1;
+	char *irq_str;
+
+	irq_str = get_proc_irq_str(state->cpumask_idx);
+	if (!irq_str)
+		return -1;
+
+	lpmd_log_debug("\tUpdate IRQ affinity (native)\n");
+
+	signature = irq_table_signature();
+	if (!info->irq || info->stale || signature != info->signature) {
+		if (irq_table_refresh())
+			return -1;
+		info->signature = signature;
+		info->stale = 0;
+	}
+
+	spread_str = malloc(hexmask_size());
+	if (!spread_str)
+		return -1;
+
+	/* IRQ_POLICY_KEEP, without P-cores the IRQs keep their original affinity */
+	pcore_str = cpumask_has_cpu(CPUMASK_PCORE) ? get_proc_irq_str(CPUMASK_PCORE) : NULL;
+
+	/*
+	 * Balance only in LP states, a state following all online CPUs is left
+	 * alone. Balancer placements only hold within the same cpumask.
+	 */
+	idx = cpumask_equal(state->cpumask_idx, CPUMASK_ONLINE) ?
+	      CPUMASK_NONE : state->cpumask_idx;
+	if (balance_idx != idx)
+		irq_balance_reset(idx);
+
+	for (i = 0; i < info->nr_irqs; i++) {
+		struct info_irq *irq = &info->irq[i];
+		struct lpmd_irq_rule *rule = irq_state_rule(irq, state);
+		char *str = irq_str;
+
+		irq->follow = 0;
+
+		switch (rule ? rule->policy : IRQ_POLICY_FOLLOW) {
+		case IRQ_POLICY_KEEP:
+			str = pcore_str ? pcore_str : irq->affinity;
+			break;
+		case IRQ_POLICY_SPREAD:
+			cpu = irq_next_cpu(state->cpumask_idx, cpu);
+			if (cpu < 0)
+				break;
+			cpu_to_hexmask(cpu, spread_str, hexmask_size());
+			str = spread_str;
+			break;
+		default:
+			irq->follow = !irq->unmovable;
+			if (irq->balance_cpu < 0)
+				break;
+			cpu_to_hexmask(irq->balance_cpu, spread_str, hexmask_size());
+			str = spread_str;
+			break;
+		}
+
+		if (update_one_irq(irq, str) > 0)
+			updated++;
+	}
+
+	free(spread_str);
+	lpmd_log_debug("\tUpdated %d of %d IRQs\n", updated, info->nr_irqs);
+
+	/* Start sampling the interrupt rates for the native balancer */
+	if (config->irq_balance_threshold)
+		irq_sample_rates();
+
+	return 0;
+}
+
+static int irq_rate_cmp(const void *a, const void *b)
+{
+	const struct info_irq *irq_a = *(struct info_irq * const *)a;
+	const struct info_irq *irq_b = *(struct info_irq * const *)b;
+
+	if (irq_a->rate == irq_b->rate)
+		return 0;
+	return irq_a->rate < irq_b->rate ? 1 : -1;
+}
+
+static unsigned long irq_max_load(unsigned long *load, int nr)
+{
+	unsigned long max = 0;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (load[i] > max)
+			max = load[i];
+	}
+	return max;
+}
+
+/*
+ * Spread the busiest IRQs following the LP cpumask over its CPUs by rate,
+ * hottest first onto the least loaded CPU. The new placement is applied
+ * only when it lowers the busiest CPU load by more than the threshold.
+ */
+static int irq_balance(int threshold)
+{
+	unsigned long *load = NULL, *plan = NULL;
+	struct info_irq **hot = NULL;
+	unsigned long total = 0, cur_max, plan_max;
+	int *cpus = NULL, *target = NULL;
+	char *str = NULL;
+	int nr_cpus = 0, nr_hot = 0;
+	int unplaced = 0, moved = 0;
+	int i, j, ret = -1;
+
+	cpus = calloc(get_max_cpus(), sizeof(*cpus));
+	hot = calloc(info->nr_irqs, sizeof(*hot));
+	target = calloc(info->nr_irqs, sizeof(*target));
+	str = malloc(hexmask_size());
+	if (!cpus || !hot || !target || !str)
+		goto out;
+
+	for (i = 0; i < get_max_cpus(); i++) {
+		if (cpumask_test_cpu(i, balance_idx))
+			cpus[nr_cpus++] = i;
+	}
+	if (nr_cpus < 2) {
+		ret = 0;
+		goto out;
+	}
+
+	load = calloc(nr_cpus, sizeof(*load));
+	plan = calloc(nr_cpus, sizeof(*plan));
+	if (!load || !plan)
+		goto out;
+
+	/* Current load per CPU, from the previous placement */
+	for (i = 0; i < info->nr_irqs; i++) {
+		struct info_irq *irq = &info->irq[i];
+
+		if (!irq->follow || irq->unmovable || !irq->rate)
+			continue;
+
+		hot[nr_hot++] = irq;
+		total += irq->rate;
+
+		for (j = 0; j < nr_cpus; j++) {
+			if (cpus[j] == irq->balance_cpu)
+				break;
+		}
+		if (j == nr_cpus)
+			unplaced = 1;
+		else
+			load[j] += irq->rate;
+	}
+
+	if (total < IRQ_BALANCE_MIN_RATE) {
+		ret = 0;
+		goto out;
+	}
+
+	qsort(hot, nr_hot, sizeof(*hot), irq_rate_cmp);
+
+	for (i = 0; i < nr_hot; i++) {
+		int min = 0;
+
+		for (j = 1; j < nr_cpus; j++) {
+			if (plan[j] < plan[min])
+				min = j;
+		}
+		plan[min] += hot[i]->rate;
+		target[i] = cpus[min];
+	}
+
+	cur_max = irq_max_load(load, nr_cpus);
+	plan_max = irq_max_load(plan, nr_cpus);
+
+	if (!unplaced && (cur_max <= plan_max ||
+			  (cur_max - plan_max) * 100 <= plan_max * threshold)) {
+		ret = 0;
+		goto out;
+	}
+
+	for (i = 0; i < nr_hot; i++) {
+		hot[i]->balance_cpu = target[i];
+		cpu_to_hexmask(target[i], str, hexmask_size());
+		if (update_one_irq(hot[i], str) > 0)
+			moved++;
+	}
+
+	lpmd_log_debug("\tIRQ balance: %lu irqs/s, max CPU load %lu -> %lu, moved %d IRQs\n",
+		       total, unplaced ? total : cur_max, plan_max, moved);
+	ret = 0;
+out:
+	free(cpus);
+	free(hot);
+	free(target);
+	free(str);
+	free(load);
+	free(plan);
+	return ret;
+}
+
+static int irq_balance_active(void)
+{
+	return irqbalance_pid == -1 && get_lpmd_config()->irq_balance_threshold &&
+	       balance_idx != CPUMASK_NONE;
+}
+
+/* Shorten the poll @timeout so that the next balancer sample is taken in time */
+int irq_balance_timeout(int timeout)
+{
+	uint64_t now = irq_now_ms();
+	int delay;
+
+	if (!irq_balance_active())
+		return timeout;
+
+	delay = balance_due > now ? balance_due - now : 0;
+	if (timeout < 0 || delay < timeout)
+		return delay;
+
+	return timeout;
+}
+
+int irq_balance_update(void)
+{
+	struct lpmd_config_t *config = get_lpmd_config();
+	uint64_t signature, now;
+
+	if (!irq_balance_active())
+		return 0;
+
+	now = irq_now_ms();
+	if (now < balance_due)
+		return 0;
+	balance_due = now + IRQ_BALANCE_INTERVAL_MS;
+
+	signature = irq_table_signature();
+	if (info->stale || signature != info->signature) {
+		if (irq_table_refresh())
+			return -1;
+		info->signature = signature;
+		info->stale = 0;
+	}
+
+	if (irq_sample_rates())
+		return -1;
+
+	return irq_balance(config->irq_balance_threshold);
+}
+
 int process_irq(struct lpmd_config_state_t *state)
 {
 	switch (state->irq_migrate) {
 	case SETTING_IGNORE:
 		lpmd_log_info("Ignore IRQ migration\n");
+		balance_idx = CPUMASK_NONE;
 		return 0;
 	case SETTING_RESTORE:
+		irqbalance_version = 0;
+		if (irqbalance_pid != -1 && !irqbalance_ban_cpus("NULL"))
+			return 0;
+		/* Fall back to native mode if irqbalance went away */
 		if (irqbalance_pid == -1)
 			native_restore_irqs();
-		else
-			irqbalance_ban_cpus("NULL");
 		return 0;
 	default:
 		if (state->cpumask_idx == CPUMASK_NONE)
 			return 0;
+		if (irqbalance_pid != -1 &&
+		    cpumask_version(state->cpumask_idx) == irqbalance_version)
+			return 0;
+		if (irqbalance_pid != -1 &&
+		    !irqbalance_ban_cpus(get_irqbalance_str(state->cpumask_idx))) {
+			irqbalance_version = cpumask_version(state->cpumask_idx);
+			return 0;
+		}
 		if (irqbalance_pid == -1)
-			native_update_irqs(get_proc_irq_str(state->cpumask_idx));
-		else
-			irqbalance_ban_cpus(get_irqbalance_str(state->cpumask_idx));
+			native_update_irqs(state);
 		return 0;
 	}
 	return 0;
@@ -220,43 +1028,25 @@ int process_irq(struct lpmd_config_state_t *state)
 
 int irq_init(void)
 {
-	DIR *dir;
-	int socket_fd;
-	int ret;
+	struct stat st;
 
 	lpmd_log_info("Detecting IRQs ...\n");
 
-	dir = opendir("/run/irqbalance");
-	if (dir) {
-		struct dirent *entry;
-
-		do {
-			entry = readdir(dir);
-			if (entry) {
-				if (!strncmp(entry->d_name, "irqbalance", 10)) {
-					ret = sscanf(entry->d_name, "irqbalance%d.sock", &irqbalance_pid);
-					if (!ret)
-						irqbalance_pid = -1;
-				}
-			}
-		} while ((entry) && (irqbalance_pid == -1));
-
-		closedir(dir);
-	}
+	irqbalance_detect();
 
 	if (irqbalance_pid == -1) {
 		lpmd_log_info("\tirqbalance not running, run in native mode\n");
 		return LPMD_SUCCESS;
 	}
 
-	snprintf(irq_socket_name, 64, "%s/%s%d.sock", SOCKET_TMPFS, SOCKET_PATH, irqbalance_pid);
-	socket_fd = socket_init_connection(irq_socket_name);
-	if (socket_fd < 0) {
-		lpmd_log_error("Can not connect to irqbalance socket /run/irqbalance/irqbalance%d.sock\n",
-			       irqbalance_pid);
+	if (get_lpmd_config()->irq_rule_count)
+		lpmd_log_info("\tIRQ rules need native mode, ignored with irqbalance\n");
+
+	/* Connections are made per command, only check the socket is there */
+	if (stat(irq_socket_name, &st) || !S_ISSOCK(st.st_mode)) {
+		lpmd_log_error("Can not find irqbalance socket %s\n", irq_socket_name);
 		return LPMD_ERROR;
 	}
-	close(socket_fd);
 	lpmd_log_info("\tFind irqbalance socket %s\n", irq_socket_name);
 	return LPMD_SUCCESS;
 }
@@ -149,6 +149,9 @@ int main(int argc, char *argv[])
 	gboolean no_daemon = FALSE;
 	gboolean log_info = FALSE;
 	gboolean systemd = FALSE;
+	gchar *hfi_replay_file = NULL;
+	gchar *hfi_replay_config = NULL;
+	gint hfi_replay_loops = 1;
 	GOptionContext *opt_ctx;
 	gboolean success;
 	int ret;
@@ -165,6 +168,9 @@ int main(int argc, char *argv[])
 		{ "loglevel=debug", 0, 0, G_OPTION_ARG_NONE, &log_debug, N_("Log severity: debug level and up: Max logging"), NULL },
 		{ "dbus-enable", 0, 0, G_OPTION_ARG_NONE, &dbus_enable, N_("Enable Dbus"), NULL },
 		{ "ignore-platform-check", 0, 0, G_OPTION_ARG_NONE, &ignore_platform_check, N_("Ignore platform check"), NULL },
+		{ "hfi-replay", 0, 0, G_OPTION_ARG_FILENAME, &hfi_replay_file, N_("Replay the HFI events of a file, report the event rate and exit"), N_("FILE") },
+		{ "hfi-replay-loops", 0, 0, G_OPTION_ARG_INT, &hfi_replay_loops, N_("Number of times to replay the HFI events"), N_("N") },
+		{ "hfi-replay-config", 0, 0, G_OPTION_ARG_FILENAME, &hfi_replay_config, N_("Configuration file of the HFI replay, default is the installed one"), N_("FILE") },
 		{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
 	};
 
@@ -209,6 +215,22 @@ int main(int argc, char *argv[])
 		exit(EXIT_SUCCESS);
 	}
 
+	if (log_info)
+		lpmd_log_level |= G_LOG_LEVEL_INFO;
+
+	if (log_debug)
+		lpmd_log_level |= G_LOG_LEVEL_INFO | G_LOG_LEVEL_DEBUG;
+
+//	 Replay doesn't touch the system, no need for root or a lock
+	if (hfi_replay_file) {
+		use_syslog = FALSE;
+		g_log_set_handler(NULL, G_LOG_LEVEL_MASK, intel_lpmd_logger, NULL);
+		ret = hfi_replay(hfi_replay_file, hfi_replay_config, hfi_replay_loops);
+		g_free(hfi_replay_file);
+		g_free(hfi_replay_config);
+		exit(ret == LPMD_SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
 	if (getuid() != 0) {
 		fprintf(stderr, "You must be root to run intel_lpmd!\n");
 		exit(EXIT_FAILURE);
@@ -224,12 +246,6 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	if (log_info)
-		lpmd_log_level |= G_LOG_LEVEL_INFO;
-
-	if (log_debug)
-		lpmd_log_level |= G_LOG_LEVEL_INFO | G_LOG_LEVEL_DEBUG;
-
 	openlog("intel_lpmd", LOG_PID, LOG_USER | LOG_DAEMON | LOG_SYSLOG);
 //	 Don't care return val
 
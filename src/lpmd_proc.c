@@ -94,6 +94,7 @@ static int idx_pipe_fd = -1;
 static int idx_uevent_fd = -1;
 static int idx_hfi_fd = -1;
 static int idx_wlt_fd = -1;
+static int idx_proxy_fd = -1;
 
 #include <gio/gio.h>
 
@@ -272,6 +273,12 @@ static void dump_poll_results(int ret)
 			       poll_fds[i].events, poll_fds[i].revents);
 		i++;
 	}
+
+	if (idx_proxy_fd != -1) {
+		lpmd_log_debug("poll_fds[%s]: event %d, revent %d\n", " Proxy",
+			       poll_fds[i].events, poll_fds[i].revents);
+		i++;
+	}
 }
 
 void update_reason(int reason)
@@ -294,11 +301,42 @@ char *user_cpumask_idx_to_state_name(enum cpumask_idx idx)
 	return NULL;
 }
 
+static uint64_t lpmd_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Poll timeout until the next utilization poll, -1 when polling is off.
+ * The deadline is kept from the last poll, so that the other wakeups don't
+ * postpone it, and follows polling_interval changes.
+ */
+static int util_poll_timeout(uint64_t *util_last)
+{
+	uint64_t now, due;
+
+	if (lpmd_config.data.polling_interval <= 0) {
+		*util_last = 0;
+		return -1;
+	}
+
+	now = lpmd_now_ms();
+	if (!*util_last)
+		*util_last = now;
+
+	due = *util_last + lpmd_config.data.polling_interval;
+	return due > now ? due - now : 0;
+}
+
 // LPMD processing thread. This is callback to pthread lpmd_core_main
 static void *lpmd_core_main_loop(void *arg)
 {
 	struct message_capsul_t msg;
-	int wlt_hint, result, n;
+	int wlt_hint, result, timeout, n;
+	uint64_t util_last = 0;
 
 	lpmd_config.data.polling_interval = DEF_POLLING_INTERVAL;
 
@@ -306,15 +344,20 @@ static void *lpmd_core_main_loop(void *arg)
 		if (get_lpmd_state() == LPMD_TERMINATE)
 			break;
 
-		n = poll(poll_fds, poll_fd_cnt, lpmd_config.data.polling_interval);
+		/* Wake up at the earliest of the util, HFI and IRQ balancer deadlines */
+		timeout = util_poll_timeout(&util_last);
+		timeout = hfi_pending_timeout(timeout);
+		timeout = irq_balance_timeout(timeout);
+		n = poll(poll_fds, poll_fd_cnt, timeout);
 		if (n < 0) {
 			lpmd_log_warn("Write to pipe failed\n");
 			continue;
 		}
 		dump_poll_results(n);
 
-		/* Polling time out, update polling data */
-		if (n == 0 && lpmd_config.data.polling_interval > 0) {
+		/* Utilization poll due, update polling data */
+		if (util_last && !util_poll_timeout(&util_last)) {
+			util_last = lpmd_now_ms();
 			update_reason(UPDATE_UTIL);
 			util_update(&lpmd_config);
 
@@ -323,6 +366,9 @@ static void *lpmd_core_main_loop(void *arg)
 					read_wlt_proxy(&lpmd_config.data.polling_interval);
 		}
 
+		/* Sample IRQ rates and rebalance, when due and in an LP state */
+		irq_balance_update();
+
 		/* Check CPU hotplug. Maybe need to freeze lpmd */
 		if (idx_uevent_fd >= 0 && (poll_fds[idx_uevent_fd].revents & POLLIN))
 			check_cpu_hotplug();
@@ -330,6 +376,14 @@ static void *lpmd_core_main_loop(void *arg)
 		/* Update CPUMASK_HFI */
 		if (idx_hfi_fd >= 0 && (poll_fds[idx_hfi_fd].revents & POLLIN))
 			hfi_update();
+		hfi_apply_pending();
+
+		/* WLT proxy poll completed on the proxy thread */
+		if (idx_proxy_fd >= 0 && (poll_fds[idx_proxy_fd].revents & POLLIN)) {
+			lpmd_config.data.wlt_hint =
+				wlt_proxy_event(&lpmd_config.data.polling_interval);
+			update_reason(UPDATE_WLT);
+		}
 
 		/* Update WLT hint */
 		if (idx_wlt_fd >= 0 && (poll_fds[idx_wlt_fd].revents & POLLPRI)) {
@@ -413,9 +467,6 @@ int lpmd_main(void)
 	/* Must done after init_cpu() */
 	lpmd_build_config_states(&lpmd_config);
 
-	/* Cleanup dynamically allocated core-type cpumasks */
-	free_cpu_type_masks(&lpmd_config);
-
 	ret = irq_init();
 	if (ret)
 		return ret;
@@ -474,6 +525,16 @@ int lpmd_main(void)
 		lpmd_log_error("Error setting up WLT Proxy. wlt_proxy_enable disabled\n");
 	}
 
+	if (lpmd_config.wlt_proxy_enable) {
+		poll_fds[poll_fd_cnt].fd = wlt_proxy_start();
+		if (poll_fds[poll_fd_cnt].fd > 0) {
+			idx_proxy_fd = poll_fd_cnt;
+			poll_fds[idx_proxy_fd].events = POLLIN;
+			poll_fds[idx_proxy_fd].revents = 0;
+			poll_fd_cnt++;
+		}
+	}
+
 	if (lpmd_config.wlt_hint_enable && !lpmd_config.hfi_lpm_enable) {
 		if (!lpmd_config.util_gfx_enable && lpmd_config.wlt_hint_poll_enable)
 			lpmd_config.util_enable = 0;
@@ -514,6 +575,5 @@ int lpmd_main(void)
 
 	return LPMD_SUCCESS;
 cleanup:
-	free_cpu_type_masks(&lpmd_config);
 	return ret;
 }
@@ -36,36 +36,45 @@
 
 #include "lpmd.h"
 
+/*
+ * irqbalance serves a single command per connection and closes it, so a
+ * connection is only kept until the next command, to collect the reply
+ * without waiting for it. The credentials message is built once.
+ */
+static int socket_fd = -1;
+static struct msghdr *credentials_msg;
+
 /* socket helpers */
 int socket_init_connection(char *name)
 {
 	struct sockaddr_un addr;
-	static int socket_fd;
+	int fd;
 
 	if (!name)
-		return 0;
+		return -1;
 
 	memset(&addr, 0, sizeof(struct sockaddr_un));
-	socket_fd = socket(AF_LOCAL, SOCK_STREAM, 0);
-	if (socket_fd < 0) {
+	/* Non blocking, a busy irqbalance must not stall the caller */
+	fd = socket(AF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd < 0) {
 		perror("Error opening socket");
-		return 0;
+		return -1;
 	}
 	addr.sun_family = AF_UNIX;
 
 	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", name);
 
-	if (connect(socket_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
 		/* Try connect to abstract */
 		memset(&addr, 0, sizeof(struct sockaddr_un));
 		addr.sun_family = AF_UNIX;
-		if (connect(socket_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-			close(socket_fd);
-			return 0;
+		if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+			close(fd);
+			return -1;
 		}
 	}
 
-	return socket_fd;
+	return fd;
 }
 
 static struct msghdr *create_credentials_msg(void)
@@ -109,41 +118,59 @@ static struct msghdr *create_credentials_msg(void)
 	return msg;
 }
 
-int socket_send_cmd(char *name, char *data)
+/* Log whatever reply already arrived on the previous connection and close it */
+static void socket_close(void)
 {
-	int socket_fd;
-	struct msghdr *msg;
-	struct iovec iov;
 	char buf[MAX_STR_LENGTH];
 	int ret;
 
-	if (!name || !data)
-		return LPMD_ERROR;
+	if (socket_fd < 0)
+		return;
 
-	socket_fd = socket_init_connection(name);
-	if (!socket_fd)
-		return LPMD_ERROR;
+	while ((ret = recv(socket_fd, buf, MAX_STR_LENGTH - 1, MSG_DONTWAIT)) > 0) {
+		buf[ret] = '\0';
+		lpmd_log_debug("\tSocket reply: %s\n", buf);
+	}
+
+	close(socket_fd);
+	socket_fd = -1;
+}
 
-	msg = create_credentials_msg();
-	if (!msg)
+int socket_send_cmd(char *name, char *data)
+{
+	struct iovec iov;
+	int retry, err = 0;
+
+	if (!name || !data)
 		return LPMD_ERROR;
 
+	if (!credentials_msg) {
+		credentials_msg = create_credentials_msg();
+		if (!credentials_msg)
+			return LPMD_ERROR;
+	}
+
 	iov.iov_base = (void *)data;
 	iov.iov_len = strlen(data);
-	msg->msg_iov = &iov;
+	credentials_msg->msg_iov = &iov;
 
-	if (sendmsg(socket_fd, msg, 0) < 0) {
-		free(msg->msg_control);
-		free(msg);
-		return LPMD_ERROR;
-	}
+	socket_close();
 
-	ret = read(socket_fd, buf, MAX_STR_LENGTH);
-	if (ret < 0)
-		lpmd_log_debug("read failed\n");
+	/* Retry once on a fresh connection if the peer reset this one */
+	for (retry = 0; retry < 2; retry++) {
+		socket_fd = socket_init_connection(name);
+		if (socket_fd < 0)
+			return LPMD_ERROR;
 
-	close(socket_fd);
-	free(msg->msg_control);
-	free(msg);
-	return LPMD_SUCCESS;
+		if (sendmsg(socket_fd, credentials_msg, MSG_NOSIGNAL | MSG_DONTWAIT) >= 0)
+			return LPMD_SUCCESS;
+
+		err = errno;
+		socket_close();
+		if (err != EPIPE && err != ECONNRESET && err != ENOTCONN)
+			break;
+	}
+
+	lpmd_log_debug("Send \"%s\" to %s failed: %s\n", data, name, strerror(err));
+	return LPMD_ERROR;
 }
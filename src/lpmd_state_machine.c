@@ -19,6 +19,7 @@
 #include <pthread.h>
 
 #include "lpmd.h"
+#include "wlt_proxy.h"
 
 /* LPMD state control: ON/OFF/AUTO/FREEZE/RESTORE/TERMINATE */
 static int lpmd_state = LPMD_OFF;
@@ -98,6 +99,9 @@ int lpmd_init_config_state(struct lpmd_config_state_t *state)
 	state->active_p_cores[0] = '\0';
 	state->active_e_cores[0] = '\0';
 	state->active_l_cores[0] = '\0';
+	state->smt_policy = SMT_POLICY_FILL;
+	state->hfi_most_efficient = 0;
+	state->hfi_min_perf = 0;
 
 	state->itmt_state = SETTING_IGNORE;
 	state->irq_migrate = SETTING_IGNORE;
@@ -317,6 +321,31 @@ static int need_enter(struct lpmd_config_t *config, int idx)
 	return 0;
 }
 
+/*
+ * With WLTProxyConfine, the cpus of the current WLT proxy mode replace
+ * the ones of the config state picked by its hint, if that state sets
+ * cpus. Several modes map to the same hint, so this runs on every proxy
+ * poll, process_cgroup() skips unchanged cpumasks. CPU offlining would
+ * stop the proxy sampling the cpus it needs to leave a mode, so that mode
+ * keeps the config state cpus.
+ */
+static void process_state_cgroup(struct lpmd_config_t *config, int idx)
+{
+	struct lpmd_config_state_t *state = &config->config_states[idx];
+	enum cpumask_idx cpumask_idx = state->cpumask_idx;
+	enum cpumask_idx proxy_idx;
+
+	if (config->wlt_proxy_enable && config->wlt_proxy_confine &&
+	    idx >= CONFIG_STATE_BASE && config->mode != LPM_CPU_OFFLINE &&
+	    cpumask_idx != CPUMASK_NONE) {
+		proxy_idx = wlt_proxy_cpumask();
+		if (proxy_idx != CPUMASK_NONE)
+			cpumask_idx = proxy_idx;
+	}
+
+	process_cgroup(cpumask_idx, config->mode);
+}
+
 static int enter_state(struct lpmd_config_t *config, int idx)
 {
 	struct lpmd_config_state_t *state = &config->config_states[idx];
@@ -332,7 +361,7 @@ static int enter_state(struct lpmd_config_t *config, int idx)
 
 	process_irq(state);
 
-	process_cgroup(state, config->mode);
+	process_state_cgroup(config, idx);
 
 	return 0;
 }
@@ -398,11 +427,11 @@ static void dump_data(struct lpmd_config_t *config, int idx)
 	if (state->cpumask_idx != CPUMASK_NONE)
 		offset += snprintf(buf + offset, MAX_STR_LENGTH - offset,
 				   "CPUMASK [%s] ",
-				   get_cpus_hexstr(state->cpumask_idx, false));
+				   get_cpus_hexstr(state->cpumask_idx));
 	else
 		offset += snprintf(buf + offset, MAX_STR_LENGTH - offset,
 				   "CPUMASK [%s] ",
-				   get_cpus_hexstr(CPUMASK_ONLINE, false));
+				   get_cpus_hexstr(CPUMASK_ONLINE));
 
 	offset += snprintf(buf + offset, MAX_STR_LENGTH - offset,
 				   "ITMT [%d] ", get_itmt());
@@ -457,6 +486,9 @@ int lpmd_enter_next_state(void)
 		enter_state(config, idx);
 		current_idx = idx;
 		dump_state(&config->config_states[idx], "Enter", 0);
+	} else if (config->wlt_proxy_enable && config->wlt_proxy_confine) {
+		/* proxy mode change within the same config state */
+		process_state_cgroup(config, idx);
 	}
 
 end:
@@ -479,6 +511,8 @@ static void dump_states(struct lpmd_config_t *lpmd_config)
 	lpmd_log_info("WLT Hint Enable:%d\n", lpmd_config->wlt_hint_enable);
 	lpmd_log_info("WLT Hint Notification Delay:%d\n", lpmd_config->wlt_notification_delay);
 	lpmd_log_info("WLT Proxy Enable:%d\n", lpmd_config->wlt_proxy_enable);
+	lpmd_log_info("WLT Proxy Confine:%d\n", lpmd_config->wlt_proxy_confine);
+	lpmd_log_info("WLT Proxy Burst Wake:%d\n", lpmd_config->wlt_proxy_burst_wake);
 	lpmd_log_info("WLT Proxy Enable:%d\n", lpmd_config->wlt_hint_poll_enable);
 	lpmd_log_info("WLT Hint mask:%d\n", lpmd_config->wlt_hint_mask);
 	lpmd_log_info("Util Enable:%d\n", lpmd_config->util_enable);
@@ -495,6 +529,16 @@ static void dump_states(struct lpmd_config_t *lpmd_config)
 	lpmd_log_info("slider_offset_def_ac:%d\n", lpmd_config->slider_offset_def_ac);
 	lpmd_log_info("slider_offset_def_dc:%d\n", lpmd_config->slider_offset_def_dc);
 
+	lpmd_log_info("HfiCoalesceMS:%d\n", lpmd_config->hfi_coalesce_ms);
+	lpmd_log_info("HfiDwellMS:%d\n", lpmd_config->hfi_dwell_ms);
+	lpmd_log_info("IRQBalanceThreshold:%d\n", lpmd_config->irq_balance_threshold);
+	for (i = 0; i < lpmd_config->irq_rule_count; ++i) {
+		struct lpmd_irq_rule *rule = &lpmd_config->irq_rules[i];
+
+		lpmd_log_info("IRQ rule:%d name:%s driver:%s policy:%d states:%d\n", i,
+			      rule->name, rule->driver, rule->policy, rule->nr_state_ids);
+	}
+
 	for (i = 0; i < MAX_STATES; ++i) {
 		state = &lpmd_config->config_states[i];
 
@@ -528,6 +572,10 @@ static void dump_states(struct lpmd_config_t *lpmd_config)
 			lpmd_log_info("\tactive_e_cores:%s\n", state->active_e_cores);
 		if (state->active_l_cores[0] != '\0')
 			lpmd_log_info("\tactive_l_cores:%s\n", state->active_l_cores);
+		lpmd_log_info("\tSMTPolicy:%d\n", state->smt_policy);
+		if (state->hfi_most_efficient || state->hfi_min_perf)
+			lpmd_log_info("\tHfiMostEfficient:%d HfiMinPerf:%d\n",
+				      state->hfi_most_efficient, state->hfi_min_perf);
 		lpmd_log_info("\tCPUMASK idx:%d\n", state->cpumask_idx);
 		lpmd_log_info("\tBalancedSliderAC:%d\n", state->balance_slider_ac);
 		lpmd_log_info("\tBalancedSliderDC:%d\n", state->balance_slider_dc);
@@ -640,7 +688,8 @@ static int config_states_update_config(struct lpmd_config_t *config)
 		if (!state->valid)
 			continue;
 
-		if (state->cpumask_idx == CPUMASK_HFI)
+		if (state->cpumask_idx == CPUMASK_HFI ||
+		    state->hfi_most_efficient || state->hfi_min_perf)
 			config->hfi_lpm_enable = 1;
 
 		if (state->wlt_type != -1 || state->wlt_type_mask != -1)
@@ -704,12 +753,14 @@ static int build_state_cpumask_activecpus(struct lpmd_config_state_t *state)
 		return -1;
 	}
 
+	state->cpumask_idx = cpumask_intern(state->cpumask_idx);
 	return 0;
 }
 
-static int build_state_cpumask_cputypes(struct lpmd_config_state_t *state, unsigned char **cmasks)
+/* The cpumask follows the HFI ranking, so it is private to the state */
+static int build_state_cpumask_hfi(struct lpmd_config_state_t *state)
 {
-	int ret;
+	state->steady = 0;
 
 	if (state->cpumask_idx != CPUMASK_NONE)
 		return 0;
@@ -720,28 +771,54 @@ static int build_state_cpumask_cputypes(struct lpmd_config_state_t *state, unsig
 		return -1;
 	}
 
-	/* Setup the specified P-cores */
-	ret = cpumask_init_cpus_type(state->active_p_cores, state->cpumask_idx, cmasks, P_CORE);
-	if (ret < 0) {
+	if (hfi_init_ranked_state(state)) {
 		cpumask_free(state->cpumask_idx);
+		state->cpumask_idx = CPUMASK_NONE;
 		return -1;
 	}
 
-	/* Setup the specified E-cores */
-	ret = cpumask_init_cpus_type(state->active_e_cores, state->cpumask_idx, cmasks, E_CORE);
-	if (ret < 0) {
-		cpumask_free(state->cpumask_idx);
+	return 0;
+}
+
+static int build_state_cpumask_cputypes(struct lpmd_config_state_t *state)
+{
+	int ret;
+
+	if (state->cpumask_idx != CPUMASK_NONE)
+		return 0;
+
+	state->cpumask_idx = cpumask_alloc();
+	if (state->cpumask_idx == CPUMASK_NONE) {
+		lpmd_log_error("Cannot alloc CPUMASK\n");
 		return -1;
 	}
 
+	/* Setup the specified P-cores */
+	ret = cpumask_init_cpus_type(state->active_p_cores, state->cpumask_idx, P_CORE,
+				     state->smt_policy);
+	if (ret < 0)
+		goto err;
+
+	/* Setup the specified E-cores */
+	ret = cpumask_init_cpus_type(state->active_e_cores, state->cpumask_idx, E_CORE,
+				     state->smt_policy);
+	if (ret < 0)
+		goto err;
+
 	/* Setup the specified L-cores */
-	ret = cpumask_init_cpus_type(state->active_l_cores, state->cpumask_idx, cmasks, L_CORE);
-	if (ret < 0) {
-		cpumask_free(state->cpumask_idx);
-		return -1;
-	}
+	ret = cpumask_init_cpus_type(state->active_l_cores, state->cpumask_idx, L_CORE,
+				     state->smt_policy);
+	if (ret < 0)
+		goto err;
 
+	state->cpumask_idx = cpumask_intern(state->cpumask_idx);
 	return 0;
+
+err:
+	/* A stale index would pass for an already built cpumask */
+	cpumask_free(state->cpumask_idx);
+	state->cpumask_idx = CPUMASK_NONE;
+	return -1;
 }
 
 #define DEFAULT_POLL_RATE_MS	1000
@@ -756,9 +833,12 @@ int lpmd_build_config_states(struct lpmd_config_t *lpmd_config)
 	for (i = CONFIG_STATE_BASE; i < CONFIG_STATE_BASE + lpmd_config->config_state_count; i++) {
 		state = &lpmd_config->config_states[i];
 
-		ret = build_state_cpumask_activecpus(state);
+		if (state->hfi_most_efficient || state->hfi_min_perf)
+			ret = build_state_cpumask_hfi(state);
+		else
+			ret = build_state_cpumask_activecpus(state);
 		if (ret == -2)
-			build_state_cpumask_cputypes(state, lpmd_config->core_type_masks);
+			build_state_cpumask_cputypes(state);
 		else if (ret)
 			continue;
 
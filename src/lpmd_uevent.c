@@ -9,39 +9,54 @@
 #include <netlink/genl/ctrl.h>
 
 #include "lpmd.h"
+#include "wlt_proxy.h"
 
 static int uevent_fd = -1;
 
 static int has_cpu_uevent(void)
 {
-	ssize_t i = 0;
+	ssize_t i;
 	ssize_t len;
 	const char *dev_path = "DEVPATH=";
 	unsigned int dev_path_len = strlen(dev_path);
 	const char *cpu_path = "/devices/system/cpu/cpu";
 	char buffer[MAX_STR_LENGTH];
-
-	len = recv(uevent_fd, buffer, sizeof(buffer) - 1, MSG_DONTWAIT);
-	if (len <= 0)
-		return 0;
-	buffer[len] = '\0';
-
-	lpmd_log_debug("Receive uevent: %s\n", buffer);
-
-	while (i < len) {
-		if (strlen(buffer + i) > dev_path_len &&
-		    !strncmp(buffer + i, dev_path, dev_path_len)) {
-			if (!strncmp(buffer + i + dev_path_len, cpu_path,
-				     strlen(cpu_path))) {
-				lpmd_log_debug("\tMatches: %s\n",
-					       buffer + i + dev_path_len);
-				return 1;
+	int found = 0;
+
+	/*
+	 * Drain all the pending uevents, CPU hotplug done by lpmd itself in
+	 * LPM_CPU_OFFLINE mode generates a burst of them.
+	 */
+	for (;;) {
+		len = recv(uevent_fd, buffer, sizeof(buffer) - 1, MSG_DONTWAIT);
+		if (len <= 0)
+			break;
+		buffer[len] = '\0';
+
+		lpmd_log_debug("Receive uevent: %s\n", buffer);
+
+		for (i = 0; i < len; i += strlen(buffer + i) + 1) {
+			/* drivers request and free their IRQs on bind/unbind */
+			if (!strcmp(buffer + i, "ACTION=bind") ||
+			    !strcmp(buffer + i, "ACTION=unbind"))
+				irq_table_invalidate();
+
+			if (found)
+				continue;
+
+			if (strlen(buffer + i) > dev_path_len &&
+			    !strncmp(buffer + i, dev_path, dev_path_len)) {
+				if (!strncmp(buffer + i + dev_path_len, cpu_path,
+					     strlen(cpu_path))) {
+					lpmd_log_debug("\tMatches: %s\n",
+						       buffer + i + dev_path_len);
+					found = 1;
+				}
 			}
 		}
-		i += strlen(buffer + i) + 1;
 	}
 
-	return 0;
+	return found;
 }
 
 #define PATH_PROC_STAT "/proc/stat"
@@ -51,10 +66,14 @@ int check_cpu_hotplug(void)
 	FILE *filep;
 	int curr;
 	int ret;
+	int i;
 
 	if (!has_cpu_uevent())
 		return 0;
 
+	if (get_lpmd_config()->wlt_proxy_enable)
+		wlt_proxy_update_cpus();
+
 	filep = fopen(PATH_PROC_STAT, "r");
 	if (!filep)
 		return 0;
@@ -96,6 +115,12 @@ free:
 
 	fclose(filep);
 
+	/* CPUs offlined by lpmd itself are not a topology change */
+	for (i = 0; i < get_max_cpus(); i++) {
+		if (cpumask_test_cpu(i, CPUMASK_OFFLINE))
+			cpumask_add_cpu(i, curr);
+	}
+
 	ret = cpumask_equal(curr, CPUMASK_ONLINE);
 	cpumask_free(curr);
 
@@ -244,7 +244,8 @@ static int parse_proc_stat(void)
 	FILE *filep;
 	int i;
 	int val;
-	int count = get_max_online_cpu() + 1;
+	/* One slot per possible CPU, plus the system line */
+	int count = get_max_cpus() + 1;
 	int sys_idx = count - 1;
 	size_t size = sizeof(struct proc_stat_info) * count;
 
@@ -304,7 +305,7 @@ static int parse_proc_stat(void)
 		if (ret == -1 && !(strncmp(p, "cpu", 3))) {
 			/* Read system line */
 			info = &proc_stat_cur[sys_idx];
-		} else if (ret == 1) {
+		} else if (ret == 1 && cpu >= 0 && cpu < sys_idx) {
 			info = &proc_stat_cur[cpu];
 		} else {
 			free(tmpline);
@@ -340,7 +341,7 @@ static int parse_proc_stat(void)
 	busy_sys = calculate_busypct(&proc_stat_cur[sys_idx], &proc_stat_prev[sys_idx]);
 
 	busy_cpu = 0;
-	for (i = 1; i <= get_max_online_cpu(); i++) {
+	for (i = 0; i < sys_idx; i++) {
 		if (!proc_stat_cur[i].valid)
 			continue;
 
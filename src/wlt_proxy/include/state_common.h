@@ -4,6 +4,9 @@
 #ifndef _WLT_PROXY_COMMON_H_
 #define _WLT_PROXY_COMMON_H_
 
+#include <stdint.h>
+#include <poll.h>
+
 /* threshold (%) for instantaneous utilizations */
 #define UTIL_LOWEST		1
 #define UTIL_LOWER		2
@@ -41,7 +44,19 @@ extern int wlt_type;		/* from wlt_proxy.c */
 
 #define		MAX_MODE 8
 
+/* highest loads of a poll, in decreasing order */
+#define TOPK_UTIL	3
+
+struct util_topk {
+	float load[TOPK_UTIL];
+	int cpu[TOPK_UTIL];
+};
+
 struct group_util {
+	/* top loads over all sampled cpus and per core type [P,E,L] */
+	struct util_topk top;
+	struct util_topk top_type[3];
+
 	/* top 3 max utils and last (min) util */
 	float c0_max;
 	float c0_min;
@@ -51,12 +66,12 @@ struct group_util {
 	float c0_3rd_max;
 	int delta;
 
-	/* simple moving average for top 3 utils */
-	int sma_sum[3];
-	int sma_avg1;
-	int sma_avg2;
-	int sma_avg3;
-	int sma_pos;
+	/* time weighted moving average for top 3 utils */
+	float ema[TOPK_UTIL];
+	uint64_t ema_last_ms;
+	int ema_avg1;
+	int ema_avg2;
+	int ema_avg3;
 };
 
 /* feature states */
@@ -68,11 +83,19 @@ struct group_util {
 
 /* state_manager.c */
 void uninit_state_manager(void);
+int get_state_cpumask(enum state_idx state);
+void update_state_cpumasks(void);
+void uninit_state_cpumasks(void);
 
 enum state_idx get_cur_state(void);
 
+int set_last_poll(int v);
 int get_last_poll(void);
 int get_poll_ms(enum state_idx);
+void set_poll_ms(enum state_idx, int poll);
+void set_stay_ms(enum state_idx, int stay_ms);
+const char *get_state_key(enum state_idx);
+int state_key_to_idx(const char *key);
 int get_state_poll(int util, enum state_idx);
 
 int set_stay_count(enum state_idx, int count);
@@ -86,13 +109,22 @@ int do_countdown(enum state_idx);
 /* state_util.c */
 int util_init_proxy(void);
 void util_uninit_proxy(void);
-
+void util_proxy_update_cpus(void);
+int util_burst_wake_init(void);
+int util_burst_wake_fds(struct pollfd *pfds, int max);
+void util_burst_wake_arm(void);
+void util_burst_wake_disarm(void);
+void util_burst_wake_close(int fd);
+int util_burst_wake_check(void);
+
+uint64_t proxy_now_ms(void);
 int state_max_avg(void);
 int update_perf_diffs(float *sum_norm_perf, int stat_init_only);
 
 int max_mt_detected(enum state_idx);
 
 /* state_machine.c */
+int state_table_init(void);
 int state_machine_auto(void);
 
 /* spike_mgmt.c */
@@ -5,7 +5,11 @@
 #define _WLT_PROXY_H_
 
 int read_wlt_proxy(int *interval);
+int wlt_proxy_event(int *interval);
 int wlt_proxy_init(void);
+int wlt_proxy_start(void);
 void wlt_proxy_uninit(void);
+void wlt_proxy_update_cpus(void);
+int wlt_proxy_cpumask(void);
 
 #endif/* _WLT_PROXY_H_ */
@@ -44,7 +44,7 @@ int burst_count;
 
 /*local variables*/
 static int total_spike_time;
-static int spike_sec_prev;
+static uint64_t spike_ms_prev;
 static int spike_rate_total;
 static int spike_rate_samples;
 static int burst_rate_per_min;
@@ -77,28 +77,23 @@ int clear_spike_rate_avg(void)
  */
 static int update_burst_count(int real_spike_burst)
 {
+	uint64_t now = proxy_now_ms();
 	float minutes = 1.0;
-	clockid_t clk = CLOCK_MONOTONIC;
-	struct timespec ts;
 
-	if (clock_gettime(clk, &ts)) {
-		perror("clock_gettime1");
-		return -1;
-	}
-
-	if (spike_sec_prev) {
-		minutes = (float)(ts.tv_sec - spike_sec_prev) / bc_reset_min;
+	/* bc_reset_min seconds make up a "minute", tracked in ms */
+	if (spike_ms_prev) {
+		minutes = (float)(now - spike_ms_prev) / (bc_reset_min * 1000);
 	} else {
-		spike_sec_prev = ts.tv_sec;
+		spike_ms_prev = now;
 		return 0;
 	}
 
 	if (real_spike_burst && (get_cur_state() <= MDRT4E_MODE)) {
 		burst_count++;
-		spike_sec_prev = ts.tv_sec;
+		spike_ms_prev = now;
 	} else if ((minutes > 1.0) || (burst_count > MAX_BURST_COUNT)) {
 		burst_count = 0;
-		spike_sec_prev = ts.tv_sec;
+		spike_ms_prev = now;
 	}
 
 	if (minutes < 1.0)
@@ -137,7 +132,7 @@ int get_spike_rate(void)
 	return (spike_pct > 100) ? 100 : spike_pct;
 }
 
-/* count spikes */
+/* count spikes, duration in ms */
 int add_spike_time(int duration)
 {
 	int spike_rate;
@@ -159,7 +154,7 @@ int add_spike_time(int duration)
 	return 1;
 }
 
-/* count idleness / non spike times */
+/* count idleness / non spike times, duration in ms */
 int add_non_spike_time(int duration)
 {
 	float avg;
@@ -8,41 +8,411 @@
 #include "state_common.h"
 #include "lpmd.h" //logs
 
-/*
- * stall scalability refer to non-stallable percentage of utilization.
- * e.g due to memory or other dependency. If work is reasonably scaling well,
- * values in 80 to 90+% is expected
- */
-#define STALL_SCALE_LOWER_MARK	60
-
 #define N_STRIKE		(10)
 
-/* threshold (%) for sustained (avg) utilizations */
-#define SUS_LOWER		2
-#define SUS_LOW_RANGE_START	4
-#define SUS_LOW_RANGE_END	25
+/* consecutive polls showing a single threaded burst before acting on it */
+#define ST_BURST_POLLS		(2)
 
 int max_util;
 
 static int only_once;
 
-/* function checks conditions for state switch */
+/* time of the last poll, ms */
+static uint64_t last_poll_ms;
+
+static int st_polls;
+
+/*
+ * Single threaded burst: the busiest P or E cpu is near full while the
+ * next busiest of the same type is below half. Pooling all types hides
+ * it, as the other type's cpus fill the 2nd and 3rd max.
+ */
+static int st_burst_detected(void)
+{
+	int st = 0;
+
+	for (int type = P_CORE; type <= E_CORE; type++) {
+		if (A_GT_B(grp.top_type[type].load[0], UTIL_NEAR_FULL) &&
+		    A_LTE_B(grp.top_type[type].load[1], UTIL_HALF))
+			st = 1;
+	}
+
+	st_polls = st ? st_polls + 1 : 0;
+
+	return st_polls >= ST_BURST_POLLS;
+}
+
+/*
+ * State table. Each state has an ordered list of transitions, the first
+ * one whose terms all hold is taken. A term compares one of the values
+ * sampled at the poll with a threshold:
+ *   lt: below by at least EPSILON (A_LTE_B)
+ *   gt: above by more than EPSILON (A_GT_B)
+ *   ge: above by at least EPSILON (A_GTE_B)
+ * The table is compiled at init from the built-in transitions below,
+ * replaced per state by the WLTProxyStates config if present.
+ */
+enum proxy_var {
+	VAR_C0_MAX,
+	VAR_C0_2ND_MAX,
+	VAR_SUM_C0,
+	VAR_AVG1,
+	VAR_AVG2,
+	VAR_AVG3,
+	VAR_STALL,		/* worst stall scalability, % */
+	VAR_MT,			/* multi threaded, for the cpus of the state */
+	VAR_ST,			/* single threaded burst */
+	VAR_BURST_COUNT,
+	VAR_BURST_BREACH,
+	VAR_PERF_COUNT,		/* PERF_MODE stay count */
+	NR_PROXY_VARS
+};
+
+static const char * const proxy_var_names[NR_PROXY_VARS] = {
+	[VAR_C0_MAX] = "c0_max",
+	[VAR_C0_2ND_MAX] = "c0_2nd_max",
+	[VAR_SUM_C0] = "sum_c0",
+	[VAR_AVG1] = "avg1",
+	[VAR_AVG2] = "avg2",
+	[VAR_AVG3] = "avg3",
+	[VAR_STALL] = "stall",
+	[VAR_MT] = "mt",
+	[VAR_ST] = "st",
+	[VAR_BURST_COUNT] = "burst_count",
+	[VAR_BURST_BREACH] = "burst_breach",
+	[VAR_PERF_COUNT] = "perf_count",
+};
+
+enum proxy_op {
+	OP_LT,
+	OP_GT,
+	OP_GE,
+};
+
+/* what to check once the terms hold, before taking the transition */
+enum proxy_guard {
+	GUARD_NONE,
+	GUARD_STRIKE,		/* absorb spikes unless the burst rate is breached */
+	GUARD_COUNTDOWN,	/* stay until the state stay count runs out */
+	GUARD_HOLD,		/* as countdown, but go on with the next transition */
+};
+
+/* stay count update of the target state */
+enum proxy_stay {
+	STAY_KEEP,
+	STAY_REFILL,
+	STAY_CLEAR,
+};
+
+#define MAX_PROXY_TERMS		6
+
+struct proxy_term {
+	enum proxy_var var;
+	enum proxy_op op;
+	float val;
+};
+
+struct proxy_rule {
+	int nr_terms;
+	struct proxy_term terms[MAX_PROXY_TERMS];
+	enum state_idx target;	/* the state itself to stay */
+	enum proxy_guard guard;
+	enum proxy_stay stay;
+	int strikes;
+};
+
+struct proxy_rule_def {
+	enum state_idx state;
+	const char *when;
+	enum state_idx target;
+	enum proxy_guard guard;
+	enum proxy_stay stay;
+};
+
+/* built-in transitions, in evaluation order per state */
+static const struct proxy_rule_def default_rules[] = {
+	/* init mode is super-set of all default/available cpu on the system */
+	{ INIT_MODE, "mt lt 1", PERF_MODE },
+
+	{ PERF_MODE, "mt gt 0", INIT_MODE },
+	{ PERF_MODE, "st gt 0", PERF_MODE, GUARD_NONE, STAY_REFILL },
+	{ PERF_MODE, "burst_count gt 0", PERF_MODE, GUARD_HOLD },
+	{ PERF_MODE, "sum_c0 lt 20, avg1 lt 70", RESP_MODE },
+	{ PERF_MODE, "burst_breach lt 1, c0_max lt 10", MDRT3E_MODE, GUARD_NONE, STAY_CLEAR },
+
+	{ RESP_MODE, "st gt 0", PERF_MODE },
+	{ RESP_MODE, "c0_max gt 70, avg1 gt 40", PERF_MODE },
+	{ RESP_MODE, "perf_count gt 0, burst_breach gt 0", RESP_MODE },
+	{ RESP_MODE, "stall lt 60", RESP_MODE },
+	{ RESP_MODE, "", MDRT3E_MODE },
+
+	{ MDRT4E_MODE, "st gt 0", PERF_MODE },
+	{ MDRT4E_MODE, "stall lt 60", RESP_MODE },
+	{ MDRT4E_MODE, "c0_max gt 90", PERF_MODE, GUARD_STRIKE },
+	{ MDRT4E_MODE, "avg1 lt 25, avg2 lt 25, sum_c0 lt 50", NORM_MODE, GUARD_COUNTDOWN },
+
+	{ MDRT3E_MODE, "st gt 0", PERF_MODE },
+	{ MDRT3E_MODE, "stall lt 60", RESP_MODE },
+	{ MDRT3E_MODE, "c0_max gt 90", PERF_MODE, GUARD_STRIKE },
+	{ MDRT3E_MODE, "avg1 ge 25, avg2 ge 20", MDRT4E_MODE },
+	{ MDRT3E_MODE, "avg1 gt 4, avg1 lt 25, avg2 gt 4, avg2 lt 25", MDRT2E_MODE, GUARD_COUNTDOWN },
+	{ MDRT3E_MODE, "avg1 lt 25, avg2 lt 2, avg3 lt 2", NORM_MODE, GUARD_COUNTDOWN },
+
+	{ MDRT2E_MODE, "st gt 0", PERF_MODE },
+	{ MDRT2E_MODE, "stall lt 60", RESP_MODE },
+	{ MDRT2E_MODE, "c0_max gt 90", MDRT3E_MODE, GUARD_STRIKE },
+	{ MDRT2E_MODE, "avg1 ge 25, avg2 ge 15", MDRT3E_MODE, GUARD_STRIKE },
+	{ MDRT2E_MODE, "avg1 gt 4, avg1 lt 25, avg2 lt 25", NORM_MODE, GUARD_COUNTDOWN },
+
+	{ NORM_MODE, "st gt 0", PERF_MODE },
+	{ NORM_MODE, "stall lt 60", RESP_MODE },
+	{ NORM_MODE, "c0_max gt 50", MDRT2E_MODE, GUARD_STRIKE },
+	{ NORM_MODE, "avg1 gt 40", MDRT2E_MODE, GUARD_STRIKE },
+	{ NORM_MODE, "c0_max lt 10, c0_2nd_max lt 1", DEEP_MODE, GUARD_COUNTDOWN },
+	{ NORM_MODE, "avg1 lt 2", DEEP_MODE, GUARD_COUNTDOWN },
+
+	{ DEEP_MODE, "st gt 0", PERF_MODE },
+	{ DEEP_MODE, "stall lt 60", RESP_MODE },
+	{ DEEP_MODE, "c0_max gt 35", NORM_MODE },
+};
+
+static struct proxy_rule state_rules[MAX_MODE][MAX_PROXY_RULES];
+static int nr_state_rules[MAX_MODE];
+
+/* compile "var op value" terms, comma separated, all of them must hold */
+static int compile_terms(struct proxy_rule *rule, const char *when)
+{
+	char buf[MAX_STR_LENGTH];
+	char *term, *save;
+
+	snprintf(buf, sizeof(buf), "%s", when);
+	rule->nr_terms = 0;
+
+	for (term = strtok_r(buf, ",", &save); term; term = strtok_r(NULL, ",", &save)) {
+		struct proxy_term *t;
+		char var[32], op[4];
+		float val;
+		int i;
+
+		if (sscanf(term, "%31s %3s %f", var, op, &val) != 3 ||
+		    rule->nr_terms >= MAX_PROXY_TERMS)
+			goto err;
+
+		t = &rule->terms[rule->nr_terms];
+		for (i = 0; i < NR_PROXY_VARS; i++) {
+			if (!strcmp(var, proxy_var_names[i]))
+				break;
+		}
+		if (i == NR_PROXY_VARS)
+			goto err;
+		t->var = i;
+
+		if (!strcmp(op, "lt"))
+			t->op = OP_LT;
+		else if (!strcmp(op, "gt"))
+			t->op = OP_GT;
+		else if (!strcmp(op, "ge"))
+			t->op = OP_GE;
+		else
+			goto err;
+
+		t->val = val;
+		rule->nr_terms++;
+	}
+
+	return LPMD_SUCCESS;
+
+err:
+	lpmd_log_error("WLT_Proxy: invalid transition condition \"%s\"\n", when);
+	return LPMD_ERROR;
+}
+
+/* compile the transitions of a WLTProxyStates config state */
+static int compile_config_state(struct lpmd_proxy_state *config)
+{
+	struct proxy_rule rules[MAX_PROXY_RULES];
+	int state, i;
+
+	state = state_key_to_idx(config->name);
+	if (state < 0) {
+		lpmd_log_error("WLT_Proxy: unknown proxy state %s\n", config->name);
+		return LPMD_ERROR;
+	}
+
+	if (config->poll_ms > 0)
+		set_poll_ms(state, config->poll_ms);
+	if (config->stay_ms >= 0)
+		set_stay_ms(state, config->stay_ms);
+
+	if (!config->nr_rules)
+		return LPMD_SUCCESS;
+
+	for (i = 0; i < config->nr_rules; i++) {
+		struct lpmd_proxy_rule *c = &config->rules[i];
+		struct proxy_rule *r = &rules[i];
+
+		if (compile_terms(r, c->when))
+			return LPMD_ERROR;
+
+		if (!strcmp(c->target, "STAY"))
+			r->target = state;
+		else if ((int)(r->target = state_key_to_idx(c->target)) < 0)
+			goto err;
+
+		if (!c->guard[0] || !strcmp(c->guard, "none"))
+			r->guard = GUARD_NONE;
+		else if (!strcmp(c->guard, "strike"))
+			r->guard = GUARD_STRIKE;
+		else if (!strcmp(c->guard, "countdown"))
+			r->guard = GUARD_COUNTDOWN;
+		else if (!strcmp(c->guard, "hold"))
+			r->guard = GUARD_HOLD;
+		else
+			goto err;
+
+		if (!c->stay_count[0] || !strcmp(c->stay_count, "keep"))
+			r->stay = STAY_KEEP;
+		else if (!strcmp(c->stay_count, "refill"))
+			r->stay = STAY_REFILL;
+		else if (!strcmp(c->stay_count, "clear"))
+			r->stay = STAY_CLEAR;
+		else
+			goto err;
+
+		r->strikes = c->strikes >= 0 ? c->strikes : N_STRIKE;
+	}
+
+	memcpy(state_rules[state], rules, config->nr_rules * sizeof(rules[0]));
+	nr_state_rules[state] = config->nr_rules;
+	lpmd_log_info("WLT_Proxy: %d transitions configured for %s\n",
+		      config->nr_rules, config->name);
+
+	return LPMD_SUCCESS;
+
+err:
+	lpmd_log_error("WLT_Proxy: invalid transition %d of %s\n", i + 1, config->name);
+	return LPMD_ERROR;
+}
+
+/* build the state table from the built-in transitions and the config */
+int state_table_init(void)
+{
+	struct lpmd_config_t *config = get_lpmd_config();
+	int i;
+
+	memset(nr_state_rules, 0, sizeof(nr_state_rules));
+
+	for (i = 0; i < (int)(sizeof(default_rules) / sizeof(default_rules[0])); i++) {
+		const struct proxy_rule_def *def = &default_rules[i];
+		struct proxy_rule *r = &state_rules[def->state][nr_state_rules[def->state]++];
+
+		if (compile_terms(r, def->when))
+			return LPMD_ERROR;
+		r->target = def->target;
+		r->guard = def->guard;
+		r->stay = def->stay;
+		r->strikes = N_STRIKE;
+	}
+
+	for (i = 0; i < config->proxy_state_count; i++) {
+		if (compile_config_state(&config->proxy_states[i]))
+			return LPMD_ERROR;
+	}
+
+	return LPMD_SUCCESS;
+}
+
+static int term_holds(const struct proxy_term *t, const float *vars)
+{
+	switch (t->op) {
+	case OP_LT:
+		return A_LTE_B(vars[t->var], t->val);
+	case OP_GT:
+		return A_GT_B(vars[t->var], t->val);
+	case OP_GE:
+		return A_GTE_B(vars[t->var], t->val);
+	}
+
+	return 0;
+}
+
+/* take the first transition of the state whose terms all hold */
+static void state_table_eval(enum state_idx state, const float *vars)
+{
+	struct proxy_rule *r;
+	int i, j;
+
+	for (i = 0; i < nr_state_rules[state]; i++) {
+		r = &state_rules[state][i];
+
+		for (j = 0; j < r->nr_terms; j++) {
+			if (!term_holds(&r->terms[j], vars))
+				break;
+		}
+		if (j < r->nr_terms)
+			continue;
+
+		switch (r->guard) {
+		case GUARD_HOLD:
+			if (!do_countdown(state))
+				return;
+			continue;
+		case GUARD_STRIKE:
+			if (!burst_rate_breach() && strikeout_once(r->strikes)) {
+				lpmd_log_debug("%s_MODE: strikeout to %s_MODE not met\n",
+					       get_state_key(state), get_state_key(r->target));
+				return;
+			}
+			break;
+		case GUARD_COUNTDOWN:
+			if (!do_countdown(state)) {
+				lpmd_log_debug("%s_MODE: countdown to %s_MODE not met\n",
+					       get_state_key(state), get_state_key(r->target));
+				return;
+			}
+			break;
+		default:
+			break;
+		}
+
+		if (r->stay == STAY_REFILL)
+			set_stay_count(r->target, staytime_to_staycount(r->target));
+		else if (r->stay == STAY_CLEAR)
+			set_stay_count(r->target, 0);
+
+		if (r->target == state)
+			return;
+
+		lpmd_log_debug("%s_MODE to %s_MODE, transition %d\n",
+			       get_state_key(state), get_state_key(r->target), i + 1);
+		prep_state_change(state, r->target, 0);
+		return;
+	}
+}
+
+/*
+ * function checks conditions for state switch, returns the time covered
+ * by the poll in ms
+ */
 int state_machine_auto(void)
 {
-	int mdrt_count, perf_count, initial_burst_count, sr, ismt;
+	int mdrt_count, perf_count, initial_burst_count, sr, ismt, st;
 	int present_state = get_cur_state();
+	float vars[NR_PROXY_VARS];
 	float dummy, sum_c0;
 	int completed_poll;
+	uint64_t now;
 
 	update_perf_diffs(&dummy, 0);
 	max_util = (int)round(grp.c0_max); //end
 
-	/*
-	 * we do not want to track avg util for following case:
-	 * a) Responsive transit mode (fast poll can flood avg leading to incorrect decisions)
-	 */
-	if (present_state != RESP_MODE)
-		state_max_avg();
+	/* time weighted, so fast polls (e.g. RESP_MODE) don't flood the avg */
+	state_max_avg();
+
+	/* time covered by this poll, for the spike time accounting */
+	now = proxy_now_ms();
+	set_last_poll(last_poll_ms ? (int)(now - last_poll_ms) : 0);
+	last_poll_ms = now;
 
 	completed_poll = get_last_poll();
 	sum_c0 = grp.c0_max + grp.c0_2nd_max + grp.c0_3rd_max;
@@ -68,248 +438,40 @@ int state_machine_auto(void)
 
 	state_demote = 0;
 	ismt = !max_mt_detected(INIT_MODE);
+	st = st_burst_detected();
 
 	if (only_once == 0) {
-		lpmd_log_debug("present_state, isMT, C0_max, C0_2ndMax, sum_c0, sma avg1, sma avg2, sma avg3, worst_stall, next_proxy_poll\n");
+		lpmd_log_debug("present_state, isMT, ST, C0_max, C0_2ndMax, sum_c0, ema avg1, ema avg2, ema avg3, worst_stall, next_proxy_poll\n");
 		only_once = 1;
 	}
 
-	lpmd_log_debug("%d, %d,     %.2f,       %.2f,   %.2f,       %d,      %d,        %d,        %.2f, %d\n",
+	lpmd_log_debug("%d, %d, %d,     %.2f,       %.2f,   %.2f,       %d,      %d,        %d,        %.2f, %d\n",
 		       present_state,
 		       ismt,
+		       st,
 		       grp.c0_max,
 		       grp.c0_2nd_max,
 		       sum_c0,
-		       grp.sma_avg1,
-		       grp.sma_avg2,
-		       grp.sma_avg3,
+		       grp.ema_avg1,
+		       grp.ema_avg2,
+		       grp.ema_avg3,
 		       grp.worst_stall,
 		       next_proxy_poll);
 
-	switch (present_state) {
-	case INIT_MODE:
-		// init mode is super-set of all default/available cpu on the system
-		// promote -- if not high multi-thread trend
-		if (!max_mt_detected(INIT_MODE)) {
-			lpmd_log_debug("INIT_MODE to PERF_MODE\n");
-			prep_state_change(INIT_MODE, PERF_MODE, 0);
-			break;
-		}
-		// stay -- full MT
-		break;
-
-	case PERF_MODE:
-		// Demote -- if highly MT
-		if (max_mt_detected(PERF_MODE)) {
-			lpmd_log_debug("PERF_MODE to INIT_MODE = mt detected.\n");
-			prep_state_change(PERF_MODE, INIT_MODE, 0);
-			break;
-		}
-		// Stay -- if there was recent perf/resp bursts
-		if (burst_count > 0 && !do_countdown(PERF_MODE)) {
-			lpmd_log_debug("PERF_MODE: burst_count is %d > 0 && !do_countdown\n",
-				       burst_count);
-			break;
-		}
-		// Promote but through responsive watch -- if top sampled util and their avg are receding.
-		if (A_LTE_B(sum_c0, (2 * UTIL_LOW)) &&
-		    A_LTE_B(grp.sma_avg1, UTIL_ABOVE_HALF)) {
-			lpmd_log_debug("PERF_MODE to RESP_MODE\n");
-			prep_state_change(PERF_MODE, RESP_MODE, 0);
-			break;
-		}
-		// Promote -- to moderate (3) MT state
-		if (!burst_rate_breach() &&
-		    A_LTE_B(grp.c0_max, UTIL_LOW)) { // && A_LTE_B(sum_avg, UTIL_BELOW_HALF))
-			set_stay_count(MDRT3E_MODE, 0);
-			lpmd_log_debug("PERF_MODE to MDRT3E_MODE\n");
-			prep_state_change(PERF_MODE, MDRT3E_MODE, 0);
-			break;
-		}
-		//Stay -- all else
-		break;
-
-	case RESP_MODE:
-		// Demote -- if ST above halfway mark and avg trending higher
-		if (A_GT_B(grp.c0_max, UTIL_ABOVE_HALF) &&
-		    A_GT_B(grp.sma_avg1, UTIL_BELOW_HALF)) {
-			lpmd_log_debug("RESP_MODE to PERF_MODE\n");
-			prep_state_change(RESP_MODE, PERF_MODE, 0);
-			break;
-		}
-		// Stay -- if there were recent burst of spikes
-		if (perf_count && burst_rate_breach())
-			break;
-
-		// Promote -- all else
-		if (A_LTE_B(grp.worst_stall * 100, STALL_SCALE_LOWER_MARK)) {
-			lpmd_log_debug("worst stall is less than STALL_SCALE_LOWER_MARK -- stay here.\n");
-		} else {
-			lpmd_log_debug("RESP_MODE to MDRT3E_MODE\n");
-			prep_state_change(RESP_MODE, MDRT3E_MODE, 0);
-		}
-		break;
+	vars[VAR_C0_MAX] = grp.c0_max;
+	vars[VAR_C0_2ND_MAX] = grp.c0_2nd_max;
+	vars[VAR_SUM_C0] = sum_c0;
+	vars[VAR_AVG1] = grp.ema_avg1;
+	vars[VAR_AVG2] = grp.ema_avg2;
+	vars[VAR_AVG3] = grp.ema_avg3;
+	vars[VAR_STALL] = grp.worst_stall * 100;
+	vars[VAR_MT] = max_mt_detected(present_state);
+	vars[VAR_ST] = st;
+	vars[VAR_BURST_COUNT] = burst_count;
+	vars[VAR_BURST_BREACH] = burst_rate_breach();
+	vars[VAR_PERF_COUNT] = perf_count;
 
-	case MDRT4E_MODE:
-		if (A_LTE_B(grp.worst_stall * 100, STALL_SCALE_LOWER_MARK)) {
-			lpmd_log_debug("MDRT4E_MODE to RESP_MODE\n");
-			prep_state_change(MDRT4E_MODE, RESP_MODE, 0);
-			break;
-		}
-		// Demote
-		if (A_GT_B(grp.c0_max, UTIL_NEAR_FULL)) {
-			if (!burst_rate_breach() && strikeout_once(N_STRIKE))
-				break;
-			lpmd_log_debug("MDRT4E_MODE to PERF_MODE\n");
-			prep_state_change(MDRT4E_MODE, PERF_MODE, 0);
-			break;
-		}
-		// promote
-		if (A_LTE_B(grp.sma_avg1, SUS_LOW_RANGE_END) &&
-		    A_LTE_B(grp.sma_avg2, SUS_LOW_RANGE_END) &&
-		    A_LTE_B(sum_c0, UTIL_HALF)) {
-			if (!do_countdown(MDRT4E_MODE))
-				break;
-			lpmd_log_debug("MDRT4E_MODE to NORM_MODE\n");
-			prep_state_change(MDRT4E_MODE, NORM_MODE, 0);
-			break;
-		}
-		// stay
-		break;
-
-	case MDRT3E_MODE:
-		// Demote -- if mem bound work is stalling but didn't show higher utilization
-		if (A_LTE_B(grp.worst_stall * 100, STALL_SCALE_LOWER_MARK)) {
-			lpmd_log_debug("MDRT3E_MODE to RESP_MODE %.2f < %d\n",
-				       grp.worst_stall, STALL_SCALE_LOWER_MARK);
-			prep_state_change(MDRT3E_MODE, RESP_MODE, 0);
-			break;
-		}
-		// Demote to perf
-		if (A_GT_B(grp.c0_max, UTIL_NEAR_FULL)) {
-			if (!burst_rate_breach() && strikeout_once(N_STRIKE)) {
-				lpmd_log_debug("MDRT3E_MODE: burst_rate_breach AND strikeout_once - not met\n");
-				break;
-			}
-			lpmd_log_debug("MDRT3E_MODE to PERF_MODE\n");
-			prep_state_change(MDRT3E_MODE, PERF_MODE, 0);
-			break;
-		}
-
-		// Demote to 4 thread sustained
-		if (A_GTE_B(grp.sma_avg1, SUS_LOW_RANGE_END) &&
-		    A_GTE_B(grp.sma_avg2, (SUS_LOW_RANGE_END - 5))) {
-			lpmd_log_debug("MDRT3E_MODE to MDRT4E_MODE %d > %d\n",
-				       grp.sma_avg1, SUS_LOW_RANGE_END);
-			prep_state_change(MDRT3E_MODE, MDRT4E_MODE, 0);
-			break;
-		}
-		// promote
-		if ((A_GT_B(grp.sma_avg1, SUS_LOW_RANGE_START) &&
-		     A_LTE_B(grp.sma_avg1, SUS_LOW_RANGE_END)) &&
-		    (A_GT_B(grp.sma_avg2, SUS_LOW_RANGE_START) &&
-		     A_LTE_B(grp.sma_avg2, SUS_LOW_RANGE_END))) {
-			if (!do_countdown(MDRT3E_MODE)) {
-				lpmd_log_debug("MDRT3E_MODE: to MDRT2E_MODE - do countdown not met\n");
-				break;
-			}
-			lpmd_log_debug("MDRT3E_MODE to MDRT2E_MODE %d < %d\n",
-				       grp.sma_avg1, MDRT2E_MODE);
-			prep_state_change(MDRT3E_MODE, MDRT2E_MODE, 0);
-			break;
-		}
-		// Promote -- if top three avg util are trending lower.
-		if (A_LTE_B(grp.sma_avg1, SUS_LOW_RANGE_END) &&
-		   (A_LTE_B(grp.sma_avg2, SUS_LOWER) &&
-		    A_LTE_B(grp.sma_avg3, SUS_LOWER))) {
-			if (!do_countdown(MDRT3E_MODE)) {
-				lpmd_log_debug("MDRT3E_MODE: to NORM_MODE - do countdown not met\n");
-				break;
-			}
-			lpmd_log_debug("MDRT3E_MODE to NORM_MODE\n");
-			prep_state_change(MDRT3E_MODE, NORM_MODE, 0);
-			break;
-		}
-
-		lpmd_log_debug("MDRT3E_MODE: stay\n");
-		break;
-
-	case MDRT2E_MODE:
-		// Demote -- if mem bound work is stalling but didn't show higher utilization
-		if (A_LTE_B(grp.worst_stall * 100, STALL_SCALE_LOWER_MARK)) {
-			lpmd_log_debug("MDRT2E_MODE to RESP_MODE\n");
-			prep_state_change(MDRT2E_MODE, RESP_MODE, 0);
-			break;
-		}
-		// Demote -- if instant util nearing full or sustained moderate avg1 trend with avg2 trailing closeby
-		if (A_GT_B(grp.c0_max, UTIL_NEAR_FULL) ||
-		   (A_GTE_B(grp.sma_avg1, SUS_LOW_RANGE_END) &&
-		    A_GTE_B(grp.sma_avg2, SUS_LOW_RANGE_END - 10))) {
-			if (!burst_rate_breach() && strikeout_once(N_STRIKE))
-				break;
-			lpmd_log_debug("MDRT2E_MODE to MDRT3E_MODE\n");
-			prep_state_change(MDRT2E_MODE, MDRT3E_MODE, 0);
-			break;
-		}
-		// Promote -- if top two avg util are trending lower.
-		if ((A_GT_B(grp.sma_avg1, SUS_LOW_RANGE_START) &&
-		     A_LTE_B(grp.sma_avg1, SUS_LOW_RANGE_END)) &&
-		     A_LTE_B(grp.sma_avg2, SUS_LOW_RANGE_END)) {
-			if (!do_countdown(MDRT2E_MODE))
-				break;
-			lpmd_log_debug("MDRT2E_MODE to NORM_MODE\n");
-			prep_state_change(MDRT2E_MODE, NORM_MODE, 0);
-			break;
-		}
-		// stay
-		break;
-
-	case NORM_MODE:
-		// Demote -- if mem bound work is stalling but didn't show higher utilization
-		if (A_LTE_B(grp.worst_stall * 100, STALL_SCALE_LOWER_MARK)) {
-			lpmd_log_debug("NORM_MODE to RESP_MODE\n");
-			prep_state_change(NORM_MODE, RESP_MODE, 0);
-			break;
-		}
-		// Demote -- if instant util more than half or if signs of sustained ST activity.
-		if (A_GT_B(grp.c0_max, UTIL_HALF) ||
-		    (A_GT_B(grp.sma_avg1, UTIL_BELOW_HALF))) {
-			/* In this state its better to absorb few spike (noise) before reacting */
-			if (!burst_rate_breach() && strikeout_once(N_STRIKE))
-				break;
-			lpmd_log_debug("NORM_MODE to MDRT2E_MODE\n");
-			prep_state_change(NORM_MODE, MDRT2E_MODE, 0);
-			break;
-		}
-		// Promote -- if top few instant util or top avg is trending lower.
-		if ((A_LTE_B(grp.c0_max, UTIL_LOW) &&
-		     A_LTE_B(grp.c0_2nd_max, UTIL_LOWEST)) ||
-		     A_LTE_B(grp.sma_avg1, SUS_LOWER)) {
-			/* its better to absorb few dips before reacting out of a steady-state */
-			if (!do_countdown(NORM_MODE))
-				break;
-			lpmd_log_debug("NORM_MODE to DEEP_MODE\n");
-			prep_state_change(NORM_MODE, DEEP_MODE, 0);
-			break;
-		}
-		break;
-
-	case DEEP_MODE:
-		// Demote -- if mem bound work is stalling but didn't show higher util.
-		if (A_LTE_B(grp.worst_stall * 100, STALL_SCALE_LOWER_MARK)) {
-			lpmd_log_debug("DEEP_MODE to RESP_MODE\n");
-			prep_state_change(DEEP_MODE, RESP_MODE, 0);
-			break;
-		}
-		// Demote -- if there are early signs of instantaneous utilization build-up.
-		if (A_GT_B(grp.c0_max, UTIL_FILL_START)) {
-			lpmd_log_debug("DEEP_MODE to NORM_MODE\n");
-			prep_state_change(DEEP_MODE, NORM_MODE, 0);
-			break;
-		}
-
-		break;
-	}
+	state_table_eval(present_state, vars);
 
-	return 1;
+	return completed_poll;
 }
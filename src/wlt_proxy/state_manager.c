@@ -54,6 +54,12 @@ struct st_state {
 	char *hexstr;
 	char *hexstr_reverse;
 	int poll;
+	int stay_ms;
+	/* cores the mode confines work to, in the ActiveXcores format */
+	char *p_cores;
+	char *e_cores;
+	char *l_cores;
+	int cpumask_idx;
 	enum elastic_poll poll_order;
 	int stay_count;
 	int stay_count_update_sec;
@@ -68,30 +74,63 @@ struct st_state {
 static struct st_state state_info[MAX_MODE] = {
 	[INIT_MODE] = { .name = "Avail cpu: P/E/L",
 			.poll = BASE_POLL_MT,
+			.cpumask_idx = CPUMASK_NONE,
 			.poll_order = ZEROTH },
 	[PERF_MODE] = { .name = "Perf:non-soc cpu",
 			.poll = BASE_POLL_PERF,
+			.stay_ms = PERF_MODE_STAY,
+			.p_cores = "ALL",
+			.e_cores = "ALL",
+			.cpumask_idx = CPUMASK_NONE,
 			.poll_order = ZEROTH },
+	/* E-cores are numbered module by module, the first few share one */
 	[MDRT2E_MODE] = { .name = "Moderate 2E",
 			  .poll = BASE_POLL_MDRT2E,
+			  .stay_ms = MDRT_MODE_STAY,
+			  .e_cores = "2",
+			  .cpumask_idx = CPUMASK_NONE,
 			  .poll_order = LINEAR },
 	[MDRT3E_MODE] = { .name = "Moderate 3E",
 			  .poll = BASE_POLL_MDRT3E,
+			  .stay_ms = MDRT_MODE_STAY,
+			  .e_cores = "3",
+			  .cpumask_idx = CPUMASK_NONE,
 			  .poll_order = LINEAR },
 	[MDRT4E_MODE] = { .name = "Moderate 4E",
 			  .poll = BASE_POLL_MDRT4E,
+			  .stay_ms = MDRT_MODE_STAY,
+			  .e_cores = "4",
+			  .cpumask_idx = CPUMASK_NONE,
 			  .poll_order = LINEAR },
 	[RESP_MODE] = { .name = "Responsive 2L",
 			.poll = BASE_POLL_RESP,
+			.l_cores = "2",
+			.cpumask_idx = CPUMASK_NONE,
 			.poll_order = CUBIC },
 	[NORM_MODE] = { .name = "Normal LP 2L",
 			.poll = BASE_POLL_NORM,
+			.l_cores = "2",
+			.cpumask_idx = CPUMASK_NONE,
 			.poll_order = QUADRATIC },
 	[DEEP_MODE] = { .name = "Deep LP 1L",
 			.poll = BASE_POLL_DEEP,
+			.l_cores = "1",
+			.cpumask_idx = CPUMASK_NONE,
 			.poll_order = CUBIC },
 };
 
+/* state names used by the proxy state table and its config */
+static const char * const state_keys[MAX_MODE] = {
+	[INIT_MODE] = "INIT",
+	[PERF_MODE] = "PERF",
+	[MDRT4E_MODE] = "MDRT4E",
+	[MDRT3E_MODE] = "MDRT3E",
+	[MDRT2E_MODE] = "MDRT2E",
+	[RESP_MODE] = "RESP",
+	[NORM_MODE] = "NORM",
+	[DEEP_MODE] = "DEEP",
+};
+
 static enum state_idx cur_state = NORM_MODE;
 static int needs_state_reset = 1;
 
@@ -123,6 +162,32 @@ int get_poll_ms(enum state_idx state)
 	return state_info[state].poll;
 }
 
+void set_poll_ms(enum state_idx state, int poll)
+{
+	state_info[state].poll = poll;
+}
+
+void set_stay_ms(enum state_idx state, int stay_ms)
+{
+	state_info[state].stay_ms = stay_ms;
+}
+
+const char *get_state_key(enum state_idx state)
+{
+	return state_keys[state];
+}
+
+/* return the state named key, -1 if none */
+int state_key_to_idx(const char *key)
+{
+	for (int idx = INIT_MODE; idx < MAX_MODE; idx++) {
+		if (!strcmp(key, state_keys[idx]))
+			return idx;
+	}
+
+	return -1;
+}
+
 int get_stay_count(enum state_idx state)
 {
 	return state_info[state].stay_count;
@@ -264,29 +329,80 @@ int prep_state_change(enum state_idx from_state, enum state_idx to_state,
 	return 1;
 }
 
-/* return staycount for the state */
-int staytime_to_staycount(enum state_idx state)
+/* cpumask of the mode, CPUMASK_NONE if it doesn't confine */
+int get_state_cpumask(enum state_idx state)
 {
-	int stay_count = 0;
+	return state_info[state].cpumask_idx;
+}
 
-	switch (state) {
-	case MDRT2E_MODE:
-	case MDRT3E_MODE:
-	case MDRT4E_MODE:
-		stay_count = (int)MDRT_MODE_STAY / get_poll_ms(MDRT3E_MODE);
-		break;
-	case PERF_MODE:
-		stay_count = (int)PERF_MODE_STAY / get_poll_ms(PERF_MODE);
-		break;
-	default:
-		break;
+static int init_state_cpumask(struct st_state *st)
+{
+	int idx, ret = 0;
+
+	if (!st->p_cores && !st->e_cores && !st->l_cores)
+		return CPUMASK_NONE;
+
+	idx = cpumask_alloc();
+	if (idx == CPUMASK_NONE)
+		return CPUMASK_NONE;
+
+	if (st->p_cores)
+		ret += cpumask_init_cpus_type(st->p_cores, idx, P_CORE, SMT_POLICY_FILL);
+	if (st->e_cores)
+		ret += cpumask_init_cpus_type(st->e_cores, idx, E_CORE, SMT_POLICY_FILL);
+	if (st->l_cores)
+		ret += cpumask_init_cpus_type(st->l_cores, idx, L_CORE, SMT_POLICY_FILL);
+
+	/* no such cores, keep the cpus of the config state */
+	if (ret <= 0) {
+		cpumask_free(idx);
+		return CPUMASK_NONE;
 	}
-	return stay_count;
+
+	return cpumask_intern(idx);
+}
+
+/*
+ * Build the cpumask of each mode from the core types, called at init
+ * and after cpu hotplug. Modes sharing the same cpus share the mask.
+ */
+void update_state_cpumasks(void)
+{
+	struct st_state *st;
+
+	uninit_state_cpumasks();
+
+	for (int idx = INIT_MODE; idx < MAX_MODE; idx++) {
+		st = &state_info[idx];
+		st->cpumask_idx = init_state_cpumask(st);
+		if (st->cpumask_idx == CPUMASK_NONE)
+			lpmd_log_debug("WLT_Proxy: %s: no cpumask\n", st->name);
+		else
+			lpmd_log_debug("WLT_Proxy: %s: cpus %s\n", st->name,
+				       get_cpus_str(st->cpumask_idx));
+	}
+}
+
+void uninit_state_cpumasks(void)
+{
+	for (int idx = INIT_MODE; idx < MAX_MODE; idx++) {
+		if (state_info[idx].cpumask_idx != CPUMASK_NONE)
+			cpumask_free(state_info[idx].cpumask_idx);
+		state_info[idx].cpumask_idx = CPUMASK_NONE;
+	}
+}
+
+/* return staycount for the state */
+int staytime_to_staycount(enum state_idx state)
+{
+	return state_info[state].stay_ms / get_poll_ms(state);
 }
 
 /* cleanup */
 void uninit_state_manager(void)
 {
+	uninit_state_cpumasks();
+
 	for (int idx = INIT_MODE; idx < MAX_MODE; idx++) {
 		if (state_info[idx].str)
 			free(state_info[idx].str);
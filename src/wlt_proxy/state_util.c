@@ -7,50 +7,53 @@
 #include <stdio.h>
 #include <stdint.h> //uint64_t
 #include <math.h> //round
+#include <time.h> //clock_gettime
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 
 #include "lpmd.h"
 #include "state_common.h"
 
 /*
- * simple moving average (sma), event count based - not time.
+ * exponential moving average (ema), time weighted - not event count.
  * updated for up to top 3 max util streams.
  * exact cpu # is not tracked; only the max since continuum of task
  * keeps switching cpus anyway.
- * array implementation with SMA_LENGTH number of values.
+ * each sample is weighted by the time its poll covered, so the averages
+ * track real time whatever the poll period of the state (96ms to 1.8s).
+ * a sample one half-life old weighs half as much as a fresh one.
  */
-#define SMA_LENGTH		(25)
-#define SMA_CPU_COUNT		(3)
-#define SCALE_DECIMAL		(100)
-
-static int sample[3][SMA_LENGTH];
+static const int ema_half_life_ms[TOPK_UTIL] = {
+	8000,	/* max util */
+	8000,	/* 2nd max util */
+	8000,	/* 3rd max util */
+};
 
+/*
+ * Per-cpu counters and stats, one array per field indexed by cpu, so that
+ * the per-poll pass streams through the fields it uses rather than
+ * striding over whole per-cpu records.
+ */
 struct perf_stats_t {
-	int cpu;
-
-	enum core_type cpu_type;
+	int *aperf_fd;	/* group leader, read for the whole group */
+	int *mperf_fd;
+	int *pperf_fd;
+	unsigned char *cpu_type;
+
+	uint64_t *last_aperf;
+	uint64_t *last_mperf;
+	uint64_t *last_pperf;
+	uint64_t *last_tsc;
+
+	float *l0;	/* load (c0 %) of the last poll */
+	float *s0;	/* scalability: non-stalled share of the active cycles */
+};
 
-	int aperf_fd;
-	int mperf_fd;
-	int pperf_fd;
+static struct perf_stats_t perf_stats;
 
-	uint64_t aperf_diff;
-	uint64_t mperf_diff;
-	uint64_t pperf_diff;
-	uint64_t tsc_diff;
+/* lowest load per core type, as of the last poll sampling the type */
+static float type_min_load[L_CORE + 1];
 
-	uint64_t nperf;
-	/*
-	 * As initial freq f0 changes to some other value
-	 * in the next cycle, it influences the initial
-	 * load l0 and associated stall-factor (1-s0)
-	 * track them for perf-per-watt evaluation.
-	 */
-	float f0;
-	float l0;
-	float s0;
-};
-
-struct perf_stats_t *perf_stats;
 struct group_util grp;
 
 struct thread_data {
@@ -60,10 +63,24 @@ struct thread_data {
 	unsigned long long pperf;
 } *thread_even, *thread_odd;
 
-static uint64_t *last_aperf;
-static uint64_t *last_mperf;
-static uint64_t *last_pperf;
-static uint64_t *last_tsc;
+/* counter group read of one cpu, in the PERF_FORMAT_GROUP layout */
+struct amperf_sample {
+	struct thread_data data;
+	int status;
+	uint64_t buf[4]; /* nr, aperf, mperf, pperf */
+};
+
+/*
+ * Online cpus with open counters, applicable to each state, as dense
+ * lists so that a poll only walks the cpus it samples. Rebuilt at init
+ * and on cpu hotplug.
+ */
+static int *state_cpus[MAX_MODE];
+static int nr_state_cpus[MAX_MODE];
+
+/* cpus read in the current poll (one of state_cpus) and their samples */
+static int *sample_cpus;
+static struct amperf_sample *samples;
 
 /*
  * Intel Alderlake hardware errata #ADL026: pperf bits 31:64 could be incorrect.
@@ -75,56 +92,77 @@ static uint64_t *last_tsc;
 	    (uint64_t)((uint32_t)~0UL - (uint32_t)a + (uint32_t)b) :	\
 	    ((uint64_t)b - (uint64_t)a))
 
-/* routine to evaluate & store a per-cpu msr value's diff */
-#define VARI(a, b, i) (a##b[i])
-#define cpu_generate_msr_diff(scope)					\
-uint64_t cpu_get_diff_##scope(uint64_t cur_value, int instance)		\
-{									\
-	uint64_t diff;							\
-	diff = (VARI(last_, scope, instance) == 0) ?			\
-	    0 : u64diff(cur_value, VARI(last_, scope, instance));	\
-	VARI(last_, scope, instance) = cur_value;			\
-	return diff;							\
+/* start a poll with no load recorded */
+static void topk_reset(struct util_topk *k)
+{
+	for (int i = 0; i < TOPK_UTIL; i++) {
+		k->load[i] = 0;
+		k->cpu[i] = -1;
+	}
 }
 
-/********************Perf calculation - begin *****************************************/
+/* insert a cpu load, shifting the lower ones down */
+static inline void topk_add(struct util_topk *k, float load, int cpu)
+{
+	int i;
 
-cpu_generate_msr_diff(aperf);
-cpu_generate_msr_diff(mperf);
-cpu_generate_msr_diff(pperf);
-cpu_generate_msr_diff(tsc);
+	if (load <= k->load[TOPK_UTIL - 1])
+		return;
 
-/* initialize perf_stat structure */
-static int perf_stat_init(void)
+	for (i = TOPK_UTIL - 1; i > 0 && k->load[i - 1] < load; i--) {
+		k->load[i] = k->load[i - 1];
+		k->cpu[i] = k->cpu[i - 1];
+	}
+	k->load[i] = load;
+	k->cpu[i] = cpu;
+}
+
+/* evaluate & store a per-cpu msr value's diff */
+static inline uint64_t cpu_get_diff(uint64_t *last, uint64_t cur_value)
 {
-	int max_cpus = get_max_cpus();
+	uint64_t diff = *last ? u64diff(cur_value, *last) : 0;
+
+	*last = cur_value;
+	return diff;
+}
+
+/********************Perf calculation - begin *****************************************/
 
-	perf_stats = NULL;
-	perf_stats = calloc(max_cpus, sizeof(struct perf_stats_t));
-	if (!perf_stats) {
+/* initialize perf_stat structure */
+static int perf_stat_init(int n)
+{
+	perf_stats.aperf_fd = malloc(n * sizeof(int));
+	perf_stats.mperf_fd = malloc(n * sizeof(int));
+	perf_stats.pperf_fd = malloc(n * sizeof(int));
+	perf_stats.cpu_type = calloc(n, sizeof(unsigned char));
+	perf_stats.last_aperf = calloc(n, sizeof(uint64_t));
+	perf_stats.last_mperf = calloc(n, sizeof(uint64_t));
+	perf_stats.last_pperf = calloc(n, sizeof(uint64_t));
+	perf_stats.last_tsc = calloc(n, sizeof(uint64_t));
+	perf_stats.l0 = calloc(n, sizeof(float));
+	perf_stats.s0 = calloc(n, sizeof(float));
+	if (!perf_stats.aperf_fd || !perf_stats.mperf_fd || !perf_stats.pperf_fd ||
+	    !perf_stats.cpu_type || !perf_stats.last_aperf || !perf_stats.last_mperf ||
+	    !perf_stats.last_pperf || !perf_stats.last_tsc || !perf_stats.l0 ||
+	    !perf_stats.s0) {
 		lpmd_log_error("WLT_Proxy: memory failure\n");
 		return 0;
 	}
 
-	for (int t = 0; t < max_cpus; t++) {
-		if (!is_cpu_online(t))
-			continue;
-
-		perf_stats[t].cpu = t;
-
-		if (is_cpu_pcore(t))
-			perf_stats[t].cpu_type = P_CORE;
-		else if (is_cpu_ecore(t))
-			perf_stats[t].cpu_type = E_CORE;
-		else
-			perf_stats[t].cpu_type = L_CORE;
+	for (int t = 0; t < n; t++) {
+		perf_stats.aperf_fd[t] = -1;
+		perf_stats.mperf_fd[t] = -1;
+		perf_stats.pperf_fd[t] = -1;
 	}
 
+	for (int type = P_CORE; type <= L_CORE; type++)
+		type_min_load[type] = 100.0;
+
 	return 1;
 }
 
-/* is cpu applicable for the given state*/
-static int cpu_applicable(int cpu, enum state_idx state)
+/* is core type applicable for the given state*/
+static int type_applicable(int type, enum state_idx state)
 {
 	switch (state) {
 	case INIT_MODE:
@@ -133,11 +171,15 @@ static int cpu_applicable(int cpu, enum state_idx state)
 	case NORM_MODE: // 2 L cores
 	case DEEP_MODE: // 1 L core
 	case RESP_MODE: // all L core
+		/* work confined to the L cores must be seen to leave the mode */
+		if (type == L_CORE)
+			return get_lpmd_config()->wlt_proxy_confine;
+		return 1;
 	case MDRT2E_MODE: // 2 E cores
 	case MDRT3E_MODE: // 3 E cores
 	case MDRT4E_MODE: // 4 E cores
 	case PERF_MODE:
-		if (perf_stats[cpu].cpu_type != L_CORE)
+		if (type != L_CORE)
 			return 1;
 	default:
 		break;
@@ -146,18 +188,55 @@ static int cpu_applicable(int cpu, enum state_idx state)
 	return 0;
 }
 
+/* rebuild the per state cpu lists, from the cpus with counters open */
+static void update_state_cpus(void)
+{
+	int t, state;
+
+	for (state = 0; state < MAX_MODE; state++)
+		nr_state_cpus[state] = 0;
+
+	for (t = 0; t < get_max_cpus(); t++) {
+		if (!is_cpu_online(t) || perf_stats.aperf_fd[t] < 0)
+			continue;
+
+		if (is_cpu_pcore(t))
+			perf_stats.cpu_type[t] = P_CORE;
+		else if (is_cpu_ecore(t))
+			perf_stats.cpu_type[t] = E_CORE;
+		else
+			perf_stats.cpu_type[t] = L_CORE;
+
+		for (state = 0; state < MAX_MODE; state++) {
+			if (type_applicable(perf_stats.cpu_type[t], state))
+				state_cpus[state][nr_state_cpus[state]++] = t;
+		}
+	}
+
+	for (state = 0; state < MAX_MODE; state++)
+		lpmd_log_debug("WLT_Proxy: %d cpus sampled in state %d\n",
+			       nr_state_cpus[state], state);
+}
+
 static int init_perf_calculations(int n)
 {
-	if (!perf_stat_init()) {
+	int state;
+
+	if (!perf_stat_init(n)) {
 		lpmd_log_error("\nerror initiating cpu proxy\n");
 		return -1;
 	}
 
-	last_aperf = calloc(n, sizeof(uint64_t));
-	last_mperf = calloc(n, sizeof(uint64_t));
-	last_pperf = calloc(n, sizeof(uint64_t));
-	last_tsc = calloc(n, sizeof(uint64_t));
-	if (!last_aperf || !last_mperf || !last_mperf || !last_tsc) {
+	for (state = 0; state < MAX_MODE; state++) {
+		state_cpus[state] = calloc(n, sizeof(int));
+		if (!state_cpus[state]) {
+			lpmd_log_error("calloc failure perf vars\n");
+			return -2;
+		}
+	}
+
+	samples = calloc(n, sizeof(struct amperf_sample));
+	if (!samples) {
 		lpmd_log_error("calloc failure perf vars\n");
 		return -2;
 	}
@@ -221,7 +300,7 @@ static unsigned int read_perf_counter_info_n(const char *const path,
 }
 
 /* helper - pperf reading */
-static int read_pperf_config(void)
+static unsigned int read_pperf_config(void)
 {
 	const char *const path = "/sys/bus/event_source/devices/msr/events/pperf";
 	const char *const format = "event=%x";
@@ -285,28 +364,92 @@ static long open_perf_counter(int cpu, unsigned int type, unsigned int config,
 	return fd;
 }
 
+/* msr PMU type and event configs, the same for all CPUs */
+static struct {
+	unsigned int type;
+	unsigned int aperf;
+	unsigned int mperf;
+	unsigned int pperf;
+} msr_pmu;
+
 /* helper - pperf reading */
-static void open_amperf_fd(int cpu)
+static int resolve_msr_pmu(void)
 {
-	const unsigned int msr_type = read_msr_type();
-	const unsigned int aperf_config = read_aperf_config();
-	const unsigned int mperf_config = read_mperf_config();
-	const unsigned int pperf_config = read_pperf_config();
+	msr_pmu.type = read_msr_type();
+	msr_pmu.aperf = read_aperf_config();
+	msr_pmu.mperf = read_mperf_config();
+	msr_pmu.pperf = read_pperf_config();
+
+	if (msr_pmu.type == -1U || msr_pmu.aperf == -1U ||
+	    msr_pmu.mperf == -1U || msr_pmu.pperf == -1U)
+		return LPMD_ERROR;
 
-	perf_stats[cpu].aperf_fd = open_perf_counter(cpu, msr_type, aperf_config, -1, PERF_FORMAT_GROUP);
-	perf_stats[cpu].mperf_fd = open_perf_counter(cpu, msr_type, mperf_config, perf_stats[cpu].aperf_fd, PERF_FORMAT_GROUP);
-	perf_stats[cpu].pperf_fd = open_perf_counter(cpu, msr_type, pperf_config, perf_stats[cpu].aperf_fd, PERF_FORMAT_GROUP);
+	return LPMD_SUCCESS;
 }
 
-/* helper - pperf reading */
-static int get_amperf_fd(int cpu)
+/* close perf fd's */
+static void close_amperf_fd(int cpu)
+{
+	if (perf_stats.pperf_fd[cpu] >= 0)
+		close(perf_stats.pperf_fd[cpu]);
+	if (perf_stats.mperf_fd[cpu] >= 0)
+		close(perf_stats.mperf_fd[cpu]);
+	if (perf_stats.aperf_fd[cpu] >= 0)
+		close(perf_stats.aperf_fd[cpu]);
+
+	perf_stats.aperf_fd[cpu] = -1;
+	perf_stats.mperf_fd[cpu] = -1;
+	perf_stats.pperf_fd[cpu] = -1;
+}
+
+/* helper - pperf reading. A group is either fully opened or not at all */
+static int open_amperf_fd(int cpu)
 {
-	if (perf_stats[cpu].aperf_fd)
-		return perf_stats[cpu].aperf_fd;
+	perf_stats.aperf_fd[cpu] = open_perf_counter(cpu, msr_pmu.type, msr_pmu.aperf, -1, PERF_FORMAT_GROUP);
+	if (perf_stats.aperf_fd[cpu] < 0)
+		goto err;
+
+	perf_stats.mperf_fd[cpu] = open_perf_counter(cpu, msr_pmu.type, msr_pmu.mperf, perf_stats.aperf_fd[cpu], PERF_FORMAT_GROUP);
+	if (perf_stats.mperf_fd[cpu] < 0)
+		goto err;
 
-	open_amperf_fd(cpu);
+	perf_stats.pperf_fd[cpu] = open_perf_counter(cpu, msr_pmu.type, msr_pmu.pperf, perf_stats.aperf_fd[cpu], PERF_FORMAT_GROUP);
+	if (perf_stats.pperf_fd[cpu] < 0)
+		goto err;
 
-	return perf_stats[cpu].aperf_fd;
+	/* A new group restarts the diffs */
+	perf_stats.last_aperf[cpu] = 0;
+	perf_stats.last_mperf[cpu] = 0;
+	perf_stats.last_pperf[cpu] = 0;
+	perf_stats.last_tsc[cpu] = 0;
+
+	return LPMD_SUCCESS;
+
+err:
+	close_amperf_fd(cpu);
+	return LPMD_ERROR;
+}
+
+/*
+ * Open the counter groups of all the online CPUs up front, so that the
+ * polls only read them. Fails if no CPU can be monitored.
+ */
+static int open_all_amperf_fds(void)
+{
+	int t, opened = 0;
+
+	for (t = 0; t < get_max_cpus(); t++) {
+		if (!is_cpu_online(t))
+			continue;
+
+		if (open_amperf_fd(t) != LPMD_SUCCESS) {
+			lpmd_log_warn("WLT_Proxy: failed to open perf counters for cpu %d\n", t);
+			continue;
+		}
+		opened++;
+	}
+
+	return opened ? LPMD_SUCCESS : LPMD_ERROR;
 }
 
 /* helper - pperf reading */
@@ -320,69 +463,421 @@ static unsigned long long rdtsc(void)
 }
 
 /*
- * Helper for - Reading APERF, MPERF and TSC using the perf API.
- * Calc perf [cpu utilization per core] difference from MSR registers
+ * Burst wakeups (WLTProxyBurstWake): a sampling event per cpu on unhalted
+ * reference cycles, which tick at the TSC rate while the cpu is busy. It
+ * takes a sample each BURST_SAMPLE_MS busy, which wakes the proxy thread
+ * through the perf fd. A cpu is in a burst when its last BURST_SAMPLES
+ * samples came within BURST_WINDOW_MS, i.e. it was busy for BURST_WAKE_MS
+ * at BURST_WAKE_UTIL or more, wherever the burst starts in the interval.
+ * Samples further apart are background load. The events are armed by the
+ * regular polls of the slow states, so those no longer hide short bursts.
  */
-static int read_aperf_mperf_tsc_perf(struct thread_data *t, int cpu)
+#define BURST_WAKE_MS		50
+#define BURST_SAMPLE_MS		10
+#define BURST_SAMPLES		(BURST_WAKE_MS / BURST_SAMPLE_MS)
+#define BURST_WAKE_UTIL		UTIL_HALF
+/* span of the busy time between the first and the last sample */
+#define BURST_WINDOW_MS		((BURST_SAMPLES - 1) * BURST_SAMPLE_MS * 100 / BURST_WAKE_UTIL)
+#define BURST_RB_PAGES		2	/* header page + one data page */
+
+/* times of the last BURST_SAMPLES samples of a cpu, in ns */
+struct burst_hist {
+	uint64_t ns[BURST_SAMPLES];
+	int next;
+	int nr;
+};
+
+static int *burst_fd;
+static struct perf_event_mmap_page **burst_rb;
+static struct burst_hist *burst_hist;
+static size_t burst_rb_size;
+static size_t burst_page_size;
+static uint64_t burst_period;
+
+/* reference cycles per ms, from the TSC over a short sleep */
+static uint64_t tsc_per_ms(void)
+{
+	struct timespec req = { .tv_nsec = 10 * 1000000 };
+	struct timespec start, end;
+	uint64_t tsc, ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	tsc = rdtsc();
+	nanosleep(&req, NULL);
+	tsc = rdtsc() - tsc;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	ns = (end.tv_sec - start.tv_sec) * 1000000000ULL +
+	     end.tv_nsec - start.tv_nsec;
+
+	return ns ? tsc * 1000000 / ns : 0;
+}
+
+static void close_burst_fd(int cpu)
 {
-	union {
-		struct {
-			unsigned long nr_entries;
-			unsigned long aperf;
-			unsigned long mperf;
-			unsigned long pperf;
-		};
+	if (burst_rb[cpu])
+		munmap(burst_rb[cpu], burst_rb_size);
+	if (burst_fd[cpu] >= 0)
+		close(burst_fd[cpu]);
 
-		unsigned long as_array[4];
-	} cnt;
-	const int fd_amperf = get_amperf_fd(cpu);
+	burst_rb[cpu] = NULL;
+	burst_fd[cpu] = -1;
+}
 
-	if (fd_amperf == -1)
+static int open_burst_fd(int cpu)
+{
+	struct perf_event_attr attr;
+	void *rb;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_REF_CPU_CYCLES;
+	attr.sample_period = burst_period;
+	attr.sample_type = PERF_SAMPLE_TIME;
+	attr.wakeup_events = 1;
+	attr.disabled = 1;	/* armed by the polls */
+
+	burst_fd[cpu] = perf_event_open(&attr, -1, cpu, -1, PERF_FLAG_FD_CLOEXEC);
+	if (burst_fd[cpu] < 0)
 		return LPMD_ERROR;
 
+	/* the overflows are only signaled through a ring buffer */
+	rb = mmap(NULL, burst_rb_size, PROT_READ | PROT_WRITE, MAP_SHARED, burst_fd[cpu], 0);
+	if (rb == MAP_FAILED) {
+		close_burst_fd(cpu);
+		return LPMD_ERROR;
+	}
+	burst_rb[cpu] = rb;
+	burst_hist[cpu].nr = 0;
+
+	return LPMD_SUCCESS;
+}
+
+static void open_all_burst_fds(void)
+{
+	for (int t = 0; t < get_max_cpus(); t++) {
+		if (!is_cpu_online(t))
+			continue;
+
+		if (open_burst_fd(t) != LPMD_SUCCESS)
+			lpmd_log_debug("WLT_Proxy: no burst wakeup for cpu %d\n", t);
+	}
+}
+
+static void uninit_burst_wake(void)
+{
+	if (!burst_fd)
+		return;
+
+	for (int t = 0; t < get_max_cpus(); t++)
+		close_burst_fd(t);
+
+	free(burst_fd);
+	burst_fd = NULL;
+	free(burst_rb);
+	burst_rb = NULL;
+	free(burst_hist);
+	burst_hist = NULL;
+}
+
+int util_burst_wake_init(void)
+{
+	uint64_t rate = tsc_per_ms();
+	int t, n = get_max_cpus();
+
+	if (!rate) {
+		lpmd_log_error("WLT_Proxy: failed to calibrate the TSC\n");
+		return LPMD_ERROR;
+	}
+
+	burst_period = rate * BURST_SAMPLE_MS;
+	burst_page_size = sysconf(_SC_PAGESIZE);
+	burst_rb_size = BURST_RB_PAGES * burst_page_size;
+
+	burst_fd = malloc(n * sizeof(int));
+	burst_rb = calloc(n, sizeof(*burst_rb));
+	burst_hist = calloc(n, sizeof(*burst_hist));
+	if (!burst_fd || !burst_rb || !burst_hist) {
+		lpmd_log_error("WLT_Proxy: memory failure\n");
+		uninit_burst_wake();
+		return LPMD_ERROR;
+	}
+
+	for (t = 0; t < n; t++)
+		burst_fd[t] = -1;
+
+	open_all_burst_fds();
+
+	if (!util_burst_wake_fds(NULL, 0)) {
+		lpmd_log_error("WLT_Proxy: burst wakeup events not available\n");
+		uninit_burst_wake();
+		return LPMD_ERROR;
+	}
+
+	lpmd_log_info("WLT_Proxy: burst wakeups after %d ms busy within %d ms\n",
+		      BURST_WAKE_MS, BURST_SAMPLE_MS + BURST_WINDOW_MS);
+
+	return LPMD_SUCCESS;
+}
+
+/* fill pfds with up to max burst wakeup fds, return the number of open ones */
+int util_burst_wake_fds(struct pollfd *pfds, int max)
+{
+	int t, nr = 0;
+
+	if (!burst_fd)
+		return 0;
+
+	for (t = 0; t < get_max_cpus(); t++) {
+		if (burst_fd[t] < 0)
+			continue;
+
+		if (nr < max) {
+			pfds[nr].fd = burst_fd[t];
+			pfds[nr].events = POLLIN;
+			pfds[nr].revents = 0;
+		}
+		nr++;
+	}
+
+	return nr;
+}
+
+/* drop the samples of the cpu not read yet */
+static void burst_drop_samples(int cpu)
+{
+	struct perf_event_mmap_page *pg = burst_rb[cpu];
+
+	__atomic_store_n(&pg->data_tail, __atomic_load_n(&pg->data_head, __ATOMIC_ACQUIRE),
+			 __ATOMIC_RELEASE);
+}
+
+/* copy len bytes at offset off of the ring buffer data, which wraps around */
+static void burst_rb_copy(int cpu, uint64_t off, void *dst, size_t len)
+{
+	unsigned char *data = (unsigned char *)burst_rb[cpu] + burst_page_size;
+	size_t size = burst_rb_size - burst_page_size;
+	size_t pos = off % size;
+	size_t first = len < size - pos ? len : size - pos;
+
+	memcpy(dst, data + pos, first);
+	memcpy((unsigned char *)dst + first, data, len - first);
+}
+
+/* add the new samples of the cpu to its history, 1 if it is in a burst */
+static int burst_read_samples(int cpu)
+{
+	struct perf_event_mmap_page *pg = burst_rb[cpu];
+	struct burst_hist *hist = &burst_hist[cpu];
+	struct perf_event_header hdr;
+	uint64_t head, tail, ns;
+
+	head = __atomic_load_n(&pg->data_head, __ATOMIC_ACQUIRE);
+	for (tail = pg->data_tail; tail + sizeof(hdr) <= head; tail += hdr.size) {
+		burst_rb_copy(cpu, tail, &hdr, sizeof(hdr));
+		if (hdr.size < sizeof(hdr))
+			break;
+
+		/* throttle and lost records carry no sample */
+		if (hdr.type != PERF_RECORD_SAMPLE || hdr.size < sizeof(hdr) + sizeof(ns))
+			continue;
+
+		burst_rb_copy(cpu, tail + sizeof(hdr), &ns, sizeof(ns));
+		hist->ns[hist->next] = ns;
+		hist->next = (hist->next + 1) % BURST_SAMPLES;
+		if (hist->nr < BURST_SAMPLES)
+			hist->nr++;
+	}
+	__atomic_store_n(&pg->data_tail, head, __ATOMIC_RELEASE);
+
+	if (hist->nr < BURST_SAMPLES)
+		return 0;
+
+	/* next is the oldest sample, the one before it the newest */
+	ns = hist->ns[(hist->next + BURST_SAMPLES - 1) % BURST_SAMPLES] - hist->ns[hist->next];
+
+	return ns <= BURST_WINDOW_MS * 1000000ULL;
+}
+
+/* start sampling all cpus from now, forgetting the samples so far */
+void util_burst_wake_arm(void)
+{
+	if (!burst_fd)
+		return;
+
+	for (int t = 0; t < get_max_cpus(); t++) {
+		if (burst_fd[t] < 0)
+			continue;
+
+		burst_drop_samples(t);
+		burst_hist[t].nr = 0;
+
+		/* a new period also restarts the count to the next sample */
+		ioctl(burst_fd[t], PERF_EVENT_IOC_PERIOD, &burst_period);
+		ioctl(burst_fd[t], PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+/* close the burst wakeup of the cpu with this fd */
+void util_burst_wake_close(int fd)
+{
+	if (!burst_fd)
+		return;
+
+	for (int t = 0; t < get_max_cpus(); t++) {
+		if (burst_fd[t] == fd) {
+			lpmd_log_debug("WLT_Proxy: burst wakeup of cpu %d failed\n", t);
+			close_burst_fd(t);
+			return;
+		}
+	}
+}
+
+void util_burst_wake_disarm(void)
+{
+	if (!burst_fd)
+		return;
+
+	for (int t = 0; t < get_max_cpus(); t++) {
+		if (burst_fd[t] >= 0)
+			ioctl(burst_fd[t], PERF_EVENT_IOC_DISABLE, 0);
+	}
+}
+
+/*
+ * Called on a burst wakeup: return the busy time of the burst in ms, the
+ * wakeups then staying off until the next regular poll, or 0 for samples
+ * of background load, the sampling going on.
+ */
+int util_burst_wake_check(void)
+{
+	int t, burst = 0;
+
+	if (!burst_fd)
+		return 0;
+
+	/* read all cpus, so the histories stay current */
+	for (t = 0; t < get_max_cpus(); t++) {
+		if (burst_fd[t] >= 0 && burst_read_samples(t)) {
+			lpmd_log_debug("WLT_Proxy: burst on cpu %d\n", t);
+			burst = 1;
+		}
+	}
+
+	if (!burst)
+		return 0;
+
+	util_burst_wake_disarm();
+
+	return BURST_WAKE_MS;
+}
+
+/*
+ * Reopen the counter groups after CPU hotplug, from the uevent path
+ * rather than from the next poll. Events of an offlined CPU don't resume
+ * when it comes back, and offline CPUs simply fail to open.
+ */
+void util_proxy_update_cpus(void)
+{
+	int t;
+
+	if (!perf_stats.aperf_fd)
+		return;
+
+	for (t = 0; t < get_max_cpus(); t++) {
+		close_amperf_fd(t);
+		if (open_amperf_fd(t) == LPMD_SUCCESS)
+			lpmd_log_debug("WLT_Proxy: perf counters opened for cpu %d\n", t);
+	}
+
+	if (burst_fd) {
+		for (t = 0; t < get_max_cpus(); t++)
+			close_burst_fd(t);
+		open_all_burst_fds();
+	}
+
+	update_state_cpus();
+}
+
+/*
+ * Helper for - Reading APERF, MPERF and TSC using the perf API.
+ * Calc perf [cpu utilization per core] difference from MSR registers
+ */
+static int read_aperf_mperf_tsc_perf(struct amperf_sample *s, int cpu)
+{
 	/*
 	 * Read the TSC with rdtsc, because we want the absolute value and not
 	 * the offset from the start of the counter.
 	 */
-	t->tsc = rdtsc();
+	s->data.tsc = rdtsc();
 
-	const int n = read(fd_amperf, &cnt.as_array[0], sizeof(cnt.as_array));
+	const int n = read(perf_stats.aperf_fd[cpu], s->buf, sizeof(s->buf));
 
-	if (n != sizeof(cnt.as_array))
+	if (n != sizeof(s->buf))
 		return -2;
 
-	t->aperf = cnt.aperf;
-	t->mperf = cnt.mperf;
-	t->pperf = cnt.pperf;
-
 	return LPMD_SUCCESS;
 }
 
-/* Calc perf [cpu utilization per core] difference from MSR registers */
+/* read the counter groups of the nr cpus in sample_cpus */
+static void read_amperf_batch(int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		samples[i].status = read_aperf_mperf_tsc_perf(&samples[i], sample_cpus[i]);
+		samples[i].data.aperf = samples[i].buf[1];
+		samples[i].data.mperf = samples[i].buf[2];
+		samples[i].data.pperf = samples[i].buf[3];
+	}
+}
+
+/*
+ * Calc perf [cpu utilization per core] difference from MSR registers.
+ * Diffs, loads, scalability and the group reductions are all done in a
+ * single pass over the cpus sampled in this poll.
+ */
 int update_perf_diffs(float *sum_norm_perf, int stat_init_only)
 {
-	float max_load = 0, max_2nd_load = 0, max_3rd_load = 0, next_load = 0;
-	float min_load = 100.0, min_s0 = 1.0, next_s0 = 1.0;
-	int t, min_s0_cpu = 0, first_pass = 1;
-	struct thread_data tdata;
-	int maxed_cpu = -1;
+	float min_load = 100.0, min_s0 = 1.0;
+	int t, i, type, min_s0_cpu = 0, first_pass = 1;
+	enum state_idx state = get_cur_state();
+	int nr = nr_state_cpus[state];
+	struct thread_data *tdata;
 
-	for (t = 0; t < get_max_online_cpu(); t++) {
-		if (!cpu_applicable(t, get_cur_state()))
-			continue;
+	sample_cpus = state_cpus[state];
+
+	/*reading through perf api*/
+	read_amperf_batch(nr);
 
-		/*reading through perf api*/
-		if (read_aperf_mperf_tsc_perf(&tdata, t) != LPMD_SUCCESS) {
+	for (type = P_CORE; type <= L_CORE; type++) {
+		if (type_applicable(type, state))
+			type_min_load[type] = 100.0;
+		topk_reset(&grp.top_type[type]);
+	}
+	topk_reset(&grp.top);
+
+	for (i = 0; i < nr; i++) {
+		uint64_t aperf, mperf, pperf, tsc;
+		float load, s0;
+
+		t = sample_cpus[i];
+		type = perf_stats.cpu_type[t];
+
+		if (samples[i].status != LPMD_SUCCESS) {
 			lpmd_log_error("read_aperf_mperf_tsc_perf failed for cpu = %d\n", t);
+			/* the last load still counts for multi-thread detection */
+			if (perf_stats.l0[t] < type_min_load[type])
+				type_min_load[type] = perf_stats.l0[t];
 			continue;
 		}
-		perf_stats[t].pperf_diff = cpu_get_diff_pperf(tdata.pperf, t);
-		perf_stats[t].aperf_diff = cpu_get_diff_aperf(tdata.aperf, t);
-		perf_stats[t].mperf_diff = cpu_get_diff_mperf(tdata.mperf, t);
-		perf_stats[t].tsc_diff = cpu_get_diff_tsc(tdata.tsc, t);
 
-		if (stat_init_only)
-			continue;
+		tdata = &samples[i].data;
+		pperf = cpu_get_diff(&perf_stats.last_pperf[t], tdata->pperf);
+		aperf = cpu_get_diff(&perf_stats.last_aperf[t], tdata->aperf);
+		mperf = cpu_get_diff(&perf_stats.last_mperf[t], tdata->mperf);
+		tsc = cpu_get_diff(&perf_stats.last_tsc[t], tdata->tsc);
 
 		/*
 		 * Normalized perf metric defined as pperf per load per time.
@@ -391,34 +886,32 @@ int update_perf_diffs(float *sum_norm_perf, int stat_init_only)
 		 * Given that delta_load = delta_mperf/delta_tsc, we can rewrite
 		 * as given below.
 		 */
-		if (perf_stats[t].tsc_diff) {
-			next_load = (float)100 * perf_stats[t].mperf_diff /
-				    perf_stats[t].tsc_diff;
-			perf_stats[t].l0 = next_load;
-		}
+		load = tsc ? (float)100 * mperf / tsc : 0;
+
+		/* since aperf/pperf are not read oneshot, ratio > 1 is not ruled out */
+		s0 = aperf ? (float)pperf / aperf : 1;
+		s0 = (s0 >= 1) ? (1 - EPSILON) : s0;
+
+		perf_stats.l0[t] = load;
+		perf_stats.s0[t] = s0;
+
+		if (load < type_min_load[type])
+			type_min_load[type] = load;
+
+		if (stat_init_only)
+			continue;
+
+		topk_add(&grp.top, load, t);
+		topk_add(&grp.top_type[type], load, t);
 
-		if (A_LTE_B(max_load, next_load)) {
-			max_load = next_load;
-			maxed_cpu = perf_stats[t].cpu;
-		} else if (A_LTE_B(max_2nd_load, next_load)) {
-			max_2nd_load = next_load;
-		} else if (A_LTE_B(max_3rd_load, next_load)) {
-			max_3rd_load = next_load;
-		}
 		/* min scalability */
-		if (perf_stats[t].aperf_diff) {
-			next_s0 = (float)perf_stats[t].pperf_diff /
-				  perf_stats[t].aperf_diff;
-			/* since aperf/pperf are not read oneshot, ratio > 1 is not ruled out */
-			next_s0 = (next_s0 >= 1) ? (1 - EPSILON) : next_s0;
-		}
-		if (A_LTE_B(next_s0, min_s0) || first_pass) {
-			min_s0 = next_s0;
-			min_s0_cpu = perf_stats[t].cpu;
+		if (A_LTE_B(s0, min_s0) || first_pass) {
+			min_s0 = s0;
+			min_s0_cpu = t;
 		}
 
-		if (A_GT_B(min_load, next_load))
-			min_load = next_load;
+		if (A_GT_B(min_load, load))
+			min_load = load;
 
 		first_pass = 0;
 	}
@@ -429,127 +922,111 @@ int update_perf_diffs(float *sum_norm_perf, int stat_init_only)
 	grp.worst_stall = min_s0;
 	grp.worst_stall_cpu = min_s0_cpu;
 
-	grp.c0_max = max_load;
-	grp.c0_2nd_max = max_2nd_load;
-	grp.c0_3rd_max = max_3rd_load;
+	grp.c0_max = grp.top.load[0];
+	grp.c0_2nd_max = grp.top.load[1];
+	grp.c0_3rd_max = grp.top.load[2];
 	grp.c0_min = min_load;
 
-	return maxed_cpu;
-}
-
-/* close perf fd's */
-static void close_amperf_fd(int cpu)
-{
-	if (perf_stats[cpu].aperf_fd)
-		close(perf_stats[cpu].aperf_fd);
-	if (perf_stats[cpu].mperf_fd)
-		close(perf_stats[cpu].mperf_fd);
-	if (perf_stats[cpu].pperf_fd)
-		close(perf_stats[cpu].pperf_fd);
+	return grp.top.cpu[0];
 }
 
 /* cleanup perf_stat structure */
 static void perf_stat_uninit(void)
 {
-	int max_cpus = get_max_cpus();
-
-	if (perf_stats) {
-		for (size_t i = 0; i < max_cpus; ++i) {
+	if (perf_stats.aperf_fd) {
+		for (int i = 0; i < get_max_cpus(); ++i)
 			close_amperf_fd(i);
-			memset(&perf_stats[i], 0, sizeof(struct perf_stats_t));
-		}
-		free(perf_stats);
 	}
+
+	free(perf_stats.aperf_fd);
+	free(perf_stats.mperf_fd);
+	free(perf_stats.pperf_fd);
+	free(perf_stats.cpu_type);
+	free(perf_stats.last_aperf);
+	free(perf_stats.last_mperf);
+	free(perf_stats.last_pperf);
+	free(perf_stats.last_tsc);
+	free(perf_stats.l0);
+	free(perf_stats.s0);
+	memset(&perf_stats, 0, sizeof(perf_stats));
 }
 
 static void uninit_perf_calculations(void)
 {
+	uninit_burst_wake();
 	perf_stat_uninit();
 
-	if (last_aperf)
-		free(last_aperf);
-	if (last_mperf)
-		free(last_mperf);
-	if (last_pperf)
-		free(last_pperf);
-	if (last_tsc)
-		free(last_tsc);
+	for (int state = 0; state < MAX_MODE; state++) {
+		free(state_cpus[state]);
+		state_cpus[state] = NULL;
+		nr_state_cpus[state] = 0;
+	}
+	sample_cpus = NULL;
+	free(samples);
+	samples = NULL;
 }
 
 /********************perf calculation - end *****************************************/
 
-/********************SMA calculation - begin *****************************************/
+/********************EMA calculation - begin *****************************************/
 
 /* initialize avg calculation variables */
-static void init_sma_calculations(void)
+static void init_ema_calculations(void)
 {
-	for (int i = 0; i < SMA_CPU_COUNT; i++) {
-		grp.sma_sum[i] = -1;
-		for (int j = 0; j < SMA_LENGTH; j++)
-			sample[i][j] = 0;
-	}
-	grp.sma_pos = -1;
+	for (int i = 0; i < TOPK_UTIL; i++)
+		grp.ema[i] = 0;
+	grp.ema_last_ms = 0;
 }
 
-/* Helper avg calculation */
-static int do_sum(int *sam, int len)
+/* monotonic time in ms, for the proxy time keeping */
+uint64_t proxy_now_ms(void)
 {
-	int sum = 0;
+	struct timespec ts;
 
-	for (int i = 0; i < len; i++)
-		sum += sam[i];
-	return sum;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
 }
 
 /* average cpu usage */
 int state_max_avg(void)
 {
-	grp.sma_pos += 1;
-
-	int v1 = (int)round(grp.c0_max * SCALE_DECIMAL);
-	int v2 = (int)round(grp.c0_2nd_max * SCALE_DECIMAL);
-	int v3 = (int)round(grp.c0_3rd_max * SCALE_DECIMAL);
-
-	if (grp.sma_pos == SMA_LENGTH)
-		grp.sma_pos = 0;
-	if (grp.sma_sum[0] == -1) {
-		sample[0][grp.sma_pos] = v1;
-		sample[1][grp.sma_pos] = v2;
-		sample[2][grp.sma_pos] = v3;
-		if (grp.sma_pos == SMA_LENGTH - 1) {
-			grp.sma_sum[0] = do_sum(sample[0], SMA_LENGTH);
-			grp.sma_sum[1] = do_sum(sample[1], SMA_LENGTH);
-			grp.sma_sum[2] = do_sum(sample[2], SMA_LENGTH);
+	float v[TOPK_UTIL] = { grp.c0_max, grp.c0_2nd_max, grp.c0_3rd_max };
+	uint64_t now = proxy_now_ms();
+	double elapsed, w;
+
+	/* the first sample seeds the averages */
+	elapsed = grp.ema_last_ms ? (double)(now - grp.ema_last_ms) : -1;
+	grp.ema_last_ms = now;
+
+	for (int i = 0; i < TOPK_UTIL; i++) {
+		if (elapsed < 0) {
+			grp.ema[i] = v[i];
+			continue;
 		}
-	} else {
-		grp.sma_sum[0] = grp.sma_sum[0] - sample[0][grp.sma_pos] + v1;
-		grp.sma_sum[1] = grp.sma_sum[1] - sample[1][grp.sma_pos] + v2;
-		grp.sma_sum[2] = grp.sma_sum[2] - sample[2][grp.sma_pos] + v3;
-		sample[0][grp.sma_pos] = v1;
-		sample[1][grp.sma_pos] = v2;
-		sample[2][grp.sma_pos] = v3;
-	}
-
-	grp.sma_avg1 = (int)round((double)grp.sma_sum[0] /
-				  (double)(SMA_LENGTH * SCALE_DECIMAL));
-	grp.sma_avg2 = (int)round((double)grp.sma_sum[1] /
-				  (double)(SMA_LENGTH * SCALE_DECIMAL));
-	grp.sma_avg3 = (int)round((double)grp.sma_sum[2] /
-				  (double)(SMA_LENGTH * SCALE_DECIMAL));
+		w = 1 - exp2(-elapsed / ema_half_life_ms[i]);
+		grp.ema[i] += w * (v[i] - grp.ema[i]);
+	}
+
+	grp.ema_avg1 = (int)round(grp.ema[0]);
+	grp.ema_avg2 = (int)round(grp.ema[1]);
+	grp.ema_avg3 = (int)round(grp.ema[2]);
 
 	return 1;
 }
 
-/********************SMA calculation - end *****************************************/
+/********************EMA calculation - end *****************************************/
 
-/* return multi threaded false if at least one cpu is under utilizied */
+/*
+ * return multi threaded false if at least one cpu is under utilizied.
+ * Uses the per core type lowest loads of the last polls.
+ */
 int max_mt_detected(enum state_idx state)
 {
-	for (int t = 0; t < get_max_online_cpu(); t++) {
-		if (!cpu_applicable(t, state))
+	for (int type = P_CORE; type <= L_CORE; type++) {
+		if (!type_applicable(type, state))
 			continue;
 
-		if A_LTE_B(perf_stats[t].l0, (UTIL_LOW))
+		if A_LTE_B(type_min_load[type], (UTIL_LOW))
 			return 0;
 	}
 	return 1;
@@ -560,14 +1037,27 @@ int util_init_proxy(void)
 {
 	float dummy;
 
-	if (init_perf_calculations(get_max_online_cpu()) < 0) {
+	if (resolve_msr_pmu() != LPMD_SUCCESS) {
+		lpmd_log_error("WLT_Proxy: msr PMU events not available\n");
+		return LPMD_ERROR;
+	}
+
+	if (init_perf_calculations(get_max_cpus()) < 0) {
 		lpmd_log_error("WLT_Proxy: error initializing perf calculations");
 		return LPMD_ERROR;
 	}
 
+	if (open_all_amperf_fds() != LPMD_SUCCESS) {
+		lpmd_log_error("WLT_Proxy: no perf counters available\n");
+		uninit_perf_calculations();
+		return LPMD_ERROR;
+	}
+
+	update_state_cpus();
+
 	update_perf_diffs(&dummy, 1);
 
-	init_sma_calculations();
+	init_ema_calculations();
 
 	return LPMD_SUCCESS;
 }
@@ -1,8 +1,21 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 /* Copyright (C) 2026 Intel Corporation */
 
+#define _GNU_SOURCE
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h> //setpriority
+#include <sys/syscall.h>
+
 #include "lpmd.h" //wlt_type
 #include "state_common.h"
+#include "wlt_proxy.h"
+
+/* nice level of the sampling thread */
+#define PROXY_THREAD_NICE	10
+
+/* shorter polls catch the bursts on their own */
+#define BURST_WAKE_MIN_POLL	500
 
 /* wlt_proxy polling interval - updated at every state change */
 int next_proxy_poll = 1000;
@@ -10,23 +23,404 @@ int next_proxy_poll = 1000;
 /* wlt_proxy hint - updated at every state change */
 int wlt_type = WLT_IDLE;
 
-/* called at the configured interval to take action; return next interval and workload type*/
+/*
+ * Result of the last poll, as seen by the lpmd core thread. Published
+ * under a seqlock: the sampling side is serialized by proxy_lock, the
+ * core thread reads without blocking and retries if a poll completed
+ * while it was copying.
+ */
+struct proxy_snapshot {
+	int wlt_type;
+	int next_poll;
+	enum state_idx state;
+	struct group_util grp;
+};
+
+static struct proxy_snapshot snapshot = {
+	.wlt_type = WLT_IDLE,
+	.next_poll = 1000,
+	.state = INIT_MODE,
+};
+static unsigned int snapshot_seq;
+
+/* serializes the polls with the cpu hotplug updates */
+static pthread_mutex_t proxy_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* requests to the sampling thread, flagged in proxy_req before a kick */
+#define PROXY_REQ_POLL	(1 << 0)
+#define PROXY_REQ_CPUS	(1 << 1)
+#define PROXY_REQ_STOP	(1 << 2)
+
+/*
+ * Sampling thread: kick_fd signals requests, done_fd tells the core
+ * thread a poll completed. -1 when the polls run inline.
+ */
+static pthread_t proxy_thread;
+static int kick_fd = -1;
+static int done_fd = -1;
+static int proxy_req;
+static struct pollfd *proxy_pfds;
+
+/* cpu the sampling thread runs on, -1 if not pinned */
+static int proxy_cpu = -1;
+
+/* perf overflow wakeups between the polls are set up */
+static int burst_wake;
+
+/*
+ * Time by which the core thread asks for the next regular poll, allowing
+ * for as long again. Past it, polls are no longer requested, e.g. in the
+ * DEFAULT_ON/OFF states or frozen, and the burst wakeups are turned off.
+ */
+static uint64_t poll_due_ms;
+
+/* called with proxy_lock held */
+static void publish_snapshot(void)
+{
+	unsigned int seq = snapshot_seq;
+
+	__atomic_store_n(&snapshot_seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	snapshot.wlt_type = wlt_type;
+	snapshot.next_poll = next_proxy_poll;
+	snapshot.state = get_cur_state();
+	snapshot.grp = grp;
+
+	__atomic_store_n(&snapshot_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void read_snapshot(struct proxy_snapshot *snap)
+{
+	unsigned int seq;
+
+	do {
+		seq = __atomic_load_n(&snapshot_seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		*snap = snapshot;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (seq & 1 || seq != __atomic_load_n(&snapshot_seq, __ATOMIC_RELAXED));
+}
+
+/*
+ * Regular polls arm the burst wakeups for the next interval, a burst
+ * wakeup polls early once, the wakeups staying off until the next
+ * regular poll. The burst only adds spike time if the poll sees a cpu
+ * busy for that long, and the poll didn't count it already as a spike.
+ * Returns 0 if a wakeup was no burst and nothing was polled.
+ */
+static int proxy_poll(int burst)
+{
+	int burst_ms = 0, poll_ms;
+
+	pthread_mutex_lock(&proxy_lock);
+
+	if (burst) {
+		if (proxy_now_ms() > poll_due_ms) {
+			lpmd_log_debug("WLT_Proxy: no regular poll, burst wakeups off\n");
+			util_burst_wake_disarm();
+			burst_ms = 0;
+		} else {
+			burst_ms = util_burst_wake_check();
+		}
+		if (!burst_ms) {
+			pthread_mutex_unlock(&proxy_lock);
+			return 0;
+		}
+	}
+
+	/* the length of this poll, the state may change */
+	poll_ms = state_machine_auto();
+
+	if (burst_ms && A_LTE_B(grp.c0_max, UTIL_NEAR_FULL) &&
+	    grp.c0_max * poll_ms >= burst_ms * 100)
+		add_spike_time(burst_ms);
+
+	if (burst_wake && !burst) {
+		if (next_proxy_poll >= BURST_WAKE_MIN_POLL) {
+			poll_due_ms = proxy_now_ms() + 2 * next_proxy_poll;
+			util_burst_wake_arm();
+		} else {
+			util_burst_wake_disarm();
+		}
+	}
+
+	publish_snapshot();
+	pthread_mutex_unlock(&proxy_lock);
+
+	return 1;
+}
+
+/* first LP cpu, computed on the core thread which owns the cpumasks */
+static void update_proxy_cpu(void)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < get_max_cpus(); cpu++) {
+		if (cpumask_test_cpu(cpu, CPUMASK_LPM_DEFAULT) &&
+		    is_cpu_online(cpu))
+			break;
+	}
+
+	__atomic_store_n(&proxy_cpu, cpu < get_max_cpus() ? cpu : -1,
+			 __ATOMIC_RELAXED);
+}
+
+/*
+ * Run on a LP cpu, out of the way of the workload. When a cgroup cpuset
+ * lpmd runs in excludes that cpu, the kernel moves the thread to the
+ * cpus of the cpuset, the pinning is then only redone after cpu hotplug.
+ */
+static void proxy_thread_pin(void)
+{
+	int cpu = __atomic_load_n(&proxy_cpu, __ATOMIC_RELAXED);
+	cpu_set_t *set;
+	size_t size;
+
+	if (cpu < 0)
+		return;
+
+	set = CPU_ALLOC(get_max_cpus());
+	if (!set)
+		return;
+
+	size = CPU_ALLOC_SIZE(get_max_cpus());
+	CPU_ZERO_S(size, set);
+	CPU_SET_S(cpu, size, set);
+	if (pthread_setaffinity_np(pthread_self(), size, set))
+		lpmd_log_warn("WLT_Proxy: failed to pin the proxy thread to cpu %d\n", cpu);
+	else
+		lpmd_log_debug("WLT_Proxy: proxy thread on cpu %d\n", cpu);
+
+	CPU_FREE(set);
+}
+
+/* reopen the per-cpu counters of the cpus of the last hotplug */
+static void proxy_update_cpus(void)
+{
+	pthread_mutex_lock(&proxy_lock);
+	util_proxy_update_cpus();
+	publish_snapshot();
+	pthread_mutex_unlock(&proxy_lock);
+}
+
+static void *proxy_thread_loop(void *arg)
+{
+	int max = get_max_cpus();
+	int nr, n, i, req, burst;
+	eventfd_t val;
+
+	proxy_thread_pin();
+	if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), PROXY_THREAD_NICE))
+		lpmd_log_debug("WLT_Proxy: failed to lower the proxy thread priority\n");
+
+	for (;;) {
+		proxy_pfds[0].fd = kick_fd;
+		proxy_pfds[0].events = POLLIN;
+		proxy_pfds[0].revents = 0;
+
+		/* the burst fds change with cpu hotplug */
+		pthread_mutex_lock(&proxy_lock);
+		n = util_burst_wake_fds(proxy_pfds + 1, max);
+		pthread_mutex_unlock(&proxy_lock);
+		nr = 1 + (n < max ? n : max);
+
+		n = poll(proxy_pfds, nr, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			lpmd_log_error("WLT_Proxy: proxy thread wait failed\n");
+			break;
+		}
+
+		if (proxy_pfds[0].revents & POLLIN) {
+			eventfd_read(kick_fd, &val);
+			req = __atomic_exchange_n(&proxy_req, 0, __ATOMIC_ACQUIRE);
+			if (req & PROXY_REQ_STOP)
+				break;
+			if (req & PROXY_REQ_CPUS) {
+				proxy_update_cpus();
+				proxy_thread_pin();
+			}
+			if (!(req & PROXY_REQ_POLL))
+				continue;
+			proxy_poll(0);
+		} else {
+			/*
+			 * POLLERR/POLLHUP of a counter going away, e.g. its
+			 * cpu offlined, aren't bursts. Drop the counter until
+			 * the hotplug update reopens it, rather than spin.
+			 */
+			burst = 0;
+			pthread_mutex_lock(&proxy_lock);
+			for (i = 1; i < nr; i++) {
+				if (proxy_pfds[i].revents & POLLIN)
+					burst = 1;
+				else if (proxy_pfds[i].revents)
+					util_burst_wake_close(proxy_pfds[i].fd);
+			}
+			pthread_mutex_unlock(&proxy_lock);
+			if (!burst)
+				continue;
+
+			lpmd_log_debug("WLT_Proxy: burst wakeup\n");
+			if (!proxy_poll(1))
+				continue;
+		}
+
+		eventfd_write(done_fd, 1);
+	}
+
+	return NULL;
+}
+
+/* flag a request and wake the sampling thread up */
+static void proxy_kick(int req)
+{
+	__atomic_fetch_or(&proxy_req, req, __ATOMIC_RELEASE);
+	eventfd_write(kick_fd, 1);
+}
+
+/*
+ * Called when the lpmd polling interval expires, take action; return next
+ * interval and workload type. With the sampling thread, the poll is only
+ * requested here and the last result returned, the new one comes with
+ * wlt_proxy_event().
+ */
 int read_wlt_proxy(int *interval)
 {
-	state_machine_auto();
-	*interval = next_proxy_poll;
+	struct proxy_snapshot snap;
+
+	if (kick_fd < 0)
+		proxy_poll(0);
+	else
+		proxy_kick(PROXY_REQ_POLL);
+
+	read_snapshot(&snap);
+	*interval = snap.next_poll;
+
+	return snap.wlt_type;
+}
+
+/* called when done_fd is readable: a poll of the sampling thread completed */
+int wlt_proxy_event(int *interval)
+{
+	struct proxy_snapshot snap;
+	eventfd_t val;
+
+	eventfd_read(done_fd, &val);
+
+	read_snapshot(&snap);
+	*interval = snap.next_poll;
 
-	return wlt_type;
+	lpmd_log_debug("WLT_Proxy: hint %d, c0 max %.2f, next poll %d\n",
+		       snap.wlt_type, snap.grp.c0_max, snap.next_poll);
+
+	return snap.wlt_type;
+}
+
+/*
+ * Move the polls to a sampling thread. Returns the fd signaling completed
+ * polls to the core thread, -1 to keep polling inline.
+ */
+int wlt_proxy_start(void)
+{
+	kick_fd = eventfd(0, EFD_CLOEXEC);
+	done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	proxy_pfds = calloc(1 + get_max_cpus(), sizeof(*proxy_pfds));
+	if (kick_fd < 0 || done_fd < 0 || !proxy_pfds)
+		goto err;
+
+	/* the wakeups need the thread to wait on the perf fds */
+	if (get_lpmd_config()->wlt_proxy_burst_wake &&
+	    util_burst_wake_init() == LPMD_SUCCESS)
+		burst_wake = 1;
+
+	update_proxy_cpu();
+	proxy_req = 0;
+	if (pthread_create(&proxy_thread, NULL, proxy_thread_loop, NULL))
+		goto err;
+
+	return done_fd;
+
+err:
+	lpmd_log_warn("WLT_Proxy: no proxy thread, polling inline\n");
+	if (kick_fd >= 0)
+		close(kick_fd);
+	if (done_fd >= 0)
+		close(done_fd);
+	kick_fd = -1;
+	done_fd = -1;
+	free(proxy_pfds);
+	proxy_pfds = NULL;
+	burst_wake = 0;
+	return -1;
+}
+
+static void wlt_proxy_stop(void)
+{
+	if (kick_fd < 0)
+		return;
+
+	proxy_kick(PROXY_REQ_STOP);
+	pthread_join(proxy_thread, NULL);
+
+	close(kick_fd);
+	close(done_fd);
+	kick_fd = -1;
+	done_fd = -1;
+	free(proxy_pfds);
+	proxy_pfds = NULL;
+	burst_wake = 0;
 }
 
 /* Returns success if proxy supported on platform */
 int wlt_proxy_init(void)
 {
-	return util_init_proxy();
+	if (state_table_init() != LPMD_SUCCESS)
+		return LPMD_ERROR;
+
+	if (util_init_proxy() != LPMD_SUCCESS)
+		return LPMD_ERROR;
+
+	update_state_cpumasks();
+
+	return LPMD_SUCCESS;
 }
 
 /* make sure all resource are properly released and closed */
 void wlt_proxy_uninit(void)
 {
+	wlt_proxy_stop();
 	util_uninit_proxy();
 }
+
+/*
+ * Rebuild the mode cpumasks after cpu hotplug, those are only used on
+ * the core thread. Reopening the per-cpu counters is left to the sampling
+ * thread, so the core thread doesn't wait for a poll in flight.
+ */
+void wlt_proxy_update_cpus(void)
+{
+	update_state_cpumasks();
+
+	if (kick_fd < 0) {
+		proxy_update_cpus();
+		return;
+	}
+
+	update_proxy_cpu();
+	proxy_kick(PROXY_REQ_CPUS);
+}
+
+/* cpumask of the current proxy mode, CPUMASK_NONE if it doesn't confine */
+int wlt_proxy_cpumask(void)
+{
+	struct proxy_snapshot snap;
+
+	read_snapshot(&snap);
+
+	return get_state_cpumask(snap.state);
+}
@@ -0,0 +1,270 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2026 Intel Corporation */
+
+/*
+ * Standalone benchmark of the WLT proxy per poll counter reads, plain read()
+ * per group against one io_uring_enter() per batch, not part of the default
+ * build:
+ *	make -f Makefile.simple counter_read_bench	or	make counter_read_bench
+ *	./counter_read_bench [nr_groups ...]		default 8 16 32 64
+ *
+ * Each group has three counters read with PERF_FORMAT_GROUP, as the proxy
+ * opens them, spread over the online CPUs. The msr PMU tsc event is used
+ * when available, else the cpu-clock software event. io_uring is driven with
+ * raw syscalls, liburing is not needed. Needs the permission to open system
+ * wide events, root or a low perf_event_paranoid.
+ */
+
+#define _GNU_SOURCE
+#include <linux/perf_event.h>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#define NR_COUNTERS	3
+#define ITERS		20000
+#define WARMUP		1000
+
+/* nr, then one value per counter */
+struct group_buf {
+	uint64_t val[1 + NR_COUNTERS];
+};
+
+static int *fds;
+static struct group_buf *bufs;
+static int max_groups;
+
+static int ring_fd = -1;
+static unsigned int *sq_tail, *sq_mask, *sq_array;
+static unsigned int *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int msr_pmu_type(void)
+{
+	FILE *filep;
+	int type;
+
+	filep = fopen("/sys/bus/event_source/devices/msr/type", "r");
+	if (!filep)
+		return -1;
+	if (fscanf(filep, "%d", &type) != 1)
+		type = -1;
+	fclose(filep);
+	return type;
+}
+
+static int open_event(struct perf_event_attr *attr, int cpu, int group_fd)
+{
+	return syscall(SYS_perf_event_open, attr, -1, cpu, group_fd, 0);
+}
+
+static int open_groups(int nr_groups)
+{
+	struct perf_event_attr attr;
+	int nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int type = msr_pmu_type();
+	int i, j;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.read_format = PERF_FORMAT_GROUP;
+	if (type >= 0) {
+		attr.type = type;
+		attr.config = 0;	/* tsc */
+	} else {
+		attr.type = PERF_TYPE_SOFTWARE;
+		attr.config = PERF_COUNT_SW_CPU_CLOCK;
+	}
+
+	printf("Up to %d groups of %d %s events on %d cpus\n", nr_groups,
+	       NR_COUNTERS, type >= 0 ? "msr/tsc" : "cpu-clock", nr_cpus);
+
+	for (i = 0; i < nr_groups; i++) {
+		fds[i] = open_event(&attr, i % nr_cpus, -1);
+		if (fds[i] < 0)
+			goto err;
+		for (j = 1; j < NR_COUNTERS; j++) {
+			if (open_event(&attr, i % nr_cpus, fds[i]) < 0)
+				goto err;
+		}
+	}
+	return 0;
+
+err:
+	perror("perf_event_open");
+	return -1;
+}
+
+static int ring_init(unsigned int entries)
+{
+	struct io_uring_params p;
+	size_t sq_size, cq_size;
+	char *ring;
+
+	memset(&p, 0, sizeof(p));
+	ring_fd = syscall(SYS_io_uring_setup, entries, &p);
+	if (ring_fd < 0) {
+		perror("io_uring_setup");
+		return -1;
+	}
+
+	/* One mapping for both rings, IORING_FEAT_SINGLE_MMAP */
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_size > sq_size)
+		sq_size = cq_size;
+
+	ring = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		    ring_fd, IORING_OFF_SQ_RING);
+	if (ring == MAP_FAILED)
+		goto err;
+
+	sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		    ring_fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		goto err;
+
+	sq_tail = (unsigned int *)(ring + p.sq_off.tail);
+	sq_mask = (unsigned int *)(ring + p.sq_off.ring_mask);
+	sq_array = (unsigned int *)(ring + p.sq_off.array);
+	cq_head = (unsigned int *)(ring + p.cq_off.head);
+	cq_tail = (unsigned int *)(ring + p.cq_off.tail);
+	cq_mask = (unsigned int *)(ring + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+	return 0;
+
+err:
+	perror("io_uring mmap");
+	return -1;
+}
+
+static int read_plain(int nr_groups)
+{
+	int i;
+
+	for (i = 0; i < nr_groups; i++) {
+		if (read(fds[i], &bufs[i], sizeof(bufs[i])) != sizeof(bufs[i]))
+			return -1;
+	}
+	return 0;
+}
+
+static int read_ring(int nr_groups)
+{
+	unsigned int tail = *sq_tail, head, done = 0;
+	int i;
+
+	for (i = 0; i < nr_groups; i++) {
+		unsigned int idx = tail++ & *sq_mask;
+		struct io_uring_sqe *sqe = &sqes[idx];
+
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = fds[i];
+		sqe->addr = (uintptr_t)&bufs[i];
+		sqe->len = sizeof(bufs[i]);
+		sqe->user_data = i;
+		sq_array[idx] = idx;
+	}
+	__atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+	if (syscall(SYS_io_uring_enter, ring_fd, nr_groups, nr_groups,
+		    IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+		return -1;
+
+	head = *cq_head;
+	while (done < (unsigned int)nr_groups) {
+		while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+			if (cqes[head & *cq_mask].res != sizeof(bufs[0]))
+				return -1;
+			head++;
+			done++;
+		}
+		if (done < (unsigned int)nr_groups &&
+		    syscall(SYS_io_uring_enter, ring_fd, 0, nr_groups - done,
+			    IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+			return -1;
+	}
+	__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static int bench(const char *name, int (*read_fn)(int), int nr_groups)
+{
+	double start;
+	int it;
+
+	for (it = 0; it < WARMUP; it++) {
+		if (read_fn(nr_groups))
+			goto err;
+	}
+
+	start = now_ns();
+	for (it = 0; it < ITERS; it++) {
+		if (read_fn(nr_groups))
+			goto err;
+	}
+	printf("  %-28s %10.0f ns/poll\n", name, (now_ns() - start) / ITERS);
+	return 0;
+
+err:
+	fprintf(stderr, "%s: read of %d groups failed\n", name, nr_groups);
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	static const int defaults[] = { 8, 16, 32, 64 };
+	int sizes[64];
+	int i, n, ret = 0;
+
+	n = argc > 1 ? argc - 1 : (int)(sizeof(defaults) / sizeof(defaults[0]));
+	if (n > (int)(sizeof(sizes) / sizeof(sizes[0]))) {
+		fprintf(stderr, "Too many group counts\n");
+		return 1;
+	}
+
+	for (i = 0; i < n; i++) {
+		sizes[i] = argc > 1 ? atoi(argv[i + 1]) : defaults[i];
+		/* The io_uring SQ holds at most 4096 entries */
+		if (sizes[i] < 1 || sizes[i] > 4096) {
+			fprintf(stderr, "Invalid group count: %d\n", sizes[i]);
+			return 1;
+		}
+		if (sizes[i] > max_groups)
+			max_groups = sizes[i];
+	}
+
+	fds = calloc(max_groups, sizeof(*fds));
+	bufs = calloc(max_groups, sizeof(*bufs));
+	if (!fds || !bufs)
+		return 1;
+
+	if (open_groups(max_groups) || ring_init(max_groups))
+		return 1;
+
+	for (i = 0; i < n; i++) {
+		printf("%d groups\n", sizes[i]);
+		ret |= bench("read()", read_plain, sizes[i]);
+		ret |= bench("io_uring_enter()", read_ring, sizes[i]);
+	}
+
+	return ret;
+}
@@ -0,0 +1,187 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2026 Intel Corporation */
+
+/*
+ * Standalone benchmark of the cpumask operations in lpmd_cpumask.c, not
+ * part of the default build:
+ *	make -f Makefile.simple cpumask_bench	or	make cpumask_bench
+ *	./cpumask_bench [nr_cpus ...]		multiples of 8, default 64 512 4096
+ *
+ * The mask size is fixed once per process, so each CPU count runs in a
+ * child. All CPUs are online, SMT siblings are pairs of CPUs. The results
+ * of the string conversions are checked as well, a mismatch fails.
+ */
+
+#define _GNU_SOURCE
+#include <sys/wait.h>
+#include <time.h>
+
+#include "lpmd.h"
+
+/* Only the cpumask code is linked, provide what it uses from the rest */
+int get_cpu_core_id(int cpu)
+{
+	return cpu / 2;
+}
+
+int is_wildcard(char *str)
+{
+	return 0;
+}
+
+char *user_cpumask_idx_to_state_name(enum cpumask_idx idx)
+{
+	return "bench";
+}
+
+static volatile int sink;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+#define BENCH(name, iters, body)						\
+	do {									\
+		double start = now_ns();					\
+		for (int it = 0; it < (iters); it++) {				\
+			body;							\
+		}								\
+		printf("  %-28s %10.1f ns\n", name, (now_ns() - start) / (iters));	\
+	} while (0)
+
+static int check_str(const char *what, const char *got, const char *expect)
+{
+	if (got && !strcmp(got, expect))
+		return 0;
+
+	fprintf(stderr, "%s: got \"%s\", expected \"%s\"\n", what,
+		got ? got : "(null)", expect);
+	return 1;
+}
+
+static int bench(int nr_cpus)
+{
+	int iters = 20000000 / nr_cpus;
+	char list[64], buf[64], expect[64];
+	int a, b, c, cpu, n, ret = 0;
+
+	set_max_cpus(nr_cpus);
+	for (cpu = 0; cpu < nr_cpus; cpu++)
+		cpumask_add_cpu(cpu, CPUMASK_ONLINE);
+
+	a = cpumask_alloc();
+	b = cpumask_alloc();
+	if (a == CPUMASK_NONE || b == CPUMASK_NONE)
+		return 1;
+
+	/* two ranges, as in a state ActiveCPUs */
+	snprintf(list, sizeof(list), "0-%d,%d-%d", nr_cpus / 4 - 1,
+		 nr_cpus / 2, nr_cpus - 1);
+
+	printf("%d cpus\n", nr_cpus);
+
+	BENCH("cpumask_add_cpu (all)", iters / nr_cpus + 1,
+	      cpumask_reset(a);
+	      for (cpu = 0; cpu < nr_cpus; cpu++)
+		      cpumask_add_cpu(cpu, a));
+
+	BENCH("cpumask_init_cpus", iters / 16 + 1,
+	      strcpy(buf, list);
+	      cpumask_reset(a);
+	      cpumask_init_cpus(buf, a));
+
+	BENCH("cpumask_copy", iters,
+	      cpumask_copy(CPUMASK_ONLINE, b));
+
+	BENCH("cpumask_exclude_copy", iters,
+	      cpumask_exclude_copy(CPUMASK_ONLINE, b, a));
+
+	BENCH("cpumask_equal", iters,
+	      sink += cpumask_equal(a, b));
+
+	BENCH("cpumask_nr_cpus", iters,
+	      sink += cpumask_nr_cpus(a));
+
+	BENCH("cpumask_next (walk)", iters / 16 + 1,
+	      for (cpu = cpumask_next(0, a); cpu >= 0; cpu = cpumask_next(cpu + 1, a))
+		      sink++);
+
+	/* change the mask each time, so the renderings aren't cached */
+	BENCH("get_cpus_str", iters / 16 + 1,
+	      cpumask_clear_cpu(it & 1, a);
+	      cpumask_add_cpu(it & 1, a);
+	      sink += !!get_cpus_str(a));
+
+	BENCH("get_cpus_hexstr", iters / 16 + 1,
+	      cpumask_clear_cpu(it & 1, a);
+	      cpumask_add_cpu(it & 1, a);
+	      sink += !!get_cpus_hexstr(a));
+
+	BENCH("get_cgroup_systemd_vals", iters / 16 + 1,
+	      cpumask_clear_cpu(it & 1, a);
+	      cpumask_add_cpu(it & 1, a);
+	      sink += !!get_cgroup_systemd_vals(a, &n));
+
+	BENCH("get_cpus_str (cached)", iters,
+	      sink += !!get_cpus_str(a));
+
+	BENCH("cpumask_intern", iters / 16 + 1,
+	      c = cpumask_alloc();
+	      cpumask_copy(a, c);
+	      cpumask_free(cpumask_intern(c)));
+
+	strcpy(buf, list);
+	cpumask_reset(a);
+	cpumask_init_cpus(buf, a);
+	ret |= check_str("get_cpus_str", get_cpus_str(a), list);
+
+	cpumask_exclude_copy(CPUMASK_ONLINE, b, a);
+	snprintf(expect, sizeof(expect), "%d-%d", nr_cpus / 4, nr_cpus / 2 - 1);
+	ret |= check_str("cpumask_exclude_copy", get_cpus_str(b), expect);
+
+	if (cpumask_nr_cpus(a) != nr_cpus * 3 / 4) {
+		fprintf(stderr, "cpumask_nr_cpus: got %d, expected %d\n",
+			cpumask_nr_cpus(a), nr_cpus * 3 / 4);
+		ret = 1;
+	}
+
+	cpumask_free(a);
+	cpumask_free(b);
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	static const int defaults[] = { 64, 512, 4096 };
+	int i, n, status, ret = 0;
+	pid_t pid;
+
+	n = argc > 1 ? argc - 1 : (int)(sizeof(defaults) / sizeof(defaults[0]));
+
+	for (i = 0; i < n; i++) {
+		int nr_cpus = argc > 1 ? atoi(argv[i + 1]) : defaults[i];
+
+		if (nr_cpus < 8 || nr_cpus % 8) {
+			fprintf(stderr, "Invalid CPU count: %d\n", nr_cpus);
+			return 1;
+		}
+
+		fflush(stdout);
+		pid = fork();
+		if (pid < 0)
+			return 1;
+		if (!pid)
+			exit(bench(nr_cpus));
+
+		if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status))
+			ret = 1;
+	}
+
+	return ret;
+}
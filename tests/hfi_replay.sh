@@ -0,0 +1,43 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-2.0-or-later
+# Copyright (C) 2026 Intel Corporation
+#
+# Replay each HFI fixture trace, NAME.txt, with the fixture configuration
+# and compare the transitions with the expected ones in NAME.expected. The
+# event rate and the log lines depend on the machine and are left out.
+#
+# Usage: hfi_replay.sh [path to intel_lpmd], default ./intel_lpmd
+
+lpmd=${1:-./intel_lpmd}
+dir=$(dirname "$0")/hfi_replay
+ret=0
+
+if [ ! -x "$lpmd" ]
+then
+	echo "Can't run $lpmd"
+	exit 1
+fi
+
+for trace in "$dir"/*.txt
+do
+	name=$(basename "$trace" .txt)
+
+	if ! "$lpmd" --hfi-replay="$trace" --hfi-replay-config="$dir/config.xml" > hfi_replay.out
+	then
+		cat hfi_replay.out
+		echo "FAIL: $name, replay failed"
+		ret=1
+		continue
+	fi
+
+	if grep -v -e '^rate:' -e '^\[[0-9]*\]' hfi_replay.out | diff -u "$dir/$name.expected" -
+	then
+		echo "PASS: $name"
+	else
+		echo "FAIL: $name"
+		ret=1
+	fi
+done
+
+rm -f hfi_replay.out
+exit $ret
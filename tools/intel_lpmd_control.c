@@ -24,6 +24,7 @@ int main(int argc, char **argv)
 	g_autoptr(GVariant) result = NULL;
 	GError *error = NULL;
 	const gchar *state;
+	guint32 updates, applied, absorbed, dropped, resyncs;
 
 	if (geteuid()) {
 		g_warning("Must run as root");
@@ -33,7 +34,7 @@ int main(int argc, char **argv)
 	if (argc < 2) {
 		fprintf(stderr, "intel_lpmd_control: missing control command\n");
 		fprintf(stderr, "syntax:\n");
-		fprintf(stderr, "intel_lpmd_control ON|OFF|AUTO|STATUS\n");
+		fprintf(stderr, "intel_lpmd_control ON|OFF|AUTO|STATUS|HFI_STATS\n");
 		exit(0);
 	}
 
@@ -65,6 +66,31 @@ int main(int argc, char **argv)
 		return 0;
 	}
 
+	if (!strncmp(argv[1], "HFI_STATS", 9)) {
+		result = g_dbus_connection_call_sync(connection,
+						     INTEL_LPMD_SERVICE_NAME,
+						     INTEL_LPMD_SERVICE_OBJECT_PATH,
+						     INTEL_LPMD_SERVICE_INTERFACE,
+						     "GetHfiStats",
+						     NULL,
+						     G_VARIANT_TYPE("(uuuuu)"),
+						     G_DBUS_CALL_FLAGS_NONE,
+						     -1,
+						     NULL,
+						     &error);
+
+		if (error) {
+			g_warning("Fail on connecting lpmd: %s", error->message);
+			exit(1);
+		}
+
+		g_variant_get(result, "(uuuuu)", &updates, &applied, &absorbed, &dropped, &resyncs);
+		g_print("updates:%u applied:%u absorbed:%u dropped:%u resyncs:%u\n",
+			updates, applied, absorbed, dropped, resyncs);
+
+		return 0;
+	}
+
 	if (!strncmp(argv[1], "ON", 2)) {
 		command = g_string_new("LPM_FORCE_ON");
 	} else if (!strncmp(argv[1], "OFF", 3)) {